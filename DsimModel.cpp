@@ -1,1534 +1,140 @@
 #include "StdAfx.h"
 #include "DsimModel.h"
+#include <ctype.h>
+#include <stdarg.h>
 
-int hold_state = 0; // set to 1 to hold execution state, used for unnecessarily time consuming instructions
+static inline UINT BitCount(DWORD x) {
+	UINT n = 0;
 
-int instr_x, instr_y, instr_z, instr_p, instr_q;
-int instr_pre = 0; // instruction prefix (REMEMBER TO RESET TO 0 AFTER EXECUTING ANY PREFIXED INSTRUCTIONS!)
-
-volatile unsigned long long int z80_clk = 0; // cycle counter
-int z80_up = 0; // set to 1 after reset, activates Z80 ops
-
-void DsimModel::HIZAddr(ABSTIME time) {						// Sets the address bus to HIZ
-	int i;
-
-	for (i = 0; i < 16; i++) {
-		pin_A[i]->SetFloat;
-	}
+	for (; x; x &= x - 1) n++;
+	return n;
 }
 
-void DsimModel::HIZData(ABSTIME time) {						// Sets the data bus to HIZ
-	int i;
+VOID DsimBus::Account(DWORD last, DWORD val, UINT width) {	// Counts the bus pins a drive changes
+	UINT n = (last > 0xFFFF) ? width : BitCount(last ^ val);
 
-	for (i = 0; i < 8; i++) {
-		pin_D[i]->SetFloat;
-	}
+	issued += n;
+	suppressed += width - n;
 }
 
-void DsimModel::SetAddr(UINT16 val, ABSTIME time) {			// Sets an address onto the address bus
-	int i, j;
-
-	for (i = 0; i < 16; i++) {
-		j = (val >> i) & 0x01;
-		if (j) {
-			pin_A[i]->SetHigh;
-		} else {
-			pin_A[i]->SetLow;
-		}
+VOID DsimBus::HIZAddr(ABSTIME time) {						// Sets the address bus to HIZ
+	if (drv_A == SHADOW_FLT) {
+		suppressed += 16;
+		return;
 	}
+	drv_A = SHADOW_FLT;
+	issued += 16;
+	bus_A->drivetristate(time);
 }
 
-void DsimModel::SetData(UINT8 val, ABSTIME time) {			// Sets a value onto the data bus
-	int i, j;
-
-	for (i = 0; i < 8; i++) {
-		j = (val >> i) & 0x01;
-		if (j) {
-			pin_D[i]->SetHigh;
-		} else {
-			pin_D[i]->SetLow;
-		}
+VOID DsimBus::HIZData(ABSTIME time) {						// Sets the data bus to HIZ
+	if (drv_D == SHADOW_FLT) {
+		suppressed += 8;
+		return;
 	}
+	drv_D = SHADOW_FLT;
+	issued += 8;
+	bus_D->drivetristate(time);
 }
 
-UINT8 DsimModel::GetData(void) {							// Reads a value from the data bus
-	int i;
-	UINT8 val = 0;
-
-	for (i = 0; i < 8; i++) {
-		if (ishigh(pin_D[i]->istate()))
-			val |= (1 << i);
-	}
-	return(val);
-}
-
-void DsimModel::ResetCPU(ABSTIME time) {					// Rests the CPU
-	int i;
-
-#ifdef DEBUGCALLS
-	InfoLog("Resetting CPU...");
-#endif
-
-	// zeroes all the flags
-	cycle = 0;
-	nextcycle = 0;
-	state = 0;
-	step = 0;
-	IsHalted = 0;
-	IsWaiting = 0;
-	IsBusRQ = 0;
-	IsInt = 0;
-	IsNMI = 0;
-
-	// zeroes all the registers
-	for (i = 0; i < REGSIZE; i++)
-		reg.ARRAY[i] = 0;
-
-	// sets all output pins to high
-	pin_M1->SetHigh;
-	pin_MREQ->SetHigh;
-	pin_IORQ->SetHigh;
-	pin_RD->SetHigh;
-	pin_WR->SetHigh;
-	pin_RFSH->SetHigh;
-	pin_HALT->SetHigh;
-	pin_BUSAK->SetHigh;
+VOID DsimBus::Release(ABSTIME time) {						// Floats the buses and their strobes, and acknowledges with BUSAK
+	static const Z80PINS strobes[] = { PIN_MREQ, PIN_IORQ, PIN_RD, PIN_WR };
 
 	HIZAddr(time);
 	HIZData(time);
-}
-
-/* condition checks */
-int DsimModel::chk_nz(void) {
-	return ((reg.F & (1 << FLG_Z)) ? 0 : 1);
-}
-int DsimModel::chk_z(void) {
-	return ((reg.F & (1 << FLG_Z)) ? 1 : 0);
-}
-int DsimModel::chk_nc(void) {
-	return ((reg.F & (1 << FLG_C)) ? 0 : 1);
-}
-int DsimModel::chk_c(void) {
-	return ((reg.F & (1 << FLG_C)) ? 1 : 0);
-}
-int DsimModel::chk_po(void) {
-	return ((reg.F & (1 << FLG_PV)) ? 0 : 1);
-}
-int DsimModel::chk_pe(void) {
-	return ((reg.F & (1 << FLG_PV)) ? 1 : 0);
-}
-int DsimModel::chk_p(void) {
-	return ((reg.F & (1 << FLG_S)) ? 0 : 1);
-}
-int DsimModel::chk_m(void) {
-	return ((reg.F & (1 << FLG_S)) ? 0 : 1);
-}
-int DsimModel::cc(int n) {
-	switch (n) {
-	case 0: return chk_nz();
-	case 1: return chk_z();
-	case 2: return chk_nc();
-	case 3: return chk_c();
-	case 4: return chk_po();
-	case 5: return chk_pe();
-	case 6: return chk_p();
-	case 7: return chk_m();
-	default: return 0;
+	for (UINT i = 0; i < sizeof(strobes) / sizeof(strobes[0]); i++) {
+		out_known &= ~(1 << strobes[i]);					// Driven again by the next SetHigh()
+		issued++;
+		pin_out[strobes[i]]->setstate(time, 1, FLT);
 	}
+	SetLow(PIN_BUSAK, time);
 }
 
-void DsimModel::opflags(int n, int is16, int c, int p, int v, int z, int s, int f35) {
-	if (c) {
-		if (is16 && (UINT32) n > 65535) reg.F |= (1 << FLG_C);
-		else if (!is16 && (UINT32) n > 255)  reg.F |= (1 << FLG_C);
-		else reg.F &= ~(1 << FLG_C);
-	}
-	if (p) {
-		int b = 0;
-		for (int i = ((is16) ? 15 : 7); i >= 0; i--) {
-			if (n & (1 << i)) b ^= 1;
-		}
-		if(b) reg.F |= (1 << FLG_PV);
-		else reg.F &= ~(1 << FLG_PV);
-	}
-	if (v) {
-		int n2 = n & ((is16) ? 0xFFFF : 0xFF);
-		if (is16 && n2 > 65535) reg.F |= (1 << FLG_PV);
-		else if (!is16 && n2 > 255)  reg.F |= (1 << FLG_PV);
-		else reg.F &= ~(1 << FLG_PV);
-	}
-	if (z) {
-		if (!n) reg.F |= (1 << FLG_Z);
-		else reg.F &= ~(1 << FLG_Z);
-	}
-	if (s) {
-		int n2;
-		if (is16) n2 = (INT16)n;
-		else n2 = (INT8)n;
-		if (n2 < 0) reg.F |= (1 << FLG_S);
-		else reg.F &= ~(1 << FLG_S);
-	}
-	if (f35) {
-		reg.F &= ~((1 << FLG_F3) | (1 << FLG_F5));
-		reg.F |= n & ((1 << FLG_F3) | (1 << FLG_F5));
-	}
+VOID DsimBus::Reclaim(ABSTIME time) {						// Takes the bus back, the address is driven by the cycle that resumes
+	SetHigh(PIN_MREQ, time);
+	SetHigh(PIN_IORQ, time);
+	SetHigh(PIN_RD, time);
+	SetHigh(PIN_WR, time);
+	SetHigh(PIN_BUSAK, time);
 }
 
-/* ALU operations */
-void DsimModel::alu(int n, UINT8 r) {
-	int t;
-	switch (n) {
-	case 0: // ADD A,
-		t = reg.A + r;
-		opflags(t, 0, 1, 0, 1, 1, 1, 1);
-		reg.F &= ~(1 << FLG_N);
-		break;
-	case 1: // ADC A,
-		t = reg.A + r + chk_c();
-		opflags(t, 0, 1, 0, 1, 1, 1, 1);
-		reg.F &= ~(1 << FLG_N);
-		break;
-	case 2: // SUB
-		t = reg.A - r;
-		opflags(t, 0, 1, 0, 1, 1, 1, 1);
-		reg.F |= (1 << FLG_N);
-		break;
-	case 3: // SBC A,
-		t = reg.A - r - chk_c();
-		opflags(t, 0, 1, 0, 1, 1, 1, 1);
-		reg.F |= (1 << FLG_N);
-		break;
-	case 4: // AND
-		t = reg.A & r;
-		opflags(t, 0, 0, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_C));
-		reg.F |= (1 << FLG_H);
-		break;
-	case 5: // XOR
-		t = reg.A ^ r;
-		opflags(t, 0, 0, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_C));
-		reg.F &= ~(1 << FLG_H);
-		break;
-	case 6: // OR
-		t = reg.A | r;
-		opflags(t, 0, 0, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_C));
-		reg.F &= ~(1 << FLG_H);
-		break;
-	case 7: // CP
-		t = reg.A - r;
-		opflags(t, 0, 1, 0, 1, 1, 1, 0);
-		reg.F |= (1 << FLG_N);
-		reg.F &= ~((1 << FLG_F3) | (1 << FLG_F5));
-		reg.F |= r & ((1 << 3) | (1 << 5));
-		break;
-	default: break;
-	}
-	if (n != 7) reg.A = (UINT8) t;
+VOID DsimBus::SetAddr(UINT16 val, ABSTIME time) {			// Sets an address onto the address bus
+	Account(drv_A, val, 16);
+	if (drv_A == val) return;
+	drv_A = val;
+	bus_A->drivebusvalue(time, val);
 }
 
-/* rotation/shift operations */
-void DsimModel::rot(int n, UINT8 *r) {
-	int t;
-	switch (n) {
-	case 0: // RLC
-		t = *r << 1;
-		t |= (t >> 8) & 1;
-		if(r == &reg.A) opflags(t, 0, 1, 0, 0, 0, 0, 1);
-		else opflags(t, 0, 1, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_H));
-		break;
-	case 1: // RRC
-		t = *r >> 1;
-		if (*r & 1) t |= (1 << 7) | (1 << 8);
-		else t &= ~((1 << 7) | (1 << 8));
-		if (r == &reg.A) opflags(t, 0, 1, 0, 0, 0, 0, 1);
-		else opflags(t, 0, 1, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_H));
-		break;
-	case 2: // RL
-		t = *r << 1;
-		t |= reg.F & (1 << FLG_C);
-		if (r == &reg.A) opflags(t, 0, 1, 0, 0, 0, 0, 1);
-		else opflags(t, 0, 1, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_H));
-		break;
-	case 3: // RR
-		t = *r >> 1;
-		t |= (reg.F & (1 << FLG_C)) << 7;
-		if (*r & 1) t |= (1 << 8);
-		else t &= ~(1 << 8);
-		if (r == &reg.A) opflags(t, 0, 1, 0, 0, 0, 0, 1);
-		else opflags(t, 0, 1, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_H));
-		break;
-	case 4: // SLA
-		t = *r << 1;
-		opflags(t, 0, 1, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_H));
-		break;
-	case 5: // SRA
-		t = *r >> 1;
-		t |= ((*r & 1) << 8) | (*r & (1 << 7));
-		opflags(t, 0, 1, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_H));
-		break;
-	case 6: // SLL
-		t = *r << 1;
-		t |= 1;
-		opflags(t, 0, 1, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_H));
-		break;
-	case 7: // SRL
-		t = *r >> 1;
-		t |= ((*r & 1) << 8);
-		opflags(t, 0, 1, 1, 0, 1, 1, 1);
-		reg.F &= ~((1 << FLG_N) | (1 << FLG_H));
-		break;
-	}
-	*r = (UINT8)t;
+VOID DsimBus::SetData(UINT8 val, ABSTIME time) {			// Sets a value onto the data bus
+	Account(drv_D, val, 8);
+	if (drv_D == val) return;
+	drv_D = val;
+	bus_D->drivebusvalue(time, val);
 }
 
-/* test bit */
-void DsimModel::bit(int b, UINT8 *r) {
-	opflags(*r, 0, 0, 0, 0, 0, 0, 1);
-	if (*r & (1 << b)) reg.F &= ~((1 << FLG_Z) | (1 << FLG_PV));
-	else reg.F |= ((1 << FLG_Z) | (1 << FLG_PV));
-	if (b == 7 && (*r & (1 << b))) reg.F |= (1 << FLG_S);
+UINT8 DsimBus::GetData(void) {								// Reads a value from the data bus
+	return (UINT8)bus_D->getbusvalue();
 }
 
-/* 16bit addition routine */
-void DsimModel::add16(UINT16 *a, UINT16 *b, int c) {
-	int t = *a + *b;
-	if (c) {
-		t += chk_c();
-		opflags(t, 1, 1, 0, 0, 1, 1, 0);
-	} else opflags(t, 1, 1, 0, 0, 0, 0, 0);
-	reg.F &= ~((1 << FLG_F3) | (1 << FLG_F5) | (1 << FLG_N));
-	reg.F |= (t & ((1 << 11) | (1 << 13))) >> 8;
-	*a = (UINT16)t;
+VOID DsimBus::Log(const char *s) {							// Prints a numbered line on the debug popup
+	sprintf_s(LogLineT, "%05d: ", LogLine++);
+	myPopup->print(LogLineT);
+	myPopup->print((CHAR *)s);
+	myPopup->print("\n");
 }
 
-int done = 0;// Indicates done executing
-
-void DsimModel::Execute(void) {								// Executes an instruction
-	/* algorithmic instruction decode mechanism */
-	UINT8 *tab_r[8] = { &reg.B, &reg.C, &reg.D, &reg.E, &reg.H, &reg.L, NULL /* (HL) */, &reg.A };
-	UINT16 *tab_rp[4] = { &reg.BC, &reg.DE, &reg.HL, &reg.SP };
-	UINT16 *tab_rp2[4] = { &reg.BC, &reg.DE, &reg.HL, &reg.AF };
-#ifdef DEBUGCALLS
-	char *disp_r[8] = { "B", "C", "D", "E", "H", "L", "(HL)", "A" };
-	char *disp_rp[4] = { "BC", "DE", "HL", "SP" };
-	char *disp_rp2[4] = { "BC", "DE", "HL", "AF" };
-	sprintf_s(LogMessage, "    Executing 0x%02x step %d...", InstR, step);
-	InfoLog(LogMessage);
-#endif
-	int t = 0; // general purpose temp variable
-	switch (instr_pre) {
-	case 0xCB: // CB prefixed
-		switch (instr_x) {
-		case 0: // rot[y] r[z]
-			if (instr_z == 6) { // (HL)
-				switch (step++) {
-				case 1:
-					cycle = READ;
-					Addr = reg.HL;
-					break;
-				case 2:
-					cycle = EXEC;
-					hold_state = 1;
-					rot(instr_y, &Data);
-					break;
-				case 4:
-					cycle = WRITE;
-					hold_state = 0;
-					Addr = reg.HL;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        (0x%04x)=0x%02x", Addr, Data);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					instr_pre = 0;
-					break;
-				}
-			}
-			else {
-				rot(instr_y, tab_r[instr_z]);
-				done++;
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "        %s=0x%02x", disp_r[instr_z], *tab_r[instr_z]);
-				InfoLog(LogMessage);
-#endif
-				instr_pre = 0;
-			}
-			break;
-		case 1: // BIT y, r[z]
-			if (instr_z == 6) {
-				switch (step++) {
-				case 1:
-					cycle = READ;
-					Addr = reg.HL;
-					break;
-				case 2:
-					bit(instr_y, &Data);
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        (0x%04x)=0x%02x", Addr, Data);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					instr_pre = 0;
-					break;
-				}
-			}
-			else {
-				bit(instr_y, tab_r[instr_z]);
-				done++;
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "        %s=0x%02x", disp_r[instr_z], *tab_r[instr_z]);
-				InfoLog(LogMessage);
-#endif
-				instr_pre = 0;
-			}
-			break;
-		case 2: // RES y, r[z]
-			if (instr_z == 6) {
-				switch (step++) {
-				case 1:
-					cycle = READ;
-					Addr = reg.HL;
-					break;
-				case 2:
-					cycle = EXEC;
-					hold_state = 1;
-					Data &= ~(1 << instr_y);
-					break;
-				case 4:
-					cycle = WRITE;
-					hold_state = 0;
-					Addr = reg.HL;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        (0x%04x)=0x%02x", Addr, Data);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					instr_pre = 0;
-					break;
-				}
-			}
-			else {
-				*tab_r[instr_z] &= ~(1 << instr_y);
-				done++;
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "        %s=0x%02x", disp_r[instr_z], *tab_r[instr_z]);
-				InfoLog(LogMessage);
-#endif
-				instr_pre = 0;
-			}
-			break;
-		case 3: // SET y, r[z]
-			if (instr_z == 6) {
-				switch (step++) {
-				case 1:
-					cycle = READ;
-					Addr = reg.HL;
-					break;
-				case 2:
-					cycle = EXEC;
-					hold_state = 1;
-					Data |= (1 << instr_y);
-					break;
-				case 4:
-					cycle = WRITE;
-					hold_state = 0;
-					Addr = reg.HL;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        (0x%04x)=0x%02x", Addr, Data);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					instr_pre = 0;
-					break;
-				}
-			}
-			else {
-				*tab_r[instr_z] |= (1 << instr_y);
-				done++;
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "        %s=0x%02x", disp_r[instr_z], *tab_r[instr_z]);
-				InfoLog(LogMessage);
-#endif
-				instr_pre = 0;
-			}
-			break;
-		}
-		break;
-	case 0xED: // ED prefixed
-		switch (instr_x) {
-		case 1:
-			switch (instr_z) {
-			case 0: // IN r[y], (C) / IN (C) 
-				switch (step++) {
-				case 1:
-					cycle = IOREAD;
-					Addr = reg.C;
-					break;
-				case 2:
-					if (instr_y != 6) *tab_r[instr_y] = Data;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        IO (0x%02x)=0x%02x", reg.C, Data);
-					InfoLog(LogMessage);
-#endif
-					opflags(Data, 0, 0, 1, 0, 1, 1, 1);
-					reg.F &= ~(1 << FLG_N);
-					done++;
-					instr_pre = 0;
-					break;
-				}
-				break;
-			case 1: // OUT (C), r[y]/0
-				switch (step++) {
-				case 1:
-					cycle = IOWRITE;
-					Addr = reg.C;
-					Data = (instr_y == 6) ? 0 : *tab_r[instr_y];
-					break;
-				case 2:
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        IO (0x%02x)=0x%02x", reg.C, Data);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					instr_pre = 0;
-					break;
-				}
-				break;
-			}
-			break;
-		}
-		break;
-	default: // unprefixed
-		switch (instr_x) {
-		case 0:
-			switch (instr_z) {
-			case 0:
-				switch (instr_y) {
-				case 0: // NOP
-					done++;
-					break;
-				case 1: // EX AF, AF'
-					t = reg.AF;
-					reg.AF = reg.AF_;
-					reg.AF_ = t;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        AF=0x%04x AF'=0x%04x", reg.AF, reg.AF_);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				case 2: // DJNZ *
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.PC++;
-						break;
-					case 2:
-						reg.L = Data;
-						cycle = EXEC;
-						hold_state = 1;
-						reg.B--;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        B=0x%02x", reg.B);
-						InfoLog(LogMessage);
-#endif
-						break;
-					case 4:
-						if (!reg.B) {
-							hold_state = 0;
-							done++;
-						}
-						break;
-					case 5:
-						reg.PC += (INT8)reg.L - 2;
-						break;
-					case 14:
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        PC=0x%04x", reg.PC);
-						InfoLog(LogMessage);
-#endif
-						hold_state = 0;
-						done++;
-						break;
-					default:
-						break;
-					}
-					break;
-				case 3: // JR *
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.PC++;
-						break;
-					case 2:
-						reg.PC += (INT8)Data - 2;
-						cycle = EXEC;
-						hold_state = 1;
-						break;
-					case 12:
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        PC=0x%04x", reg.PC);
-						InfoLog(LogMessage);
-#endif
-						hold_state = 0;
-						break;
-					}
-					break;
-				default: // JR cond, *
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.PC++;
-						break;
-					case 2:
-						reg.L = Data;
-						if (!cc(instr_y - 4)) done++;
-						else {
-							cycle = EXEC;
-							hold_state = 1;
-						}
-						break;
-					case 12:
-						reg.PC += (INT8)reg.L - 2;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        PC=0x%04x", reg.PC);
-						InfoLog(LogMessage);
-#endif
-						hold_state = 0;
-						break;
-					}
-					break;
-				}
-				break;
-			case 1:
-				switch (instr_q) {
-				case 0: // LD rp[p], **
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.PC++;
-						break;
-					case 2:
-						reg.Z = Data;
-						Addr = reg.PC++;
-						break;
-					case 3:
-						reg.W = Data;
-						*tab_rp[instr_p] = reg.WZ;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        %s=0x%04x", disp_rp[instr_p], *tab_rp[instr_p]);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					}
-					break;
-				case 1: // ADD HL, rp[p]
-					switch (step++) {
-					case 1:
-						add16(&reg.HL, tab_rp[instr_p], 0);
-						hold_state = 1;
-						break;
-					case 15:
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        HL=0x%04x", reg.HL);
-						InfoLog(LogMessage);
-#endif
-						hold_state = 0;
-						done++;
-						break;
-					default:
-						break;
-					}
-					break;
-				}
-				break;
-			case 2:
-				switch (instr_q) {
-				case 0:
-					switch (instr_p) {
-					case 0: // LD (BC), A
-						switch (step++) {
-						case 1:
-							cycle = WRITE;
-							Addr = reg.BC;
-							Data = reg.A;
-							break;
-						case 2:
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        (BC)=0x%02x", reg.A);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					case 1: // LD (DE), A
-						switch (step++) {
-						case 1:
-							cycle = WRITE;
-							Addr = reg.DE;
-							Data = reg.A;
-							break;
-						case 2:
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        (DE)=0x%02x", reg.A);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					case 2: // LD (**), HL
-						switch (step++) {
-						case 1:
-							cycle = READ;
-							Addr = reg.PC++;
-							break;
-						case 2:
-							reg.Z = Data;
-							Addr = reg.PC++;
-							break;
-						case 3:
-							reg.W = Data;
-							cycle = WRITE;
-							Addr = reg.WZ;
-							Data = reg.L;
-							break;
-						case 4:
-							Addr = reg.WZ + 1;
-							Data = reg.H;
-							break;
-						case 5:
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        0x%04x=0x%04x", reg.WZ, reg.HL);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					case 3: // LD (**), A
-						switch (step++) {
-						case 1:
-							cycle = READ;
-							Addr = reg.PC++;
-							break;
-						case 2:
-							reg.Z = Data;
-							Addr = reg.PC++;
-							break;
-						case 3:
-							reg.W = Data;
-							cycle = WRITE;
-							Addr = reg.WZ;
-							Data = reg.A;
-							break;
-						case 4:
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        0x%04x=0x%02x", reg.WZ, reg.A);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					}
-					break;
-				case 1:
-					switch (instr_p) {
-					case 0: // LD A, (BC)
-						switch (step++) {
-						case 1:
-							cycle = READ;
-							Addr = reg.BC;
-							break;
-						case 2:
-							reg.A = Data;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        A=0x%02x", reg.A);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					case 1: // LD A, (DE)
-						switch (step++) {
-						case 1:
-							cycle = READ;
-							Addr = reg.DE;
-							break;
-						case 2:
-							reg.A = Data;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        A=0x%02x", reg.A);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					case 2: // LD HL, (**)
-						switch (step++) {
-						case 1:
-							cycle = READ;
-							Addr = reg.PC++;
-							break;
-						case 2:
-							reg.Z = Data;
-							Addr = reg.PC++;
-							break;
-						case 3:
-							reg.W = Data;
-							Addr = reg.WZ;
-							break;
-						case 4:
-							reg.L = Data;
-							Addr = reg.WZ + 1;
-							break;
-						case 5:
-							reg.H = Data;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        HL=0x%04x", reg.HL);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					case 3: // LD A, (**)
-						switch (step++) {
-						case 1:
-							cycle = READ;
-							Addr = reg.PC++;
-							break;
-						case 2:
-							reg.Z = Data;
-							Addr = reg.PC++;
-							break;
-						case 3:
-							reg.W = Data;
-							Addr = reg.WZ;
-							break;
-						case 4:
-							reg.A = Data;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        A=0x%02x", reg.A);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					}
-					break;
-				}
-				break;
-			case 3:
-				switch (instr_q) {
-				case 0: // INC rp[p]
-					switch (step++) {
-					case 1:
-						*tab_rp[instr_p]++;
-						reg.F &= ~(1 << FLG_N);
-						opflags((int)*tab_rp[instr_p], 1, 0, 0, 1, 1, 1, 1);
-						hold_state = 1;
-						break;
-					case 5:
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        %s=0x%04x", disp_rp[instr_p], *tab_rp[instr_p]);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						hold_state = 0;
-						break;
-					default:
-						break;
-					}
-					break;
-				case 1: // DEC rp[p]
-					switch (step++) {
-					case 1:
-						*tab_rp[instr_p]--;
-						reg.F |= (1 << FLG_N);
-						opflags((int)*tab_rp[instr_p], 1, 0, 0, 1, 1, 1, 1);
-						hold_state = 1;
-						break;
-					case 5:
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        %s=0x%04x", disp_rp[instr_p], *tab_rp[instr_p]);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						hold_state = 0;
-						break;
-					default:
-						break;
-					}
-					break;
-				}
-				break;
-			case 4: // INC r[y]
-				*tab_r[instr_y]++;
-				reg.F &= ~(1 << FLG_N);
-				opflags((int)*tab_r[instr_y], 0, 0, 0, 1, 1, 1, 1);
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "        %s=0x%02x", disp_r[instr_y], *tab_r[instr_y]);
-				InfoLog(LogMessage);
-#endif
-				done++;
-				break;
-			case 5: // DEC r[y]
-				*tab_r[instr_y]--;
-				reg.F |= (1 << FLG_N);
-				opflags((int)*tab_r[instr_y], 0, 0, 0, 1, 1, 1, 1);
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "        %s=0x%02x", disp_r[instr_y], *tab_r[instr_y]);
-				InfoLog(LogMessage);
-#endif
-				done++;
-				break;
-			case 6: // LD r[y], *
-				switch (step++) {
-				case 1:
-					cycle = READ;
-					Addr = reg.PC++;
-					break;
-				case 2:
-					*tab_r[instr_y] = Data;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        %s=0x%02x", disp_r[instr_y], *tab_r[instr_y]);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				}
-				break;
-			case 7:
-				switch (instr_y) {
-				case 4: // DAA
-					if ((reg.A & 15) > 9 || (reg.F | (1 << FLG_H))) reg.A += 6;
-					if (((reg.A >> 4) & 15) > 9 || (reg.F | (1 << FLG_C))) reg.A += 0x60;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        A=0x%02x", reg.A);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				case 5: // CPL
-					reg.A = ~reg.A;
-					reg.F |= (1 << FLG_H);
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        A=0x%02x", reg.A);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				case 6: // SCF
-					reg.F |= (1 << FLG_C);
-					reg.F &= ~((1 << FLG_H) | (1 << FLG_N));
-					done++;
-					break;
-				case 7: // CCF
-					if (reg.F & (1 << FLG_C)) reg.F &= ~(1 << FLG_C);
-					else reg.F |= (1 << FLG_C);
-					if (reg.F & (1 << FLG_H)) reg.F &= ~(1 << FLG_H);
-					else reg.F |= (1 << FLG_H);
-					reg.F &= ~(1 << FLG_N);
-					done++;
-					break;
-				default: // RLCA/RRCA/RLA/RRA
-					rot(instr_y, &reg.A);
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        A=0x%02x", reg.A);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				}
-				break;
-			}
-			break;
-		case 1:
-			if (instr_y == 6 && instr_z == 6) { // HALT
-												/* TODO: implement */
-				while (1); // not the most ideal thing but will work for the time being as we don't have interrupts yet
-			}
-			else { // LD r[y], r[z]
-				if (instr_y == 6) { // register to (HL)
-					switch (step++) {
-					case 1:
-						cycle = WRITE;
-						Addr = reg.HL;
-						Data = *tab_r[instr_z];
-						break;
-					case 2:
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        (HL)=0x%02x", *tab_r[instr_z]);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					}
-				}
-				else if (instr_z == 6) { // (HL) to register
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.HL;
-						break;
-					case 2:
-						*tab_r[instr_y] = Data;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        %s=0x%02x", disp_r[instr_y], *tab_r[instr_y]);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					}
-				}
-				else { // register to register
-					*tab_r[instr_y] = *tab_r[instr_z];
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        %s=0x%02x", disp_r[instr_y], *tab_r[instr_y]);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				}
-			}
-			break;
-		case 2: // alu[y] r[z]
-			if (instr_z == 6) { // ALU operation with (HL)
-				switch (step++) {
-				case 1:
-					cycle = READ;
-					Addr = reg.HL;
-					break;
-				case 2:
-					alu(instr_y, Data);
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        A=0x%02x", reg.A);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				}
-			}
-			else {
-				alu(instr_y, *tab_r[instr_z]);
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "        A=0x%02x", reg.A);
-				InfoLog(LogMessage);
-#endif
-				done++;
-				break;
-			}
-			break;
-		case 3:
-			switch (instr_z) {
-			case 0: // RET cc[y]
-				switch (step++) {
-				case 1:
-					hold_state = 1;
-					break;
-				default:
-					if (cc(instr_y)) { // this will be called on every step, but looks like there's no better way
-						switch (step) {
-						case 2:
-							cycle = READ;
-							Addr = reg.SP++;
-							break;
-						case 3:
-							reg.Z = Data;
-							Addr = reg.SP++;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        SP=0x%04x", reg.SP);
-							InfoLog(LogMessage);
-#endif
-							break;
-						case 4:
-							reg.W = Data;
-							reg.PC = reg.WZ;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        PC=0x%04x", reg.WZ);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-					}
-					else {
-						hold_state = 0;
-						done++;
-						break;
-					}
-					break;
-				}
-				break;
-			case 1:
-				switch (instr_q) {
-				case 0: // POP rp2[p]
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.SP++;
-						break;
-					case 2:
-						reg.Z = Data;
-						Addr = reg.SP++;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        SP=0x%04x", reg.SP);
-						InfoLog(LogMessage);
-#endif
-						break;
-					case 3:
-						reg.W = Data;
-						*tab_rp2[instr_p] = reg.WZ;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        %s=0x%04x", disp_rp2[instr_p], *tab_rp2[instr_p]);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					}
-					break;
-				case 1:
-					switch (instr_p) {
-					case 0: // RET
-						switch (step++) {
-						case 1:
-							cycle = READ;
-							Addr = reg.SP++;
-							break;
-						case 2:
-							reg.Z = Data;
-							Addr = reg.SP++;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        SP=0x%04x", reg.SP);
-							InfoLog(LogMessage);
-#endif
-							break;
-						case 3:
-							reg.W = Data;
-							reg.PC = reg.WZ;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        PC=0x%04x", reg.WZ);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					case 1: // EXX
-						t = reg.BC;
-						reg.BC = reg.BC_;
-						reg.BC_ = t;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        BC=0x%04x BC'=0x%04x", reg.BC, reg.BC_);
-						InfoLog(LogMessage);
-#endif
-						t = reg.DE;
-						reg.DE = reg.DE_;
-						reg.DE_ = t;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        DE=0x%04x DE'=0x%04x", reg.DE, reg.DE_);
-						InfoLog(LogMessage);
-#endif
-						t = reg.HL;
-						reg.HL = reg.HL_;
-						reg.HL_ = t;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        HL=0x%04x HL'=0x%04x", reg.HL, reg.HL_);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					case 2: // JP (HL)
-						reg.PC = reg.HL;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        PC=0x%04x", reg.PC);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					case 3: // LD SP, HL
-						switch (step++) {
-						case 1:
-							reg.SP = reg.HL;
-							hold_state = 1;
-							break;
-						case 5:
-							hold_state = 0;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        SP=0x%04x", reg.SP);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							break;
-						}
-						break;
-					}
-					break;
-				case 2: // JP cc[y], **
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.PC++;
-						break;
-					case 2:
-						reg.Z = Data;
-						Addr = reg.PC++;
-						break;
-					case 3:
-						reg.WZ = Data;
-						if (cc(instr_y)) reg.PC = reg.WZ;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        PC=0x%04x", reg.PC);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					}
-					break;
-				}
-			case 2: // JP cc[y], **
-				switch (step++) {
-				case 1:
-					cycle = READ;
-					Addr = reg.PC++;
-					break;
-				case 2:
-					reg.Z = Data;
-					Addr = reg.PC++;
-					break;
-				case 3:
-					reg.W = Data;
-					if (cc(instr_y)) {
-						reg.PC = reg.WZ;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        PC=0x%04x", reg.WZ);
-						InfoLog(LogMessage);
-#endif
-					}
-					done++;
-					break;
-				}
-				break;
-			case 3:
-				switch (instr_y) {
-				case 0: // JP **
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.PC++;
-						break;
-					case 2:
-						Addr = reg.PC++;
-						reg.Z = Data;
-						break;
-					case 3:
-						reg.W = Data;
-						reg.PC = reg.WZ;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        PC=0x%04x", reg.WZ);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					}
-					break;
-				case 1: // CB prefix
-					instr_pre = (instr_pre << 8) | 0xCB;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        Instruction prefix = 0x%x", instr_pre);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				case 2: // OUT (*), A
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.PC++;
-						break;
-					case 2:
-						cycle = IOWRITE;
-						Addr = Data;
-						Data = reg.A;
-						break;
-					case 3:
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        I/O 0x%02x = 0x%02x", Addr, reg.A);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					}
-					break;
-				case 3: // IN (*), A
-					switch (step++) {
-					case 1:
-						cycle = READ;
-						Addr = reg.PC++;
-						break;
-					case 2:
-						cycle = IOREAD;
-						Addr = Data;
-						break;
-					case 3:
-						Data = reg.A;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        A = 0x%02x", reg.A);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					}
-					break;
-				case 4: // EX (SP), HL
-					switch (step++) {
-					case 1:
-						hold_state = 1;
-						break;
-					case 7:
-						hold_state = 0;
-						cycle = READ;
-						Addr = reg.SP;
-						break;
-					case 8:
-						reg.Z = reg.L;
-						reg.L = Data;
-						Addr = reg.SP + 1;
-						break;
-					case 9:
-						reg.W = reg.H;
-						reg.H = Data;
-						cycle = WRITE;
-						Addr = reg.SP;
-						Data = reg.Z;
-						break;
-					case 10:
-						Addr = reg.SP + 1;
-						Data = reg.W;
-						break;
-					case 11:
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        (SP)=0x%04x HL=0x%04x", reg.WZ, reg.HL);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					default:
-						break;
-					}
-					break;
-				case 5: // EX DE, HL
-					t = reg.DE;
-					reg.DE = reg.HL;
-					reg.HL = t;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        DE=0x%04x HL=0x%04x", reg.DE, reg.HL);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				case 6: // DI
-						/* TODO: implement */
-					done++;
-					break;
-				case 7: // EI
-						/* TODO: implement */
-					done++;
-					break;
-				}
-				break;
-			case 4: // CALL cc[y], **
-				switch (step++) {
-				case 1:
-					cycle = READ;
-					Addr = reg.PC++;
-					break;
-				case 2:
-					reg.Z = Data;
-					Addr = reg.PC++;
-					break;
-				case 3:
-					reg.W = Data;
-					if (!cc(instr_y)) done++;
-					else {
-						cycle = EXEC;
-						state = T4n;
-						hold_state = 1;
-					}
-					break;
-				case 5:
-					cycle = WRITE;
-					reg.SP -= 2;
-					Addr = reg.SP;
-					Data = reg.PCl;
-					break;
-				case 6:
-					Addr = reg.SP + 1;
-					Data = reg.PCh;
-					break;
-				case 7:
-					reg.PC = reg.WZ;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        PC=0x%04x", reg.WZ);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					hold_state = 0;
-					break;
-				}
-				break;
-			case 5:
-				switch (instr_q) {
-				case 0: // PUSH rp2[p]
-					switch (step++) {
-					case 1:
-						reg.SP -= 2;
-						reg.WZ = *tab_rp2[instr_p];
-						hold_state = 1;
-						break;
-					case 2:
-						cycle = WRITE;
-						Addr = reg.SP;
-						Data = reg.Z;
-						break;
-					case 3:
-						Addr = reg.SP + 1;
-						Data = reg.W;
-						done++;
-						break;
-					}
-					break;
-				case 1:
-					switch (instr_p) {
-					case 0: // CALL **
-						switch (step++) {
-						case 1:
-							cycle = READ;
-							Addr = reg.PC++;
-							break;
-						case 2:
-							reg.Z = Data;
-							Addr = reg.PC++;
-							break;
-						case 3:
-							reg.W = Data;
-							cycle = EXEC;
-							state = T4n;
-							hold_state = 1;
-							break;
-						case 5:
-							cycle = WRITE;
-							reg.SP -= 2;
-							Addr = reg.SP;
-							Data = reg.PCl;
-							break;
-						case 6:
-							Addr = reg.SP + 1;
-							Data = reg.PCh;
-							break;
-						case 7:
-							reg.PC = reg.WZ;
-#ifdef DEBUGCALLS
-							sprintf_s(LogMessage, "        PC=0x%04x", reg.WZ);
-							InfoLog(LogMessage);
-#endif
-							done++;
-							hold_state = 0;
-							break;
-						}
-						break;
-					case 1: // DD prefix
-						instr_pre = (instr_pre << 8) | 0xDD;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        Instruction prefix = 0x%x", instr_pre);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					case 2: // ED prefix
-						instr_pre = (instr_pre << 8) | 0xED;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        Instruction prefix = 0x%x", instr_pre);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					case 3: // FD prefix
-						instr_pre = (instr_pre << 8) | 0xFD;
-#ifdef DEBUGCALLS
-						sprintf_s(LogMessage, "        Instruction prefix = 0x%x", instr_pre);
-						InfoLog(LogMessage);
-#endif
-						done++;
-						break;
-					}
-					break;
-				}
-				break;
-			case 6: // alu[y] *
-				switch (step++) {
-				case 1:
-					cycle = READ;
-					Addr = reg.PC++;
-					break;
-				case 2:
-					alu(instr_y, Data);
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        A=0x%02x", reg.A);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				}
-				break;
-			case 7: // RST y*8
-				switch (step++) {
-				case 1:
-					reg.SP -= 2;
-					cycle = WRITE;
-					Addr = reg.SP;
-					Data = reg.PCl;
-					break;
-				case 2:
-					Addr = reg.SP + 1;
-					Data = reg.PCh;
-					break;
-				case 3:
-					reg.PC = instr_y * 8;
-#ifdef DEBUGCALLS
-					sprintf_s(LogMessage, "        PC=0x%04x", reg.WZ);
-					InfoLog(LogMessage);
-#endif
-					done++;
-					break;
-				}
-				break;
-			}
-			break;
-		}
-		break;
+// DECODEFILE: the addresses of the decoded blocks of an image, keyed by its hash
+#define DECODEFILE_MAGIC	0x4430385A						// "Z80D"
+#define DECODEFILE_VERSION	1
+
+typedef struct {
+	UINT32 magic;
+	UINT32 version;
+	UINT64 hash;											// ImageHash() when the model was set up
+	UINT32 count;											// Records that follow
+	UINT32 reserved;
+} tDECODEHDR;
+
+typedef struct {
+	UINT16 pc;												// Address of a block
+	UINT8 hot;												// Ran often enough to be compiled
+	UINT8 reserved;
+} tDECODEREC;
+
+static UINT64 ImageHash(const DsimBus &bus) {				// FNV-1a of the page map and the internal pages
+	UINT64 h = 0xCBF29CE484222325ULL;
+
+	for (UINT p = 0; p < 256; p++) {
+		h = (h ^ bus.memmap[p]) * 0x100000001B3ULL;
+		if (bus.memmap[p] == MEM_EXT) continue;
+		for (UINT a = p << 8; a < (p + 1) << 8; a++) h = (h ^ bus.mem[a]) * 0x100000001B3ULL;
 	}
-	if (step) {
-		if (done) {
-			cycle = FETCH;
-			step = 0;
-		}
+	return h;
+}
+
+static BOOL ParseMemMap(const CHAR *s, UINT8 *map) {		// Fills map from "0000-7FFF ROM, 8000-BFFF EXT, C000-FFFF RAM"
+	char word[32];
+	char *end;
+	DWORD lo, hi;
+	UINT8 kind;
+	size_t n;
+
+	for (;;) {
+		while (*s == ' ' || *s == ',' || *s == ';') s++;
+		if (*s == 0) return TRUE;
+		lo = strtoul(s, &end, 16);
+		if (end == s || *end != '-') return FALSE;
+		s = end + 1;
+		hi = strtoul(s, &end, 16);
+		if (end == s || hi > 0xFFFF || lo > hi || (lo & 0xFF) != 0 || (hi & 0xFF) != 0xFF) return FALSE;
+		for (s = end, n = 0; *s != 0 && *s != ',' && *s != ';'; s++)	// Kind, "internal ROM" or "ROM", "external" or "EXT"...
+			if (n < sizeof(word) - 1) word[n++] = (char)toupper((unsigned char)*s);
+		word[n] = 0;
+		if (strstr(word, "ROM") != NULL) kind = MEM_ROM;
+		else if (strstr(word, "RAM") != NULL) kind = MEM_RAM;
+		else if (strstr(word, "EXT") != NULL) kind = MEM_EXT;
+		else return FALSE;
+		for (n = lo >> 8; n <= hi >> 8; n++) map[n] = kind;
 	}
 }
 
@@ -1538,11 +144,11 @@ INT DsimModel::isdigital(CHAR *pinname) {
 
 VOID DsimModel::setup(IINSTANCE *instance, IDSIMCKT *dsimckt) {
 
-	int n;
-	char s[8];
+	DsimBus &bus = core.bus;
 
 	inst = instance;
 	ckt = dsimckt;
+	zlog.SetLevel(inst->getinitval("LOGLEVEL", LOG_OFF));	// 0 off ... 4 every half T-state
 
 	CREATEPOPUPSTRUCT *cps = new CREATEPOPUPSTRUCT;
 	cps->caption = "Z80 Simulator Debugger Log";			// WIN Header
@@ -1552,94 +158,377 @@ VOID DsimModel::setup(IINSTANCE *instance, IDSIMCKT *dsimckt) {
 	cps->width = 400;
 	cps->id = 123;
 
-	myPopup = (IDEBUGPOPUP *)instance->createpopup(cps);
+	bus.myPopup = (IDEBUGPOPUP *)instance->createpopup(cps);
 
 	InfoLog("Connecting control pins...");
 
-	pin_M1 = inst->getdsimpin("$M1$", true);				// Connects M1 cycle pin
-	pin_MREQ = inst->getdsimpin("$MREQ$", true);			// Connects memory request pin
-	pin_IORQ = inst->getdsimpin("$IORQ$", true);			// Connects IO request pin
-	pin_RD = inst->getdsimpin("$RD$", true);				// Connects memory read pin
-	pin_WR = inst->getdsimpin("$WR$", true);				// Connects memory write pin
-	pin_RFSH = inst->getdsimpin("$RFSH$", true);			// Connects memory refresh pin
-	pin_HALT = inst->getdsimpin("$HALT$", true);			// Connects halt pin
-	pin_WAIT = inst->getdsimpin("$WAIT$", true);			// Connects memory wait pin
-	pin_INT = inst->getdsimpin("$INT$", true);				// Connects interrupt request pin
-	pin_NMI = inst->getdsimpin("$NMI$", true);				// Connects non-maskable interrupt pin
-	pin_RESET = inst->getdsimpin("$RESET$", true);			// Connects reset pin
-	pin_BUSRQ = inst->getdsimpin("$BUSRQ$", true);			// Connects bus request pin
-	pin_BUSAK = inst->getdsimpin("$BUSAK$", true);			// Connects bus acknowledge pin
-	pin_CLK = inst->getdsimpin("CLK", true);				// Connects Clock pin
+	bus.pin_out[PIN_M1] = inst->getdsimpin("$M1$", true);		// Connects M1 cycle pin
+	bus.pin_out[PIN_MREQ] = inst->getdsimpin("$MREQ$", true);	// Connects memory request pin
+	bus.pin_out[PIN_IORQ] = inst->getdsimpin("$IORQ$", true);	// Connects IO request pin
+	bus.pin_out[PIN_RD] = inst->getdsimpin("$RD$", true);		// Connects memory read pin
+	bus.pin_out[PIN_WR] = inst->getdsimpin("$WR$", true);		// Connects memory write pin
+	bus.pin_out[PIN_RFSH] = inst->getdsimpin("$RFSH$", true);	// Connects memory refresh pin
+	bus.pin_out[PIN_HALT] = inst->getdsimpin("$HALT$", true);	// Connects halt pin
+	bus.pin_WAIT = inst->getdsimpin("$WAIT$", true);			// Connects memory wait pin
+	bus.pin_INT = inst->getdsimpin("$INT$", true);				// Connects interrupt request pin
+	bus.pin_NMI = inst->getdsimpin("$NMI$", true);				// Connects non-maskable interrupt pin
+	bus.pin_RESET = inst->getdsimpin("$RESET$", true);			// Connects reset pin
+	bus.pin_BUSRQ = inst->getdsimpin("$BUSRQ$", true);			// Connects bus request pin
+	bus.pin_out[PIN_BUSAK] = inst->getdsimpin("$BUSAK$", true);	// Connects bus acknowledge pin
+	DOUBLE freq;
+	inst->getnumval(&freq, "CLOCK", 0);						// Own clock instead of the CLK pin
+	bus.pin_CLK = inst->getdsimpin("CLK", freq <= 0);			// Connects Clock pin
 
 	InfoLog("Connecting data pins...");
-	for (n = 0; n < 8; n++) {								// Connects Data pins
-		s[0] = 'D';
-		_itoa_s(n, &s[1], 7, 10);
-		pin_D[n] = inst->getdsimpin(s, true);
-	}
+	bus.bus_D = inst->getbuspin("D", 0, 8, true);			// Connects D0-D7 as one bus
+	bus.bus_D->settiming(1, 1, 1);
+	bus.bus_D->setstates(SHI, SLO, FLT);
 
 	InfoLog("Connecting address pins...");
-	for (n = 0; n < 16; n++) {								// Connects Address pins
-		s[0] = 'A';
-		_itoa_s(n, &s[1], 7, 10);
-		pin_A[n] = inst->getdsimpin(s, true);
-	}
+	bus.bus_A = inst->getbuspin("A", 0, 16, true);			// Connects A0-A15 as one bus
+	bus.bus_A->settiming(1, 1, 1);
+	bus.bus_A->setstates(SHI, SLO, FLT);
 
 	// Connects function to handle Clock steps (instead of using "simulate")
-	pin_CLK->sethandler(this, (PINHANDLERFN)&DsimModel::clockstep);
-	pin_INT->sethandler(this, (PINHANDLERFN)&DsimModel::irqfire);
-	pin_NMI->sethandler(this, (PINHANDLERFN)&DsimModel::nmifire);
-	pin_RESET->sethandler(this, (PINHANDLERFN)&DsimModel::rsthandler);
+	if (freq > 0) {
+		period = dsimtime(1.0 / freq);
+		clkevent = ckt->setclockcallback(period / 2, period / 2, this, (CALLBACKHANDLERFN)&DsimModel::clocktick, EV_CLOCK);
+		InfoLog("Clocked internally, CLK is not used");
+	}
+	else bus.pin_CLK->sethandler(this, (PINHANDLERFN)&DsimModel::clockstep);
+	sched = inst->getboolval("SCHEDULE", freq > 0);
+	if (sched && zlog.level >= LOG_TRACE) {
+		InfoLog("SCHEDULE ignored at LOGLEVEL 4, every half T-state is traced");
+		sched = FALSE;
+	}
+	CHAR *irq = inst->getstrval("IRQSTATS");
+	sprintf_s(IrqStatsFile, "%s", irq != NULL ? irq : "");
+	memset(irqstats, 0, sizeof(irqstats));
+	CHAR *prof = inst->getstrval("PROFILE");
+	sprintf_s(ProfileFile, "%s", prof != NULL ? prof : "");
+	if (ProfileFile[0] != 0) core.EnableProfile(true);
+	bus.pin_INT->sethandler(this, (PINHANDLERFN)&DsimModel::irqfire);
+	bus.pin_NMI->sethandler(this, (PINHANDLERFN)&DsimModel::nmifire);
+	bus.pin_RESET->sethandler(this, (PINHANDLERFN)&DsimModel::rsthandler);
+	bus.pin_WAIT->sethandler(this, (PINHANDLERFN)&DsimModel::waitfire);
+	bus.pin_BUSRQ->sethandler(this, (PINHANDLERFN)&DsimModel::busrqfire);
+
+	CHAR *map = inst->getstrval("MEMMAP");
+	if (map != NULL || inst->getboolval("INTERNALMEM", FALSE)) {
+		CHAR *file = inst->getstrval("PROGRAM");
+
+		bus.mem = new UINT8[0x10000];
+		memset(bus.mem, 0, 0x10000);
+		if (map == NULL) {									// INTERNALMEM: ROM up to ROMSIZE, RAM after it
+			DWORD romsize = inst->gethexval("ROMSIZE", 0);
+			for (UINT n = 0; n < 256; n++) bus.memmap[n] = (n << 8 < romsize) ? MEM_ROM : MEM_RAM;
+		}
+		else if (!ParseMemMap(map, bus.memmap)) {
+			ErrorLog("Bad MEMMAP, expected ranges like \"0000-7FFF ROM, 8000-BFFF EXT, C000-FFFF RAM\" on 256-byte pages");
+		}
+		if (file == NULL || !inst->loadmemory(file, bus.mem, 0x10000)) {
+			ErrorLog("Cannot load PROGRAM into the internal memory");
+		}
+		observe = inst->getboolval("OBSERVE", FALSE);
+		quantum = inst->getinitval("QUANTUM", 0);
+		core.EnableCache(inst->getboolval("DECODECACHE", TRUE) != FALSE);
+		if (inst->getboolval("JIT", FALSE)) {
+			if (observe) InfoLog("JIT ignored with OBSERVE");
+			else if (!core.EnableJit(true)) InfoLog("JIT not available on this host");
+		}
+		if (core.CacheEnabled()) {
+			CHAR *df = inst->getstrval("DECODEFILE");
+			sprintf_s(DecodeFile, "%s", df != NULL ? df : "");
+			LoadDecoded();
+		}
+		InfoLog("Internal memory enabled");
+	}
 
 	InfoLog("Hold $RESET$ low for at least 3 clock cycles to activate");
 	// ResetCPU(0);
 }
 
-VOID DsimModel::irqfire(ABSTIME time, DSIMMODES mode) {
-	if (pin_INT->isnegedge()) {
-#ifdef DEBUGCALLS
-		sprintf_s(LogMessage, "$INT$ active");
-		InfoLog(LogMessage);
-#endif
+VOID DsimModel::irqfire(ABSTIME time, DSIMMODES mode) {	// INT is level triggered, the core keeps the level until it goes high
+	if (core.bus.pin_INT->isnegedge()) {
+		InfoLog("$INT$ active");
+		if (!core.IsInt) asserted[0] = time;
+		core.SetInt(true);
+		if (halted != 0 && core.IntPending) Wake(time);
+		else if (ahead && core.IntPending) {				// Taken on the next rising edge, not at the end of the quantum
+			CutSleep(time);
+			skip &= 1;										// The T-states run ahead of it are not waited for
+		}
+	}
+	else if (core.bus.pin_INT->isposedge()) {
+		core.SetInt(false);
+		asserted[0] = 0;									// Withdrawn, or acknowledged already
 	}
 }
 
 VOID DsimModel::nmifire(ABSTIME time, DSIMMODES mode) {
-	if (pin_NMI->isnegedge()) {
-#ifdef DEBUGCALLS
-		sprintf_s(LogMessage, "$NMI$ active");
-		InfoLog(LogMessage);
-#endif
+	if (core.bus.pin_NMI->isnegedge()) {
+		InfoLog("$NMI$ active");
+		if (!core.IsNMI) asserted[1] = time;
+		core.SetNMI();										// Edge triggered, latched until accepted
+		if (halted != 0) Wake(time);
+		else if (ahead) {									// As for INT
+			CutSleep(time);
+			skip &= 1;
+		}
 	}
 }
 
-unsigned long long int z80_rst_start = 0;
 VOID DsimModel::rsthandler(ABSTIME ime, DSIMMODES mode) {
-	if (pin_RESET->isnegedge()) { // RESET pin activates
-		z80_rst_start = z80_clk;
-		ResetCPU(0); // reset the Z80
-		z80_up = 0; // block CPU from running
+	if (core.bus.pin_RESET->isnegedge()) { // RESET pin activates
+		if (halted != 0) Wake(ime);							// Back on the clock, which counts the reset cycles
+		if (stalled != 0) {
+			Resume(stalled, ime, period);
+			stalled = 0;
+		}
+		if (released != 0) {
+			Resume(released, ime, period);
+			released = 0;
+		}
+		if (core.IsBusRQ) core.bus.Reclaim(ime);
+		CutSleep(ime);										// The reset cycles are counted on the clock
+		rst_start = clk;
+		core.ResetCPU(0); // reset the Z80
+		asserted[1] = 0;									// The NMI latch is cleared, the handlers abandoned
+		nesting = 0;
+		skip = 0;
+		if (resync != NULL) {								// Back on the clock edges
+			ckt->cancelcallback(resync, this);
+			resync = NULL;
+		}
+		up = FALSE; // block CPU from running
 
 	}
-	else if (pin_RESET->isposedge()) { // RESET end
-		if (z80_clk - z80_rst_start < 3) { // not enough cycles
-#ifdef DEBUGCALLS
-			InfoLog("CPU reset failed");
-			sprintf_s(LogMessage, "Expected at least 3 cycles, got %d cycle(s)", z80_clk - z80_rst_start);
-			InfoLog(LogMessage);
-#endif
+	else if (core.bus.pin_RESET->isposedge()) { // RESET end
+		if (clk - rst_start < 3) { // not enough cycles
+			ErrorLog("CPU reset failed");
+			ErrorLog("Expected at least 3 cycles, got %d cycle(s)", (UINT32)(clk - rst_start));
 		}
 		else {
-#ifdef DEBUGCALLS
 			InfoLog("CPU reset completed");
-#endif
-			reg.PC = 0;
-			z80_up = 1; // lets the CPU run again
+			core.reg.PC = 0;
+			up = TRUE; // lets the CPU run again
+		}
+	}
+}
+
+VOID DsimModel::waitfire(ABSTIME time, DSIMMODES mode) {
+	if (core.bus.pin_WAIT->isnegedge()) core.bus.wait_fell = time;
+	else if (core.bus.pin_WAIT->isposedge()) {
+		core.bus.wait_rose = time;
+		if (stalled != 0) {									// Sampled high on the next falling edge, the TW then ends
+			core.Stalled(Resume(stalled, time, period) - 1);	// The TW sampled low before that one
+			stalled = 0;
+			core.IsWaiting = 2;
+		}
+	}
+}
+
+VOID DsimModel::busrqfire(ABSTIME time, DSIMMODES mode) {
+	if (core.bus.pin_BUSRQ->isnegedge()) {
+		core.BusReq = 1;									// Seen by Edge() at the end of the M-cycle
+		if (halted != 0) {									// Nothing on the bus in HALT, granted at once
+			core.bus.Release(time);
+			core.IsBusRQ = 1;
+		}
+		else if (ahead) CutSleep(time);						// Granted on the next rising edge of internal code
+	}
+	else if (core.bus.pin_BUSRQ->isposedge()) {
+		core.BusReq = 0;
+		if (released != 0) {								// The core takes the bus back on the next rising edge
+			core.bus.Reclaim(released + Resume(released, time, period) * period);
+			released = 0;
+			core.IsBusRQ = 0;
+		}
+		else if (core.IsBusRQ) {							// Granted in HALT, maybe woken since
+			core.bus.Reclaim(time);
+			core.IsBusRQ = 0;
 		}
 	}
 }
 
 VOID DsimModel::runctrl(RUNMODES mode) {
+	switch (mode) {
+	case RM_STOP:
+	case RM_SUSPEND:
+	case RM_STEPTIME:
+	case RM_STEPOVER:
+	case RM_STEPINTO:
+	case RM_STEPOUT:
+	case RM_STEPTO:
+		if (mode == RM_STOP && core.blk_hits + core.blk_misses != 0) {
+			InfoLine("Decode cache: %llu hits, %llu misses, %llu page invalidations", (unsigned long long)core.blk_hits,
+				(unsigned long long)core.blk_misses, (unsigned long long)core.blk_invalidations);
+		}
+		if (mode == RM_STOP && core.jit_runs != 0) {
+			InfoLine("JIT: %llu compiled block runs", (unsigned long long)core.jit_runs);
+		}
+		if (mode == RM_STOP && DecodeFile[0] != 0) SaveDecoded();
+		if (mode == RM_STOP && IrqStatsFile[0] != 0) SaveIrqStats();
+		if (mode == RM_STOP && ProfileFile[0] != 0) SaveProfile();
+		FlushLog();											// The simulation is paused, show what was logged
+		break;
+	default:
+		break;
+	}
+}
+
+VOID DsimModel::LoadDecoded(void) {							// Decodes what DECODEFILE lists, or the code reachable from the vectors
+	static const UINT16 vectors[] = { 0x0000, 0x0008, 0x0010, 0x0018, 0x0020, 0x0028, 0x0030, 0x0038, 0x0066 };
+	tDECODEHDR h;
+	tDECODEREC r;
+	FILE *f;
+	UINT n = 0;
+
+	imagehash = ImageHash(core.bus);
+	if (DecodeFile[0] != 0 && fopen_s(&f, DecodeFile, "rb") == 0) {
+		if (fread(&h, sizeof(h), 1, f) == 1 && h.magic == DECODEFILE_MAGIC && h.version == DECODEFILE_VERSION && h.hash == imagehash) {
+			while (n < h.count && fread(&r, sizeof(r), 1, f) == 1) {
+				core.Preload(r.pc, r.hot != 0);
+				n++;
+			}
+			fclose(f);
+			InfoLog("Decode cache: %u blocks from DECODEFILE", n);
+			return;
+		}
+		fclose(f);
+		InfoLog("DECODEFILE is for another image, decoding from the vectors");
+	}
+	n = core.Predecode(vectors, sizeof(vectors) / sizeof(vectors[0]));
+	InfoLog("Decode cache: %u blocks reachable from the vectors", n);
+}
+
+VOID DsimModel::SaveDecoded(void) {							// Writes the blocks decoded so far to DECODEFILE
+	UINT16 pcs[BLK_ENTRIES];
+	UINT8 hot[BLK_ENTRIES];
+	tDECODEHDR h = { DECODEFILE_MAGIC, DECODEFILE_VERSION, imagehash, 0, 0 };
+	FILE *f;
+
+	h.count = core.ListBlocks(pcs, hot, BLK_ENTRIES);
+	if (fopen_s(&f, DecodeFile, "wb") != 0) {
+		ErrorLog("Cannot write DECODEFILE");
+		return;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	for (UINT i = 0; i < h.count; i++) {
+		tDECODEREC r = { pcs[i], hot[i], 0 };
+		fwrite(&r, sizeof(r), 1, f);
+	}
+	fclose(f);
+}
+
+static UINT IrqBucket(UINT64 t) {							// Histogram bucket of t T-states
+	UINT b = 0;
+
+	while (b < IRQ_BUCKETS - 1 && t >= (16ULL << b)) b++;
+	return b;
+}
+
+BOOL DsimModel::Boundary(ABSTIME time) {					// Accept() on an instruction boundary, timing the interrupts
+																// for IRQSTATS
+	UINT16 pc = core.reg.PC;
+	UINT kind = core.IsNMI;									// What Accept() takes first
+	UINT64 t;
+
+	if (IrqStatsFile[0] == 0 || period == 0) return core.Accept(time);
+	if (core.IsRetn && nesting != 0) {						// Returned from the innermost handler
+		tIRQSTATS &s = irqstats[handlerkind[--nesting]];
+		t = (time - handler[nesting]) / period;
+		s.duration[IrqBucket(t)]++;
+		s.dursum += t;
+		s.returned++;
+		if (t > s.durmax) {
+			s.durmax = t;
+			s.durpc = core.RetnPC;
+		}
+	}
+	if (!core.Accept(time)) return FALSE;
+	tIRQSTATS &s = irqstats[kind];
+	t = asserted[kind] != 0 ? (time - asserted[kind]) / period : 0;
+	asserted[kind] = 0;
+	s.latency[IrqBucket(t)]++;
+	s.latsum += t;
+	s.taken++;
+	if (t > s.latmax) {
+		s.latmax = t;
+		s.latpc = pc;
+	}
+	if (nesting < IRQ_NESTING) {							// Deeper ones are not timed
+		handler[nesting] = time;
+		handlerkind[nesting++] = (UINT8)kind;
+	}
+	return TRUE;
+}
+
+VOID DsimModel::SaveIrqStats(void) {						// Shows the IRQSTATS histograms, and writes them to the file
+	static const char *names[2] = { "INT", "NMI" };
+	char line[128];
+	FILE *f;
+
+	if (fopen_s(&f, IrqStatsFile, "w") != 0) {
+		ErrorLog("Cannot write IRQSTATS");
+		f = NULL;
+	}
+#define IRQLINE(...)	do { sprintf_s(line, __VA_ARGS__); core.bus.Log(line); if (f != NULL) fprintf(f, "%s\n", line); } while (0)
+	for (UINT k = 0; k < 2; k++) {
+		tIRQSTATS &s = irqstats[k];
+		UINT last = 0;
+
+		IRQLINE("%s: %llu taken, %llu returned", names[k], (unsigned long long)s.taken, (unsigned long long)s.returned);
+		if (s.taken == 0) continue;
+		IRQLINE("  latency: mean %llu T, worst %llu T at %04Xh",
+			(unsigned long long)(s.latsum / s.taken), (unsigned long long)s.latmax, s.latpc);
+		if (s.returned != 0) IRQLINE("  handler: mean %llu T, worst %llu T ending at %04Xh",
+			(unsigned long long)(s.dursum / s.returned), (unsigned long long)s.durmax, s.durpc);
+		for (UINT b = 0; b < IRQ_BUCKETS; b++) if (s.latency[b] != 0 || s.duration[b] != 0) last = b;
+		IRQLINE("  %-14s %10s %10s", "T-states", "latency", "handler");
+		for (UINT b = 0; b <= last; b++) {
+			if (b == IRQ_BUCKETS - 1) IRQLINE("  %6llu+        %10llu %10llu", 16ULL << (b - 1),
+				(unsigned long long)s.latency[b], (unsigned long long)s.duration[b]);
+			else IRQLINE("  %6llu-%-7llu %10llu %10llu", b ? 16ULL << (b - 1) : 0ULL, (16ULL << b) - 1,
+				(unsigned long long)s.latency[b], (unsigned long long)s.duration[b]);
+		}
+	}
+#undef IRQLINE
+	if (f != NULL) fclose(f);
+}
+
+VOID DsimModel::SaveProfile(void) {							// Writes the per-PC profile to PROFILE
+	UINT64 n, t = core.Profile()->Total(&n);
+
+	if (!core.Profile()->Save(ProfileFile, inst->getstrval("PROGRAM"))) {
+		ErrorLog("Cannot write PROFILE");
+		return;
+	}
+	InfoLine("Profile: %llu instructions, %llu T-states", (unsigned long long)n, (unsigned long long)t);
+}
+
+VOID DsimModel::InfoLine(const char *fmt, ...) {			// At LOG_INFO, straight to the debug popup: the ring only keeps 32-bit arguments
+	char line[128];
+	va_list args;
+
+	if (zlog.level < LOG_INFO) return;
+	FlushLog();												// After what was logged before
+	va_start(args, fmt);
+	vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+	core.bus.Log(line);
+}
+
+VOID DsimModel::FlushLog(void) {							// Formats the pending log records on the debug popup
+	UINT64 lost;
+
+	while (zlog.Pop(LogMessage, sizeof(LogMessage)))
+		core.bus.Log(LogMessage);
+	lost = zlog.Lost();
+	if (lost) {
+		sprintf_s(LogMessage, "(%llu older records overwritten)", (unsigned long long)lost);
+		core.bus.Log(LogMessage);
+	}
 }
 
 VOID DsimModel::actuate(REALTIME time, ACTIVESTATE newstate) {
@@ -1649,227 +538,147 @@ BOOL DsimModel::indicate(REALTIME time, ACTIVEDATA *data) {
 	return FALSE;
 }
 
-VOID DsimModel::clockstep(ABSTIME time, DSIMMODES mode) {
-	if (pin_CLK->isposedge()) z80_clk++;
-	if (z80_up && pin_CLK->isedge()) {
-
-#ifdef DEBUGCALLS
-		sprintf_s(LogMessage, "Cycle %d state %d...", cycle, state);
-		InfoLog(LogMessage);
-#endif
-		switch (cycle) {
-			/*----------------------------------------------*/
-		case FETCH:											// Instruction fetch cycle
-			switch (state) {
-			case T1p:
-				done = 0;
-#ifdef DEBUGCALLS
-				InfoLog("  Fetch...");
-				sprintf_s(LogMessage, "    Setting instruction address to 0x%04x...", reg.PC);
-				InfoLog(LogMessage);
-#endif
-				pin_M1->SetLow;
-				SetAddr(reg.PC, time);
-				break;
-			case T1n:
-				pin_MREQ->SetLow;
-				pin_RD->SetLow;
-				break;
-			case T2p:
-				reg.PC++;
-				break;
-			case T2n:
-				break;
-			case T3p:
-#ifdef DEBUGCALLS
-				InfoLog("    Reading instruction...");
-#endif
-				InstR = GetData();
-				instr_z = (InstR & 7);
-				instr_y = (InstR >> 3) & 7;
-				instr_x = (InstR >> 6) & 3;
-				instr_q = instr_y & 1;
-				instr_p = (instr_y >> 1) & 3;
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "      -> 0x%02x (x=%d,y=%d,z=%d,p=%d,q=%d...", InstR, instr_x, instr_y, instr_z, instr_p, instr_q);
-				InfoLog(LogMessage);
-#endif
-				pin_MREQ->SetHigh;
-				pin_RD->SetHigh;
-				pin_M1->SetHigh;
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "    Setting refresh address to 0x%04x...", reg.IR);
-				InfoLog(LogMessage);
-#endif
-				SetAddr(reg.IR, time + 20000);				// Puts the refresh address on the bus 20ns after RD goes up
-				reg.W = reg.R++;
-				reg.R = (reg.W & 0x80) | (reg.R & 0x7f);	// Increments only the 7 first bits of R (the 8th bit stays the same)
-				pin_RFSH->setstate(time + 22000, 1, SLO);	// And brings RFSH low 2ns after that
-				break;
-			case T3n:
-				pin_MREQ->SetLow;
-				break;
-			case T4n:
-				pin_MREQ->SetHigh;
-				if(!hold_state) step = 1;									// Start execution of the fetched instruction
-				Execute();
-				pin_RFSH->SetHigh;
-				break;
-			}
+VOID DsimModel::clockstep(ABSTIME time, DSIMMODES mode) {	// Edge of the CLK pin
+	if (resync != NULL || stopped) return;					// Asleep, callback() or Resume() comes back before the edge to run
+	clklevel = core.bus.pin_CLK->isposedge();
+	if (clklevel) {
+		clk++;
+		if (lastrise != 0) period = time - lastrise;
+		lastrise = time;
+	}
+	if (core.bus.pin_CLK->isedge()) Edge(time);
+}
 
-			if(!hold_state) state++;
-			if (state > T4n)
-				state = T1p;
-			break;
-		case EXEC: // continue execution cycle (identical to FETCH cycle at T4n)
-			pin_MREQ->SetHigh;
-			if (!hold_state) step = 1;									// Start execution of the fetched instruction
-			Execute();
-			pin_RFSH->SetHigh;
-			if (!hold_state) {
-				state = T1p;
-				cycle = FETCH;
-			}
-			break;
-			/*----------------------------------------------*/
-		case READ:											// Memory read cycle
-			switch (state) {
-			case T1p:
-#ifdef DEBUGCALLS
-				InfoLog("  Read...");
-				sprintf_s(LogMessage, "    Setting read memory address to 0x%04x...", Addr);
-				InfoLog(LogMessage);
-#endif
-				SetAddr(Addr, time);
-				break;
-			case T1n:
-				pin_MREQ->SetLow;
-				pin_RD->SetLow;
-				break;
-			case T3n:
-#ifdef DEBUGCALLS
-				InfoLog("    Reading data...");
-#endif
-				Data = GetData();
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "      -> 0x%02x...", Data);
-				InfoLog(LogMessage);
-#endif
-				pin_MREQ->SetHigh;
-				pin_RD->SetHigh;
-				Execute();
-				break;
-			}
-			state++;
-			if (state > T3n)
-				state = T1p;
-			break;
-			/*----------------------------------------------*/
-		case WRITE:											// Memory write cycle
-			switch (state) {
-			case T1p:
-#ifdef DEBUGCALLS
-				InfoLog("  Write...");
-				sprintf_s(LogMessage, "    Setting write memory address to 0x%04x...", Addr);
-				InfoLog(LogMessage);
-#endif
-				SetAddr(Addr, time);
-				break;
-			case T1n:
-				pin_MREQ->SetLow;
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "    Setting data to 0x%02x...", Data);
-				InfoLog(LogMessage);
-#endif
-				SetData(Data, time);
-				break;
-			case T2n:
-				pin_WR->SetLow;
-				break;
-			case T3n:
-				pin_MREQ->SetHigh;
-				pin_WR->SetHigh;
-				HIZData(time + 20000);						// Put the data bus in FLT 20ns after the WR pin goes up
-				Execute();
-				break;
-			}
-			state++;
-			if (state > T3n)
-				state = T1p;
-			break;
-		case IOREAD:											// I/O read cycle
-			switch (state) {
-			case T1p:
-#ifdef DEBUGCALLS
-				InfoLog("  I/O Read...");
-				sprintf_s(LogMessage, "    Setting read memory address to 0x%04x...", Addr);
-				InfoLog(LogMessage);
-#endif
-				SetAddr(Addr, time);
-				break;
-			case T2p:
-				pin_IORQ->SetLow;
-				pin_RD->SetLow;
-				break;
-			case T4p: // supposed to be T3 according to Z80 docs, but in this case T3 is TW
-#ifdef DEBUGCALLS
-				InfoLog("    Reading data...");
-#endif
-				Data = GetData();
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "      -> 0x%02x...", Data);
-				InfoLog(LogMessage);
-#endif
-				break;
-			case T4n:
-				pin_IORQ->SetHigh;
-				pin_RD->SetHigh;
-				Execute();
-				break;
-			}
-			state++;
-			if (state > T4n)
-				state = T1p;
-			break;
-			/*----------------------------------------------*/
-		case IOWRITE:											// I/O write cycle
-			switch (state) {
-			case T1p:
-#ifdef DEBUGCALLS
-				InfoLog("  I/O Write...");
-				sprintf_s(LogMessage, "    Setting write memory address to 0x%04x...", Addr);
-				InfoLog(LogMessage);
-#endif
-				SetAddr(Addr, time);
-				break;
-			case T1n:
-#ifdef DEBUGCALLS
-				sprintf_s(LogMessage, "    Setting data to 0x%02x...", Data);
-				InfoLog(LogMessage);
-#endif
-				SetData(Data, time);
-				break;
-			case T2p:
-				pin_IORQ->SetLow;
-				pin_WR->SetLow;
-				break;
-			case T4n:
-				pin_IORQ->SetHigh;
-				pin_WR->SetHigh;
-				HIZData(time + 20000);						// Put the data bus in FLT 20ns after the WR pin goes up
-				Execute();
-				break;
+VOID DsimModel::clocktick(ABSTIME time, EVENTID eventid) {	// Edge of the CLOCK the model generates, every half period
+	clklevel = !clklevel;
+	if (clklevel) clk++;
+	Edge(time);
+}
+
+VOID DsimModel::Edge(ABSTIME time) {						// Half T-state of the core
+	UINT n;
+
+	if (!up) return;
+	// BUSRQ low at the end of an M-cycle, or on a rising edge of internal code run at once, which goes on counting after the grant
+	if (core.BusReq && period != 0 && (skip ? clklevel && !observe : core.state == T1p && core.cycle != EXEC)) {
+		core.bus.Release(time);
+		core.IsBusRQ = 1;
+		released = time;
+		Stop();
+		return;
+	}
+	if (skip) {												// Inside what Step()/StepBlock() ran
+		skip--;
+		if (observe && skip == m1end) core.bus.SetHigh(PIN_M1, time);
+		return;
+	}
+	if (core.cycle == FETCH && core.state == T1p && !(core.IntPending && Boundary(time))) {	// Unless an acknowledge follows
+		if (core.IsHalted && period != 0 && !core.IntPending) {	// Nothing to do but NOP fetches until an interrupt
+			Halt(time);
+			return;
+		}
+		if (core.bus.Internal(core.reg.PC)) {				// Whole instruction at once, until it needs the pins
+			if (observe) {
+				core.bus.SetAddr(core.reg.PC, time);
+				core.bus.SetLow(PIN_M1, time);
+				skip = core.Step() * 2 - 1;					// This edge is the first one
+				m1end = skip - 4;							// M1 is released at T3 as in a fetch
 			}
-			state++;
-			if (state > T4n)
-				state = T1p;
-			break;
+			else if (clkevent != NULL || (quantum != 0 && period != 0)) RunAhead(time);
+			else skip = core.StepBlock() * 2 - 1;
+			return;
 		}
 	}
+	if (period == 0) core.ClockEdge(time);
+	else if (sched) {
+		if ((n = core.ClockCycle(time, period / 2)) != 0) Sleep(time, n);
+	}
+	else if ((n = core.Idle()) != 0) Sleep(time, n);		// Internal T-states, nothing to do until they end
+	else core.ClockEdge(time);
+	if (core.IsWaiting == 1 && period != 0) {				// WAIT sampled low, nothing to do until it goes high
+		stalled = time;
+		Stop();
+	}
+}
+
+VOID DsimModel::Sleep(ABSTIME time, UINT n) {				// Next call of Edge() on the nth clock edge from this one
+	clk += clklevel ? (n - 1) / 2 : n / 2;					// Rising edges skipped
+	if (!(n & 1)) clklevel = !clklevel;						// Level before the nth edge
+	sleepend = time + n * (period / 2);
+	ahead = FALSE;
+	if (clkevent == NULL) {									// CLK: ignored until a callback between the last edge skipped and the nth
+		resync = ckt->setcallback(sleepend - period / 4, this, EV_RESYNC);
+		return;
+	}
+	ckt->cancelcallback(clkevent, this);
+	clkevent = ckt->setclockcallback(sleepend, period / 2, this, (CALLBACKHANDLERFN)&DsimModel::clocktick, EV_CLOCK);
+}
+
+VOID DsimModel::CutSleep(ABSTIME time) {					// Back on the clock on the first edge after time, if Sleep() skipped it;
+																// Edge() counts the edges skipped down in skip
+	UINT64 j;
+
+	if ((clkevent == NULL && resync == NULL) || sleepend <= time) return;
+	j = (sleepend - time - 1) / (period / 2);				// Edges before sleepend Sleep() counted, which now happen
+	clk -= j / 2 + ((j & 1) && clklevel ? 1 : 0);			// Every other one is rising, the last one if clklevel
+	if (j & 1) clklevel = !clklevel;
+	sleepend -= j * (period / 2);
+	skip = (UINT)j;
+	ahead = FALSE;
+	if (clkevent == NULL) {									// CLK: on the edges again from now
+		ckt->cancelcallback(resync, this);
+		resync = NULL;
+		lastrise = 0;
+		return;
+	}
+	ckt->cancelcallback(clkevent, this);
+	clkevent = ckt->setclockcallback(sleepend, period / 2, this, (CALLBACKHANDLERFN)&DsimModel::clocktick, EV_CLOCK);
+}
+
+VOID DsimModel::Stop(void) {								// No work at all on the clock until Resume()
+	stopped = TRUE;
+	if (clkevent != NULL) ckt->cancelcallback(clkevent, this);
+}
+
+UINT64 DsimModel::Resume(ABSTIME from, ABSTIME time, RELTIME step) {	// Back on the clock on the first edge after time a whole number of
+																// steps from the edge Stop() was called on; returns the steps
+	UINT64 m = (time - from) / step + 1;
+	UINT64 edges = m * (step / period);						// Rising edges from the stop to the resume, the latter included
+
+	clk += clklevel ? edges - 1 : edges;					// The resume edge counts itself if it is rising
+	clklevel = !clklevel;									// Before the resume edge, the same kind as the stop one
+	stopped = FALSE;
+	if (clkevent != NULL) clkevent = ckt->setclockcallback(from + m * step, period / 2, this, (CALLBACKHANDLERFN)&DsimModel::clocktick, EV_CLOCK);
+	else resync = ckt->setcallback(from + m * step - period / 4, this, EV_RESYNC);
+	return m;
+}
+
+VOID DsimModel::Halt(ABSTIME time) {						// Stops all the work on the clock on the first M1 after HALT, until Wake()
+	core.bus.SetLow(PIN_HALT, time);
+	halted = time;
+	Stop();
+}
+
+VOID DsimModel::Wake(ABSTIME time) {						// Back on the clock at the first M1 after time, with the fetches of HALT skipped
+	core.Halted(Resume(halted, time, 4 * period));
+	halted = 0;
+}
+
+VOID DsimModel::RunAhead(ABSTIME time) {					// Runs up to QUANTUM T-states of internal code in one wake-up
+	UINT t = 0;
+
+	do t += core.StepBlock();
+	while (t < quantum && core.cycle == FETCH && !core.IsHalted && !core.IntPending && core.bus.Internal(core.reg.PC));
+	Sleep(time, t * 2);										// Back on the edge the core stopped at
+	ahead = TRUE;											// Unless BUSRQ cuts it short
 }
 
 VOID DsimModel::simulate(ABSTIME time, DSIMMODES mode) {
 }
 
 VOID DsimModel::callback(ABSTIME time, EVENTID eventid) {
-}
+	if (eventid == EV_RESYNC) {								// Simulated time caught up with the core
+		resync = NULL;
+		lastrise = 0;
+	}
+}
\ No newline at end of file
@@ -1,42 +1,105 @@
 #pragma once
 #include "StdAfx.h"
 #include "sdk/vsm.hpp"
+#include "Z80Core.h"
 
-#define InfoLog(__s__) sprintf_s(LogLineT, "%05d: ", LogLine++); myPopup->print(LogLineT); myPopup->print(__s__); myPopup->print("\n")
-
-#define DEBUGCALLS
-
-#define SetHigh setstate(time, 1, SHI)
-#define SetLow setstate(time, 1, SLO)
-#define SetFloat setstate(time, 1, FLT)
-
-#define FLG_C		0
-#define FLG_N		1
-#define FLG_PV		2
-#define FLG_F3		3
-#define FLG_H		4
-#define FLG_F5		5
-#define FLG_Z		6
-#define FLG_S		7
-
-enum CYCLES {
-	FETCH = 0,
-	READ = 1,
-	WRITE = 2,
-	IOREAD = 3,
-	IOWRITE = 4,
-	EXEC = 5
+#define SHADOW_FLT		0x10000							// Bus shadow: released by the model
+#define SHADOW_NONE		0xFFFFFFFF						// Bus shadow: never driven
+
+enum MEMKINDS {												// What a 256-byte page of the address space is
+	MEM_EXT = 0,											// On the pins
+	MEM_RAM,												// Internal memory
+	MEM_ROM													// Internal memory, writes are ignored
 };
 
-enum STATES {
-	T1p = 0,
-	T1n = 1,
-	T2p = 2,
-	T2n = 3,
-	T3p = 4,
-	T3n = 5,
-	T4p = 6,
-	T4n = 7
+// IRQSTATS: interrupt latency and handler duration histograms, in T-states
+#define IRQ_BUCKETS		16									// Below 16, then one per power of 2 up to 256K and above
+#define IRQ_NESTING		8									// Handlers followed inside each other
+
+typedef struct {
+	UINT64 latency[IRQ_BUCKETS];							// Assertion to acknowledge
+	UINT64 duration[IRQ_BUCKETS];							// Acknowledge to the end of RETI/RETN
+	UINT64 taken, returned;
+	UINT64 latsum, dursum;
+	UINT64 latmax, durmax;									// Worst cases
+	UINT16 latpc, durpc;									// PC the worst latency interrupted, RETI/RETN of the longest handler
+} tIRQSTATS;
+
+enum EVENTS {												// EVENTID of the callbacks the model sets
+	EV_RESYNC = 1,											// End of a sleep on CLK (QUANTUM run ahead, bus cycle, internal T-states)
+	EV_CLOCK												// Edges of the CLOCK the model generates
+};
+
+// Pin level bus of the core, mapped onto the DSIM pins of the component.
+// The last level driven on every output is shadowed, so re-driving a pin to
+// the level it already holds costs no event.
+//
+// With INTERNALMEM or MEMMAP the bus also owns a 64K memory: cycles on the
+// pages mapped internal are served from it, and the core runs at instruction
+// level (Step()) while it fetches from them. I/O cycles and the external pages
+// still go through the pins.
+class DsimBus
+{
+public:
+	~DsimBus() { delete[] mem; }
+
+	static const bool PINIO = true;							// Step() leaves I/O cycles to ClockEdge()
+	BOOL Internal(UINT16 addr) const { return memmap[addr >> 8] != MEM_EXT; }	// Memory cycle served by MemRead/MemWrite
+	UINT8 MemRead(UINT16 addr) { return mem[addr]; }
+	VOID MemWrite(UINT16 addr, UINT8 val) { if (memmap[addr >> 8] == MEM_RAM) mem[addr] = val; }
+
+	VOID SetAddr(UINT16 val, ABSTIME time);					// At most one bus pin event per call
+	VOID SetData(UINT8 val, ABSTIME time);
+	UINT8 GetData(void);
+	VOID HIZAddr(ABSTIME time);
+	VOID HIZData(ABSTIME time);
+	VOID SetHigh(Z80PINS pin, ABSTIME time) {
+		UINT16 m = 1 << pin;
+		if (out_known & out_high & m) { suppressed++; return; }
+		out_known |= m;
+		out_high |= m;
+		issued++;
+		pin_out[pin]->setstate(time, 1, SHI);
+	}
+	VOID SetLow(Z80PINS pin, ABSTIME time) {
+		UINT16 m = 1 << pin;
+		if (out_known & ~out_high & m) { suppressed++; return; }
+		out_known |= m;
+		out_high &= ~m;
+		issued++;
+		pin_out[pin]->setstate(time, 1, SLO);
+	}
+	BOOL WaitLow(void) { return islow(pin_WAIT->istate()); }
+	BOOL WaitAt(ABSTIME time) {								// WAIT was low at time (one change at most since), from its last edges
+		if (WaitLow()) return wait_fell <= time;
+		return wait_fell <= time && time < wait_rose;
+	}
+	VOID Release(ABSTIME time);
+	VOID Reclaim(ABSTIME time);
+	VOID Log(const char *s);
+	VOID Account(DWORD last, DWORD val, UINT width);
+
+	// Used on every clock edge
+	IDSIMPIN *pin_CLK;
+	IDSIMPIN *pin_out[NUMOUTPINS];							// Indexed by Z80PINS
+	IBUSPIN *bus_A;											// A0-A15
+	IBUSPIN *bus_D;											// D0-D7
+	DWORD drv_A = SHADOW_NONE, drv_D = SHADOW_NONE;			// Shadow of the buses, or SHADOW_FLT
+	UINT16 out_known = 0, out_high = 0;						// Shadow of pin_out, one bit per Z80PINS
+	UINT64 issued = 0, suppressed = 0;						// Output pin changes driven / skipped as redundant
+	UINT8 memmap[256] = { MEM_EXT };						// MEMKINDS of every page
+	UINT8 *mem = NULL;										// Internal memory, NULL if all the pages are external
+
+	IDSIMPIN *pin_WAIT;
+	ABSTIME wait_fell = 0, wait_rose = 0;					// Last edges of WAIT, for ClockCycle() which samples it late
+	IDSIMPIN *pin_INT, *pin_NMI;
+	IDSIMPIN *pin_RESET;
+	IDSIMPIN *pin_BUSRQ;
+
+	IDEBUGPOPUP *myPopup;
+
+	int LogLine = 1;
+	char LogLineT[10];
 };
 
 class DsimModel : public IDSIMMODEL
@@ -47,86 +110,74 @@ public:
 	VOID irqfire(ABSTIME time, DSIMMODES mode);
 	VOID nmifire(ABSTIME time, DSIMMODES mode);
 	VOID rsthandler(ABSTIME ime, DSIMMODES mode);
+	VOID waitfire(ABSTIME time, DSIMMODES mode);
+	VOID busrqfire(ABSTIME time, DSIMMODES mode);
 	VOID runctrl (RUNMODES mode);
 	VOID actuate (REALTIME time, ACTIVESTATE newstate);
 	BOOL indicate (REALTIME time, ACTIVEDATA *data);
 	VOID clockstep(ABSTIME time, DSIMMODES mode);
 	VOID simulate(ABSTIME time, DSIMMODES mode);
 	VOID callback (ABSTIME time, EVENTID eventid);
-private:
-	VOID SetAddr(UINT16 val, ABSTIME time);
-	VOID SetData(UINT8 val, ABSTIME time);
-	UINT8 GetData(void);
-	void HIZAddr(ABSTIME time);
-	void HIZData(ABSTIME time);
-	void ResetCPU(ABSTIME time);
-	int chk_nz(void);
-	int chk_z(void);
-	int chk_nc(void);
-	int chk_c(void);
-	int chk_po(void);
-	int chk_pe(void);
-	int chk_p(void);
-	int chk_m(void);
-	int cc(int n);
-	void opflags(int n, int is16, int c, int p, int v, int z, int s, int f35);
-	void alu(int n, UINT8 r);
-	void rot(int n, UINT8 * r);
-	void bit(int b, UINT8 * r);
-	void add16(UINT16 * a, UINT16 * b, int c);
-	void Execute(void);
+	VOID clocktick(ABSTIME time, EVENTID eventid);
 
+	const DsimBus &GetBus(void) { return core.bus; }
+	const UINT8 *GetMemory(void) { return core.bus.mem; }	// Internal memory, NULL if the pins are used
+	const Z80Core<DsimBus> &GetCore(void) { return core; }
+
+	// Holds the core, so it is cache line aligned as well (Z80Core's own new only covers a core allocated alone)
+	static void *operator new(size_t size) { return _aligned_malloc(size, Z80_CACHELINE); }
+	static void operator delete(void *p) { _aligned_free(p); }
+private:
+	// Everything is per instance, so several Z80s can share a schematic
 	IINSTANCE *inst;
 	IDSIMCKT *ckt;
-	IDSIMPIN *pin_M1;
-	IDSIMPIN *pin_MREQ, *pin_IORQ;
-	IDSIMPIN *pin_RD, *pin_WR;
-	IDSIMPIN *pin_RFSH;
-	IDSIMPIN *pin_HALT;
-	IDSIMPIN *pin_WAIT;
-	IDSIMPIN *pin_INT, *pin_NMI;
-	IDSIMPIN *pin_RESET;
-	IDSIMPIN *pin_BUSRQ, *pin_BUSAK;
-	IDSIMPIN *pin_CLK;
-	IDSIMPIN *pin_A[16];
-	IDSIMPIN *pin_D[8];
+	UINT64 clk = 0;											// Rising clock edges seen
+	UINT64 rst_start = 0;									// clk when $RESET$ went low
+	BOOL up = FALSE;										// Set after a valid reset, activates Z80 ops
+	UINT skip = 0;											// Clock edges left of what Step()/StepBlock() ran
+	UINT m1end = 0;											// skip when M1 goes back high (OBSERVE)
+	BOOL observe = FALSE;									// Shows PC and M1 on the pins for the instructions run by Step()
+	UINT quantum = 0;										// QUANTUM, T-states run ahead of the simulator at once
+	ABSTIME lastrise = 0;									// Time of the last rising clock edge, 0 if unknown
+	RELTIME period = 0;										// Clock period, measured on CLK or from CLOCK
+	EVENT *clkevent = NULL;									// Clock callback with CLOCK, NULL when CLK is used
+	BOOL clklevel = FALSE;									// Level of that clock
+	BOOL sched = FALSE;										// SCHEDULE, bus cycles driven ahead by ClockCycle()
+	EVENT *resync = NULL;									// Callback ending a sleep on CLK, NULL when on the edges
+	ABSTIME halted = 0;										// Time of the M1 HALT stopped the clock work on, 0 when running
+	ABSTIME stalled = 0;									// Time of the edge WAIT was sampled low on, 0 when running
+	ABSTIME released = 0;									// Time of the edge the bus was released to BUSRQ on, 0 when running
+	BOOL stopped = FALSE;									// Between Stop() and Resume(), the clock is ignored
+	ABSTIME sleepend = 0;									// Edge the last Sleep() comes back on
+	BOOL ahead = FALSE;										// That sleep covers internal code RunAhead() ran, no pin cycles
+	UINT64 imagehash = 0;									// Internal memory as loaded, keys DECODEFILE
+	char DecodeFile[256] = "";								// DECODEFILE, written when the simulation stops
+	char IrqStatsFile[256] = "";							// IRQSTATS, written when the simulation stops; no statistics if empty
+	tIRQSTATS irqstats[2];									// [0] INT, [1] NMI
+	char ProfileFile[256] = "";								// PROFILE, callgrind file written when the simulation stops
+	ABSTIME asserted[2] = { 0, 0 };							// INT/NMI assertion not acknowledged yet, 0 if none
+	ABSTIME handler[IRQ_NESTING];							// Acknowledges of the handlers running, innermost last
+	UINT8 handlerkind[IRQ_NESTING];
+	UINT nesting = 0;
 
-	IDEBUGPOPUP *myPopup;
+	Z80Core<DsimBus> core;
+	Z80Log &zlog = core.zlog;								// For the logging macros
 
-	// Global variables
-	UINT8 cycle = 0;		// Current cycle of the state machine
-	UINT8 nextcycle = 0;	// Next cycle of the state machine
-	UINT8 state = 0;		// Current t-state
-	UINT8 step = 0;			// Instruction execution step (0 = nothing to do)
-	UINT8 IsHalted = 0;		// Indicates if the processor is halted
-	UINT8 IsWaiting = 0;	// Indicates if the processor is waiting
-	UINT8 IsBusRQ = 0;		// Indicates if the processor is on bus request
-	UINT8 IsInt = 0;		// Indicates if the processor is interrupted
-	UINT8 IsNMI = 0;		// Indicates if the processor is on non-maskable interrupt
+	VOID FlushLog(void);
+	VOID InfoLine(const char *fmt, ...);
+	VOID Edge(ABSTIME time);
+	VOID RunAhead(ABSTIME time);
+	VOID Sleep(ABSTIME time, UINT n);
+	VOID Stop(void);
+	UINT64 Resume(ABSTIME from, ABSTIME time, RELTIME step);
+	VOID Halt(ABSTIME time);
+	VOID Wake(ABSTIME time);
+	VOID CutSleep(ABSTIME time);
+	BOOL Boundary(ABSTIME time);
+	VOID SaveIrqStats(void);
+	VOID SaveProfile(void);
+	VOID LoadDecoded(void);
+	VOID SaveDecoded(void);
 
-	int LogLine = 1;
-	char LogLineT[10];
 	char LogMessage[256];
-
-	// Processor registers
-#define REGSIZE 30
-	typedef struct {
-		union {
-			struct {
-				UINT8 ARRAY[REGSIZE];
-			};
-			struct {
-				UINT16 PC, IR, WZ, SP, IY, IX, HL, HL_, DE, DE_, BC, BC_, AF, AF_, IFF;
-			};
-			struct { // 0    1  2  3  4  5    6    7    8    9   10   11 12 13  14  15 16 17  18  19 20 21  22  23 24 25  26  27    28    29
-				UINT8 PCl, PCh, R, I, Z, W, SPl, SPh, IYl, IYh, IXl, IXh, L, H, L_, H_, E, D, E_, D_, C, B, C_, B_, F, A, F_, A_, IFF1, IFF2;
-			};
-		};
-	} tZ80REG;
-
-	// Processor related variables
-	UINT8 InstR = 0;		// Instruction Register
-	tZ80REG reg;			// Registers
-	UINT16 Addr;			// Memory address to read/write
-	UINT8 Data;				// Data to/from the data bus
 };
@@ -0,0 +1,2433 @@
+#pragma once
+#include "StdAfx.h"
+#include "sdk/vsm.hpp"
+#include <type_traits>
+#include "Z80Log.h"
+#include "Z80Flags.h"
+#include "Z80Prof.h"
+
+// Flag evaluation policy, the LAZYFLAGS parameter of Z80Core. When it is true
+// the ALU and INC/DEC only record their operands and F is built the first
+// time something reads it (see SyncFlags()).
+#ifndef Z80_LAZYFLAGS
+#define Z80_LAZYFLAGS	false
+#endif
+
+// Z80 core, independent of how the bus is implemented.
+//
+// The bus is a template parameter so that its accesses are resolved at compile
+// time. Two ways of driving the core are provided:
+//  - ClockEdge() runs one half T-state of the pin level bus state machine and
+//    needs SetAddr/SetData/GetData/HIZAddr/HIZData/SetHigh/SetLow/WaitLow from
+//    the bus, and WaitAt for ClockCycle() (see DsimBus in DsimModel.h);
+//  - Step() runs one instruction at transaction level and needs
+//    MemRead/MemWrite/IORead/IOWrite (see Z80MemoryBus below). A bus whose
+//    PINIO is true has no IORead/IOWrite: Step() stops in front of the I/O
+//    cycle and leaves it, and the rest of the instruction, to ClockEdge().
+//    It does the same with memory cycles on addresses that are not Internal().
+// With ClockEdge(), memory cycles on addresses the bus reports as Internal()
+// are served by MemRead/MemWrite without touching the pins, in the same time.
+// Interrupts come in through SetInt()/SetNMI(); where an instruction ends
+// (FETCH in T1p) the owner calls Accept() if IntPending is set, and goes on
+// with ClockEdge() if it sets up an acknowledge. RETI/RETN also stop there,
+// with IsRetn set until that Accept().
+// EnableProfile() counts the instructions and T-states of every PC (see
+// Z80Prof.h); the owner reports the TW it runs off the clock with Stalled().
+// Only the members actually used get instantiated, so a bus only has to
+// implement the set required by the driver it is used with. Debug output goes
+// to zlog (see Z80Log.h), whoever owns the core decides where it ends up.
+
+enum CYCLES {
+	FETCH = 0,
+	READ = 1,
+	WRITE = 2,
+	IOREAD = 3,
+	IOWRITE = 4,
+	EXEC = 5,
+	INTACK = 6											// Interrupt acknowledge (M1 of an INT or an NMI)
+};
+
+enum STATES {
+	T1p = 0,
+	T1n = 1,
+	T2p = 2,
+	T2n = 3,
+	T3p = 4,
+	T3n = 5,
+	T4p = 6,
+	T4n = 7,
+	TI3p = 8,												// T3 and T4 of an INT acknowledge, after its two automatic
+	TI3n = 9,												// TW (which are T3p to T4n)
+	TI4p = 10,
+	TI4n = 11
+};
+
+enum Z80PINS {												// Control outputs driven by the core
+	PIN_M1 = 0,
+	PIN_MREQ,
+	PIN_IORQ,
+	PIN_RD,
+	PIN_WR,
+	PIN_RFSH,
+	PIN_HALT,
+	PIN_BUSAK,
+	NUMOUTPINS
+};
+
+// Processor registers
+#define REGSIZE 30
+typedef struct {
+	union {
+		struct {
+			UINT8 ARRAY[REGSIZE];
+		};
+		struct {
+			UINT16 WORD[REGSIZE / 2];
+		};
+		struct {
+			UINT16 PC, IR, WZ, SP, IY, IX, HL, HL_, DE, DE_, BC, BC_, AF, AF_, IFF;
+		};
+		struct { // 0    1  2  3  4  5    6    7    8    9   10   11 12 13  14  15 16 17  18  19 20 21  22  23 24 25  26  27    28    29
+			UINT8 PCl, PCh, R, I, Z, W, SPl, SPh, IYl, IYh, IXl, IXh, L, H, L_, H_, E, D, E_, D_, C, B, C_, B_, F, A, F_, A_, IFF1, IFF2;
+		};
+	};
+} tZ80REG;
+
+enum REG8 {													// Offsets of the 8-bit registers in ARRAY
+	R8_PCl = 0,
+	R8_PCh = 1,
+	R8_Z = 4,
+	R8_W = 5,
+	R8_IYl = 8,
+	R8_IYh = 9,
+	R8_IXl = 10,
+	R8_IXh = 11,
+	R8_L = 12,
+	R8_H = 13,
+	R8_E = 16,
+	R8_D = 17,
+	R8_C = 20,
+	R8_B = 21,
+	R8_F = 24,
+	R8_A = 25,
+	R8_MEM = 0xFF											// (HL) or (IX/IY+*)
+};
+
+enum REG16 {												// Offsets of the 16-bit registers in WORD
+	R16_PC = 0,
+	R16_IR = 1,
+	R16_WZ = 2,
+	R16_SP = 3,
+	R16_IY = 4,
+	R16_IX = 5,
+	R16_HL = 6,
+	R16_DE = 8,
+	R16_BC = 10,
+	R16_AF = 12
+};
+
+enum PAGES {												// Opcode pages, one dispatch table each
+	PAGE_MAIN = 0,
+	PAGE_CB,
+	PAGE_ED,
+	PAGE_DD,
+	PAGE_FD,
+	PAGE_DDCB,
+	PAGE_FDCB,
+	NUMPAGES
+};
+
+enum MOPS {													// Micro-operations of the instruction sequences
+	M_END = 0,												// End of the instruction
+	M_RD,													// Memory read cycle (3 T-states)
+	M_WR,													// Memory write cycle (3 T-states)
+	M_IOR,													// I/O read cycle (4 T-states)
+	M_IOW,													// I/O write cycle (4 T-states)
+	M_INT,													// Internal operation, arg T-states
+	M_EXEC,													// Runs the handler of the instruction, which may end it here
+	M_JP,													// PC = WZ
+	M_IDX													// WZ = IX/IY + Z, then continues with the (HL) sequence
+};
+
+enum ADDRS {												// Address put on the bus by a machine cycle
+	A_PC = 0,												// PC, post incremented
+	A_SP,
+	A_SP1,													// SP + 1
+	A_SPINC,												// SP, post incremented (pop)
+	A_SPDEC,												// SP, pre decremented (push)
+	A_WZ,
+	A_WZINC,												// WZ, post incremented
+	A_RP,													// 16-bit operand of the instruction
+	A_HL,
+	A_DE,
+	A_BC,
+	A_PORT													// A on the high byte, Z on the low byte
+};
+
+// Register a machine cycle reads into or writes from: an offset in ARRAY, or one of these
+#define D_TMP		0xF0									// The Data latch only
+#define D_R			0xF1									// 8-bit operand of the instruction
+#define D_RPL		0xF2									// Low byte of the 16-bit operand
+#define D_RPH		0xF3									// High byte of the 16-bit operand
+
+typedef struct {
+	UINT8 type;												// MOPS
+	UINT8 arg;												// ADDRS for bus cycles, T-states for M_INT, phase for M_EXEC
+	UINT8 data;												// Register read into/written from by bus cycles
+} tMOP;
+
+// Machine cycles of each instruction after its opcode fetch(es)
+#define MRD(a, d)	{ M_RD, a, d }
+#define MWR(a, d)	{ M_WR, a, d }
+#define IOR(a, d)	{ M_IOR, a, d }
+#define IOW(a, d)	{ M_IOW, a, d }
+#define TN(n)		{ M_INT, n, 0 }
+#define EXE(n)		{ M_EXEC, n, 0 }
+#define JPWZ		{ M_JP, 0, 0 }
+#define IDX			{ M_IDX, 0, 0 }
+#define END			{ M_END, 0, 0 }
+static constexpr tMOP seq_nop[] = { END };
+static constexpr tMOP seq_exec[] = { EXE(0), END };
+static constexpr tMOP seq_ld_rp_nn[] = { MRD(A_PC, D_RPL), MRD(A_PC, D_RPH), END };
+static constexpr tMOP seq_add_hl_rp[] = { EXE(0), TN(7), END };
+static constexpr tMOP seq_ld_ind_a[] = { MWR(A_RP, R8_A), END };
+static constexpr tMOP seq_ld_a_ind[] = { MRD(A_RP, R8_A), END };
+static constexpr tMOP seq_ld_nn_rp[] = { MRD(A_PC, R8_Z), MRD(A_PC, R8_W), MWR(A_WZINC, D_RPL), MWR(A_WZINC, D_RPH), END };
+static constexpr tMOP seq_ld_rp_nni[] = { MRD(A_PC, R8_Z), MRD(A_PC, R8_W), MRD(A_WZINC, D_RPL), MRD(A_WZINC, D_RPH), END };
+static constexpr tMOP seq_ld_nn_a[] = { MRD(A_PC, R8_Z), MRD(A_PC, R8_W), MWR(A_WZ, R8_A), END };
+static constexpr tMOP seq_ld_a_nn[] = { MRD(A_PC, R8_Z), MRD(A_PC, R8_W), MRD(A_WZ, R8_A), END };
+static constexpr tMOP seq_inc_rp[] = { EXE(0), TN(2), END };
+static constexpr tMOP seq_rmw[] = { MRD(A_RP, D_TMP), TN(1), EXE(0), MWR(A_RP, D_TMP), END };
+static constexpr tMOP seq_ld_r_n[] = { MRD(A_PC, D_R), END };
+static constexpr tMOP seq_ld_mem_n[] = { MRD(A_PC, D_TMP), MWR(A_RP, D_TMP), END };
+static constexpr tMOP seq_ld_idx_n[] = { MRD(A_PC, R8_Z), MRD(A_PC, D_TMP), TN(2), IDX };
+static constexpr tMOP seq_st_tmp[] = { MWR(A_RP, D_TMP), END };
+static constexpr tMOP seq_djnz[] = { TN(1), MRD(A_PC, R8_Z), EXE(0), TN(5), END };
+static constexpr tMOP seq_jr[] = { MRD(A_PC, R8_Z), EXE(0), TN(5), END };
+static constexpr tMOP seq_ld_r_mem[] = { MRD(A_RP, D_R), END };
+static constexpr tMOP seq_ld_mem_r[] = { MWR(A_RP, D_R), END };
+static constexpr tMOP seq_alu_mem[] = { MRD(A_RP, D_TMP), EXE(0), END };
+static constexpr tMOP seq_alu_n[] = { MRD(A_PC, D_TMP), EXE(0), END };
+static constexpr tMOP seq_ret_cc[] = { TN(1), EXE(0), MRD(A_SPINC, R8_Z), MRD(A_SPINC, R8_W), JPWZ, END };
+static constexpr tMOP seq_pop[] = { MRD(A_SPINC, D_RPL), MRD(A_SPINC, D_RPH), END };
+static constexpr tMOP seq_ret[] = { MRD(A_SPINC, R8_Z), MRD(A_SPINC, R8_W), JPWZ, END };
+static constexpr tMOP seq_jp_cc[] = { MRD(A_PC, R8_Z), MRD(A_PC, R8_W), EXE(0), END };
+static constexpr tMOP seq_jp[] = { MRD(A_PC, R8_Z), MRD(A_PC, R8_W), JPWZ, END };
+static constexpr tMOP seq_out_n_a[] = { MRD(A_PC, R8_Z), IOW(A_PORT, R8_A), END };
+static constexpr tMOP seq_in_a_n[] = { MRD(A_PC, R8_Z), IOR(A_PORT, R8_A), END };
+static constexpr tMOP seq_ex_sp_hl[] = { MRD(A_SP, R8_Z), MRD(A_SP1, R8_W), TN(1), MWR(A_SP1, D_RPH), MWR(A_SP, D_RPL), TN(2), EXE(0), END };
+static constexpr tMOP seq_call_cc[] = { MRD(A_PC, R8_Z), MRD(A_PC, R8_W), EXE(0), TN(1), MWR(A_SPDEC, R8_PCh), MWR(A_SPDEC, R8_PCl), JPWZ, END };
+static constexpr tMOP seq_call[] = { MRD(A_PC, R8_Z), MRD(A_PC, R8_W), TN(1), MWR(A_SPDEC, R8_PCh), MWR(A_SPDEC, R8_PCl), JPWZ, END };
+static constexpr tMOP seq_push[] = { TN(1), MWR(A_SPDEC, D_RPH), MWR(A_SPDEC, D_RPL), END };
+static constexpr tMOP seq_rst[] = { TN(1), MWR(A_SPDEC, R8_PCh), MWR(A_SPDEC, R8_PCl), EXE(0), END };
+static constexpr tMOP seq_im2[] = { TN(1), MWR(A_SPDEC, R8_PCh), MWR(A_SPDEC, R8_PCl), EXE(0), MRD(A_WZINC, D_RPL), MRD(A_WZINC, D_RPH), END };
+static constexpr tMOP seq_index[] = { MRD(A_PC, R8_Z), TN(5), IDX };
+static constexpr tMOP seq_ddcb[] = { MRD(A_PC, R8_Z), MRD(A_PC, D_TMP), TN(2), EXE(0), END };
+static constexpr tMOP seq_bit_mem[] = { MRD(A_RP, D_TMP), TN(1), EXE(0), END };
+static constexpr tMOP seq_in_r_c[] = { IOR(A_BC, D_TMP), EXE(0), END };
+static constexpr tMOP seq_out_c_r[] = { EXE(0), IOW(A_BC, D_TMP), END };
+static constexpr tMOP seq_retn[] = { MRD(A_SPINC, R8_Z), MRD(A_SPINC, R8_W), EXE(0), JPWZ, END };
+static constexpr tMOP seq_ld_i_a[] = { TN(1), EXE(0), END };
+static constexpr tMOP seq_rrd[] = { MRD(A_HL, D_TMP), TN(4), EXE(0), MWR(A_HL, D_TMP), END };
+static constexpr tMOP seq_ldi[] = { MRD(A_HL, D_TMP), MWR(A_DE, D_TMP), TN(2), EXE(0), TN(5), END };
+static constexpr tMOP seq_cpi[] = { MRD(A_HL, D_TMP), TN(5), EXE(0), TN(5), END };
+static constexpr tMOP seq_ini[] = { TN(1), IOR(A_BC, D_TMP), MWR(A_HL, D_TMP), EXE(0), TN(5), END };
+static constexpr tMOP seq_outi[] = { TN(1), MRD(A_HL, D_TMP), EXE(0), IOW(A_BC, D_TMP), EXE(1), TN(5), END };
+#undef MRD
+#undef MWR
+#undef IOR
+#undef IOW
+#undef TN
+#undef EXE
+#undef JPWZ
+#undef IDX
+#undef END
+
+#include "Z80Jit.h"
+
+#define Z80_CACHELINE	64
+
+#define BLK_MAXINSTR	16									// Instructions in a decoded block
+#define BLK_ENTRIES		1024								// Decoded blocks, direct mapped by PC, power of 2
+
+// The state touched by every half T-state (registers, sequencer, bus state
+// machine) comes first and fits in two cache lines; the bus and the log follow.
+template <class BUS, bool LAZYFLAGS = Z80_LAZYFLAGS>
+class alignas(Z80_CACHELINE) Z80Core
+{
+	friend class Z80Jit<Z80Core>;
+	typedef BUS BusType;
+	typedef int (Z80Core::*HANDLER)(void);				// Returns non-zero to end the instruction early
+	typedef struct {
+		HANDLER fn;			// Handler run by M_EXEC
+		const tMOP *seq;	// Machine cycles after the opcode fetch
+		const tMOP *inner;	// (HL) sequence continued by M_IDX once the displacement is known
+		UINT8 r, r2;		// 8-bit operands (REG8)
+		UINT8 rp, rp2;		// 16-bit operands (REG16), rp is also the address of (HL) operands
+		UINT8 y;			// Condition, ALU/rotation operation, bit number, RST vector/8, IM mode or prefix page
+		UINT8 idx;			// Index register of DD/FD instructions (REG16), 0 otherwise
+	} tOPCODE;
+
+	// Decoded block cache of Step(), see EnableCache()
+	typedef struct {
+		const tOPCODE *op;	// Entry reached after the prefixes
+		UINT8 opcode;		// Last opcode byte (InstR)
+		UINT8 fetches;		// M1 cycles, prefixes included
+		UINT8 len;			// Bytes, operands included
+	} tDECODED;
+	typedef struct {
+		UINT16 pc;			// Address of the first instruction
+		UINT16 ver[2];		// pagever of the first and the last page when decoded
+		UINT8 page[2];
+		UINT8 count;		// Instructions, 0 when empty
+		UINT8 runs;			// Times StepBlock() ran it interpreted
+		const UINT8 *code;	// Host code compiled by the JIT, NULL if none
+		tDECODED ins[BLK_MAXINSTR];
+	} tBLOCK;
+	typedef struct {
+		tBLOCK blocks[BLK_ENTRIES];
+		UINT16 pagever[256];	// Bumped when a page holding decoded opcodes is written
+		UINT8 pagecode[256];	// Page holds decoded opcodes
+	} tBLKCACHE;
+
+public:
+	Z80Core(void) { if (optab[PAGE_MAIN][0].seq == NULL) BuildTables(); }
+	~Z80Core(void) { delete jit; delete cache; delete prof; }
+
+	// Cache line aligned, which plain new does not honour before C++17
+	static void *operator new(size_t size) { return _aligned_malloc(size, Z80_CACHELINE); }
+	static void operator delete(void *p) { _aligned_free(p); }
+
+	void ResetCPU(ABSTIME time);
+	void ClockEdge(ABSTIME time);
+	UINT ClockCycle(ABSTIME time, RELTIME half);
+	UINT Idle(void);
+	void Halted(UINT64 m);
+	void Stalled(UINT64 n) { Count(PROF_WAIT, (UINT)n); }	// Accounts for n TW run off the clock
+	void SetInt(bool low) { IsInt = low; Pend(); }		// Level of INT, from the owner's pin handler
+	void SetNMI(void) { IsNMI = 1; Pend(); }				// Falling edge of NMI
+	bool Accept(ABSTIME time);
+	UINT Step(void);
+	UINT StepBlock(void);
+	void EnableCache(bool on);
+	bool CacheEnabled(void) const { return cache != NULL; }
+	bool EnableJit(bool on);
+	UINT Predecode(const UINT16 *entries, int n);
+	int ListBlocks(UINT16 *pcs, UINT8 *hot, int max) const;
+	void Preload(UINT16 pc, bool hot);
+	void EnableProfile(bool on);
+	const Z80Profile *Profile(void) const { return prof; }
+	void SyncFlags(void) { if (LAZYFLAGS && lf_kind != LF_NONE) BuildF(); }	// Call before reading reg.F from outside
+
+	// Processor related variables
+	tZ80REG reg;			// Registers
+	UINT16 Addr;			// Memory address to read/write
+	UINT8 Data;				// Data to/from the data bus
+	UINT8 InstR = 0;		// Instruction Register
+	UINT8 IntMode = 0;		// Interrupt mode set by IM
+
+	// State machine
+	UINT8 cycle = 0;		// Current cycle of the state machine
+	UINT8 nextcycle = 0;	// Next cycle of the state machine
+	UINT8 state = 0;		// Current t-state
+	UINT8 IsHalted = 0;		// Indicates if the processor is halted
+	UINT8 IsWaiting = 0;	// In wait states: 1 before the rising edge of a TW, 2 before its falling edge (WAIT sampled)
+	UINT8 IsBusRQ = 0;		// Indicates if the processor is on bus request
+	UINT8 BusReq = 0;		// BUSRQ is low, set by the owner: ClockCycle() stops at the end of every M-cycle
+	UINT8 IsInt = 0;		// INT is low, see SetInt()
+	UINT8 IsNMI = 0;		// NMI latched until accepted, see SetNMI()
+	UINT8 IsRetn = 0;		// RETI/RETN ran, the owner can look before Accept() clears it
+	UINT8 IntPending = 0;	// Accept() has something to look at on the next instruction boundary
+	UINT16 RetnPC = 0;		// Address of the last RETI/RETN
+	UINT64 fetches = 0;		// Opcode fetches (M1 cycles), by ClockEdge() or Step()
+
+private:
+	UINT8 page = PAGE_MAIN;	// Page the next opcode is looked up in, set by prefixes
+	UINT8 phase = 0;		// arg of the M_EXEC running the handler
+	UINT8 eidelay = 0;		// EI just run, INT is not taken before the next instruction
+	UINT8 ack = 0;			// Interrupt INTACK acknowledges: IntMode, or ACK_NMI
+	UINT16 wait = 0;		// Half T-states left in an internal operation
+	const tOPCODE *op = &optab[PAGE_MAIN][0];	// Table entry of the instruction being executed
+	const tMOP *mop = seq_nop;	// Next micro-op of the instruction
+	const tMOP *bop = seq_nop;	// Micro-op of the machine cycle on the bus
+
+	// Last flag-producing operation when LAZYFLAGS, F is stale unless lf_kind is LF_NONE
+	UINT8 lf_kind = LF_NONE;
+	UINT8 lf_a = 0;			// Operands (b is the carry kept by INC/DEC)
+	UINT8 lf_b = 0;
+	UINT16 lf_res = 0;		// Result with the carry/borrow in bit 8
+
+	// Decoded block cache, NULL unless enabled
+	tBLKCACHE *cache = NULL;
+	const tBLOCK *blk = NULL;	// Block Step() is running
+	UINT8 blk_idx = 0;		// Next instruction in it
+	UINT16 blk_pc = 0;		// Its address
+	Z80Jit<Z80Core> *jit = NULL;	// Block compiler of StepBlock(), NULL unless enabled
+
+	// Per-PC profile, NULL unless enabled
+	Z80Profile *prof = NULL;
+	UINT16 InstPC = 0;		// Address of the instruction the cycles count for
+
+public:
+	BUS bus;
+	Z80Log zlog;			// Debug log, off until SetLevel()
+	UINT64 blk_hits = 0;	// Instructions Step() found decoded
+	UINT64 blk_misses = 0;	// Instructions Step() had to decode
+	UINT64 blk_invalidations = 0;	// Pages of decoded opcodes written to
+	UINT64 jit_runs = 0;	// Compiled blocks StepBlock() ran
+
+private:
+
+	static tOPCODE optab[NUMPAGES][256];	// Dispatch tables, built once for all the instances
+	static const UINT8 ACK_NMI = 3;
+	static tOPCODE acktab[4];				// What follows the acknowledge: IM 1, IM 2 and NMI (IM 0 runs the opcode read)
+	static void BuildTables(void);
+	static void BuildMain(tOPCODE *tab, UINT8 hl, UINT8 h, UINT8 l, UINT8 idx, UINT8 cbpage);
+	static void BuildCB(tOPCODE *tab, UINT8 addr, int regs);
+	static void BuildED(tOPCODE *tab);
+	static void SetOp(tOPCODE *e, HANDLER fn, const tMOP *seq, UINT8 r = 0, UINT8 r2 = 0, UINT8 rp = 0, UINT8 rp2 = 0, UINT8 y = 0);
+	static void SetMemOp(tOPCODE *e, HANDLER fn, const tMOP *seq, UINT8 idx, UINT8 r = 0, UINT8 y = 0);
+	static const char *Name8(UINT8 r);
+	static const char *Name16(UINT8 rp);
+
+	int chk_nz(void);
+	int chk_z(void);
+	int chk_nc(void);
+	int chk_c(void);
+	int chk_po(void);
+	int chk_pe(void);
+	int chk_p(void);
+	int chk_m(void);
+	int cc(int n);
+	enum LAZYKINDS { LF_NONE = 0, LF_ADD, LF_SUB, LF_CP, LF_AND, LF_OR, LF_INC, LF_DEC };
+	static UINT8 AluFlags(int kind, UINT8 a, UINT8 b, int t);
+	void BuildF(void);
+	int CarryF(void);
+	void IncDecFlags(int kind, UINT8 res);
+	void alu(int n, UINT8 r);
+	void rot(int n, UINT8 * r);
+	void bit(int b, UINT8 val, UINT8 f53);
+	void add16(UINT16 * a, UINT16 * b, int c);
+	void sub16(UINT16 * a, UINT16 * b, int c);
+	void LogReg8(UINT8 r);
+	void LogReg16(UINT8 rp);
+
+	// Sequencer
+	void Decode(void);
+	const tMOP *Sequence(void);
+	const tDECODED *Cached(void);
+	UINT StepDecoded(const tDECODED *d);
+	UINT Execute(UINT t);
+	tBLOCK *Lookup(UINT16 pc);
+	bool Stale(const tBLOCK *b) const { return cache->pagever[b->page[0]] != b->ver[0] || cache->pagever[b->page[1]] != b->ver[1]; }
+	void BuildBlock(tBLOCK *b, UINT16 pc);
+	void Written(UINT16 addr) { if (cache != NULL && cache->pagecode[addr >> 8]) Invalidate(addr >> 8); }
+	void Invalidate(UINT8 p);
+	void FlushCode(void);
+	static void Measure(const tOPCODE *e, tDECODED *d);
+	static bool Branches(const tOPCODE *e);
+	void Next(void);
+	void Count(UINT kind, UINT t) { if (prof != NULL) prof->pc[InstPC].t[kind] += t; }
+	void CountFetch(UINT n);
+	void Pend(void) { IntPending = IsNMI | (IsInt & reg.IFF1) | eidelay | IsRetn; }
+	void Acknowledged(ABSTIME time);
+	bool Waited(void);
+	UINT EndCycle(ABSTIME time, RELTIME half);
+	void Cycle(const tMOP *m);
+	void BusCycle(const tMOP *m);
+	int IOStep(const tMOP *m, std::false_type);
+	int IOStep(const tMOP *m, std::true_type);
+	UINT16 Address(UINT8 src);
+	UINT8 *Operand(UINT8 d);
+
+	// Instruction handlers
+	int op_prefix(void);
+	int op_ddcb(void);
+	int op_ex_af(void);
+	int op_djnz(void);
+	int op_jr(void);
+	int op_jr_cc(void);
+	int op_add_hl_rp(void);
+	int op_inc_rp(void);
+	int op_dec_rp(void);
+	int op_inc_r(void);
+	int op_inc_mem(void);
+	int op_dec_r(void);
+	int op_dec_mem(void);
+	int op_rota(void);
+	int op_daa(void);
+	int op_cpl(void);
+	int op_scf(void);
+	int op_ccf(void);
+	int op_halt(void);
+	int op_ld_r_r(void);
+	int op_alu_r(void);
+	int op_alu_mem(void);
+	int op_cond(void);
+	int op_exx(void);
+	int op_jp_hl(void);
+	int op_ld_sp_hl(void);
+	int op_jp_cc(void);
+	int op_ex_sp_hl(void);
+	int op_ex_de_hl(void);
+	int op_di(void);
+	int op_ei(void);
+	int op_rst(void);
+	int op_nmi(void);
+	int op_im2(void);
+	int op_rot_r(void);
+	int op_rot_mem(void);
+	int op_bit_r(void);
+	int op_bit_mem(void);
+	int op_res_r(void);
+	int op_res_mem(void);
+	int op_set_r(void);
+	int op_set_mem(void);
+	int op_in_r_c(void);
+	int op_out_c_r(void);
+	int op_sbc_hl(void);
+	int op_adc_hl(void);
+	int op_neg(void);
+	int op_retn(void);
+	int op_im(void);
+	int op_ld_i_a(void);
+	int op_ld_r_a(void);
+	int op_ld_a_i(void);
+	int op_ld_a_r(void);
+	int op_rrd(void);
+	int op_rld(void);
+	int op_ldi(void);
+	int op_cpi(void);
+	int op_ini(void);
+	int op_outi(void);
+};
+
+// Plain 64K memory bus for running the core outside a simulator
+class Z80MemoryBus
+{
+public:
+	static const bool PINIO = false;						// I/O is done by IORead/IOWrite
+	bool Internal(UINT16) const { return true; }			// All the memory is in mem
+	UINT8 MemRead(UINT16 addr) { return mem[addr]; }
+	void MemWrite(UINT16 addr, UINT8 val) { mem[addr] = val; }
+	UINT8 IORead(UINT16) { return 0xFF; }
+	void IOWrite(UINT16, UINT8) { }
+
+	UINT8 mem[0x10000];
+};
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::ResetCPU(ABSTIME time) {		// Resets the CPU
+	int i;
+
+	InfoLog("Resetting CPU...");
+
+	// zeroes all the flags
+	cycle = 0;
+	nextcycle = 0;
+	state = 0;
+	page = PAGE_MAIN;
+	lf_kind = LF_NONE;
+	op = &optab[PAGE_MAIN][0];
+	mop = seq_nop;
+	bop = seq_nop;
+	blk = NULL;
+	phase = 0;
+	wait = 0;
+	IntMode = 0;
+	IsHalted = 0;
+	IsWaiting = 0;
+	IsBusRQ = 0;
+	IsNMI = 0;												// IsInt is the level of the pin, it stays
+	IsRetn = 0;
+	IntPending = 0;
+	eidelay = 0;
+
+	// zeroes all the registers
+	for (i = 0; i < REGSIZE; i++)
+		reg.ARRAY[i] = 0;
+
+	// sets all output pins to high
+	bus.SetHigh(PIN_M1, time);
+	bus.SetHigh(PIN_MREQ, time);
+	bus.SetHigh(PIN_IORQ, time);
+	bus.SetHigh(PIN_RD, time);
+	bus.SetHigh(PIN_WR, time);
+	bus.SetHigh(PIN_RFSH, time);
+	bus.SetHigh(PIN_HALT, time);
+	bus.SetHigh(PIN_BUSAK, time);
+
+	bus.HIZAddr(time);
+	bus.HIZData(time);
+}
+
+/* condition checks */
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::chk_nz(void) {
+	return ((reg.F & (1 << FLG_Z)) ? 0 : 1);
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::chk_z(void) {
+	return ((reg.F & (1 << FLG_Z)) ? 1 : 0);
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::chk_nc(void) {
+	return ((reg.F & (1 << FLG_C)) ? 0 : 1);
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::chk_c(void) {
+	return ((reg.F & (1 << FLG_C)) ? 1 : 0);
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::chk_po(void) {
+	return ((reg.F & (1 << FLG_PV)) ? 0 : 1);
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::chk_pe(void) {
+	return ((reg.F & (1 << FLG_PV)) ? 1 : 0);
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::chk_p(void) {
+	return ((reg.F & (1 << FLG_S)) ? 0 : 1);
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::chk_m(void) {
+	return ((reg.F & (1 << FLG_S)) ? 1 : 0);
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::cc(int n) {
+	if (LAZYFLAGS && lf_kind != LF_NONE && n < 4) {		// Z and C straight from the recorded result
+		int f = (n & 2) ? CarryF() : !(lf_res & 0xFF);
+		return (n & 1) ? f : !f;
+	}
+	SyncFlags();
+	switch (n) {
+	case 0: return chk_nz();
+	case 1: return chk_z();
+	case 2: return chk_nc();
+	case 3: return chk_c();
+	case 4: return chk_po();
+	case 5: return chk_pe();
+	case 6: return chk_p();
+	case 7: return chk_m();
+	default: return 0;
+	}
+}
+
+/* flags of the ALU and INC/DEC, t is the result with the carry/borrow in bit 8 */
+template <class BUS, bool LAZYFLAGS>
+UINT8 Z80Core<BUS, LAZYFLAGS>::AluFlags(int kind, UINT8 a, UINT8 b, int t) {
+	switch (kind) {
+	case LF_ADD:
+		return (UINT8)(((t >> 8) & F_C) | flags_sz53[t & 0xFF] | flags_hadd[FlagIdx(a, b, t) & 7] | flags_vadd[FlagIdx(a, b, t) >> 4]);
+	case LF_SUB:
+		return (UINT8)(((t >> 8) & F_C) | F_N | flags_sz53[t & 0xFF] | flags_hsub[FlagIdx(a, b, t) & 7] | flags_vsub[FlagIdx(a, b, t) >> 4]);
+	case LF_CP:													// CP takes F3/F5 from the operand
+		return (UINT8)(((t >> 8) & F_C) | F_N | (flags_sz53[t & 0xFF] & ~F_53) | (b & F_53) | flags_hsub[FlagIdx(a, b, t) & 7] | flags_vsub[FlagIdx(a, b, t) >> 4]);
+	case LF_AND:
+		return F_H | flags_sz53p[t & 0xFF];
+	case LF_OR:													// XOR too
+		return flags_sz53p[t & 0xFF];
+	case LF_INC:
+		return b | flags_inc[t & 0xFF];
+	default:
+		return b | flags_dec[t & 0xFF];
+	}
+}
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::BuildF(void) {
+	reg.F = AluFlags(lf_kind, lf_a, lf_b, lf_res);
+	lf_kind = LF_NONE;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::CarryF(void) {
+	if (!LAZYFLAGS || lf_kind == LF_NONE) return reg.F & F_C;
+	switch (lf_kind) {
+	case LF_INC:
+	case LF_DEC: return lf_b;
+	case LF_AND:
+	case LF_OR: return 0;
+	default: return (lf_res >> 8) & 1;
+	}
+}
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::IncDecFlags(int kind, UINT8 res) {
+	if (LAZYFLAGS) {
+		lf_b = (UINT8)CarryF();
+		lf_kind = (UINT8)kind;
+		lf_res = res;
+	}
+	else reg.F = AluFlags(kind, 0, reg.F & F_C, res);
+}
+
+/* ALU operations */
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::alu(int n, UINT8 r) {
+	int t, kind;
+	switch (n) {
+	case 0: // ADD A,
+	case 1: // ADC A,
+		t = reg.A + r + ((n == 1) ? CarryF() : 0);
+		kind = LF_ADD;
+		break;
+	case 2: // SUB
+	case 3: // SBC A,
+	case 7: // CP
+		t = reg.A - r - ((n == 3) ? CarryF() : 0);
+		kind = (n == 7) ? LF_CP : LF_SUB;
+		break;
+	case 4: // AND
+		t = reg.A & r;
+		kind = LF_AND;
+		break;
+	case 5: // XOR
+		t = reg.A ^ r;
+		kind = LF_OR;
+		break;
+	default: // OR
+		t = reg.A | r;
+		kind = LF_OR;
+		break;
+	}
+	if (LAZYFLAGS) {
+		lf_kind = (UINT8)kind;
+		lf_a = reg.A;
+		lf_b = r;
+		lf_res = (UINT16)(t & 0x1FF);
+	}
+	else reg.F = AluFlags(kind, reg.A, r, t);
+	if (n != 7) reg.A = (UINT8)t;
+}
+
+/* rotation/shift operations, RLCA/RRCA/RLA/RRA fix up F afterwards */
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::rot(int n, UINT8 *r) {
+	SyncFlags();
+	UINT8 v = *r, c;
+	switch (n) {
+	case 0: // RLC
+		c = v >> 7;
+		v = (v << 1) | c;
+		break;
+	case 1: // RRC
+		c = v & 1;
+		v = (v >> 1) | (c << 7);
+		break;
+	case 2: // RL
+		c = v >> 7;
+		v = (v << 1) | (reg.F & F_C);
+		break;
+	case 3: // RR
+		c = v & 1;
+		v = (v >> 1) | ((reg.F & F_C) << 7);
+		break;
+	case 4: // SLA
+		c = v >> 7;
+		v <<= 1;
+		break;
+	case 5: // SRA
+		c = v & 1;
+		v = (v >> 1) | (v & 0x80);
+		break;
+	case 6: // SLL
+		c = v >> 7;
+		v = (v << 1) | 1;
+		break;
+	default: // SRL
+		c = v & 1;
+		v >>= 1;
+		break;
+	}
+	reg.F = c | flags_sz53p[v];
+	*r = v;
+}
+
+/* test bit, F3/F5 come from f53 (the operand, or W for memory) */
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::bit(int b, UINT8 val, UINT8 f53) {
+	SyncFlags();
+	val &= (1 << b);
+	reg.F = (reg.F & F_C) | F_H | (f53 & F_53) | (val & F_S) | (val ? 0 : (F_Z | F_PV));
+}
+
+/* 16bit addition routine, c selects ADC */
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::add16(UINT16 *a, UINT16 *b, int c) {
+	SyncFlags();
+	int t = *a + *b + (c ? (reg.F & F_C) : 0);
+	int i = FlagIdx(*a >> 8, *b >> 8, t >> 8);
+
+	if (c) reg.F = (UINT8)(((t >> 16) & F_C) | ((t >> 8) & (F_S | F_53)) | flags_hadd[i & 7] | flags_vadd[i >> 4] | ((t & 0xFFFF) ? 0 : F_Z));
+	else reg.F = (UINT8)((reg.F & (F_S | F_Z | F_PV)) | ((t >> 16) & F_C) | ((t >> 8) & F_53) | flags_hadd[i & 7]);
+	*a = (UINT16)t;
+}
+
+/* 16bit subtraction routine (SBC HL) */
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::sub16(UINT16 *a, UINT16 *b, int c) {
+	SyncFlags();
+	int t = *a - *b - (c ? (reg.F & F_C) : 0);
+	int i = FlagIdx(*a >> 8, *b >> 8, t >> 8);
+
+	reg.F = (UINT8)(((t >> 16) & F_C) | F_N | ((t >> 8) & (F_S | F_53)) | flags_hsub[i & 7] | flags_vsub[i >> 4] | ((t & 0xFFFF) ? 0 : F_Z));
+	*a = (UINT16)t;
+}
+
+/* register names for the debug log */
+template <class BUS, bool LAZYFLAGS>
+const char *Z80Core<BUS, LAZYFLAGS>::Name8(UINT8 r) {
+	static const char *names[REGSIZE] = { "PCl", "PCh", "R", "I", "Z", "W", "SPl", "SPh", "IYl", "IYh", "IXl", "IXh", "L", "H", "L'", "H'",
+		"E", "D", "E'", "D'", "C", "B", "C'", "B'", "F", "A", "F'", "A'", "IFF1", "IFF2" };
+	return (r < REGSIZE) ? names[r] : "(HL)";
+}
+template <class BUS, bool LAZYFLAGS>
+const char *Z80Core<BUS, LAZYFLAGS>::Name16(UINT8 rp) {
+	static const char *names[REGSIZE / 2] = { "PC", "IR", "WZ", "SP", "IY", "IX", "HL", "HL'", "DE", "DE'", "BC", "BC'", "AF", "AF'", "IFF" };
+	return (rp < REGSIZE / 2) ? names[rp] : "??";
+}
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::LogReg8(UINT8 r) {
+	Z80LOGS(LOG_DEBUG, "        %s=0x%02x", Name8(r), reg.ARRAY[r]);
+}
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::LogReg16(UINT8 rp) {
+	Z80LOGS(LOG_DEBUG, "        %s=0x%04x", Name16(rp), reg.WORD[rp]);
+}
+
+/* dispatch tables */
+template <class BUS, bool LAZYFLAGS>
+typename Z80Core<BUS, LAZYFLAGS>::tOPCODE Z80Core<BUS, LAZYFLAGS>::optab[NUMPAGES][256];
+template <class BUS, bool LAZYFLAGS>
+typename Z80Core<BUS, LAZYFLAGS>::tOPCODE Z80Core<BUS, LAZYFLAGS>::acktab[4];
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::SetOp(tOPCODE *e, HANDLER fn, const tMOP *seq, UINT8 r, UINT8 r2, UINT8 rp, UINT8 rp2, UINT8 y) {
+	e->fn = fn;
+	e->seq = seq;
+	e->inner = NULL;
+	e->r = r;
+	e->r2 = r2;
+	e->rp = rp;
+	e->rp2 = rp2;
+	e->y = y;
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::SetMemOp(tOPCODE *e, HANDLER fn, const tMOP *seq, UINT8 idx, UINT8 r, UINT8 y) {	// Instruction with an (HL) or (IX/IY+*) operand
+	if (idx) {
+		SetOp(e, fn, seq_index, r, 0, R16_WZ, 0, y);		// The displacement is added into WZ before the (HL) sequence
+		e->inner = seq;
+	}
+	else SetOp(e, fn, seq, r, 0, R16_HL, 0, y);
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::BuildMain(tOPCODE *tab, UINT8 hl, UINT8 h, UINT8 l, UINT8 idx, UINT8 cbpage) {	// Unprefixed opcodes, or DD/FD with HL replaced by IX/IY
+	const UINT8 r[8] = { R8_B, R8_C, R8_D, R8_E, h, l, R8_MEM, R8_A };
+	const UINT8 rm[8] = { R8_B, R8_C, R8_D, R8_E, R8_H, R8_L, R8_MEM, R8_A };	// H and L are not replaced next to (IX/IY+*)
+	const UINT8 rp[4] = { R16_BC, R16_DE, hl, R16_SP };
+	const UINT8 rp2[4] = { R16_BC, R16_DE, hl, R16_AF };
+
+	for (int n = 0; n < 256; n++) {
+		int x = (n >> 6) & 3, y = (n >> 3) & 7, z = n & 7, p = (y >> 1) & 3, q = y & 1;
+		tOPCODE *e = &tab[n];
+
+		SetOp(e, NULL, seq_nop);
+		switch (x) {
+		case 0:
+			switch (z) {
+			case 0:
+				switch (y) {
+				case 0: SetOp(e, NULL, seq_nop); break;
+				case 1: SetOp(e, &Z80Core::op_ex_af, seq_exec); break;
+				case 2: SetOp(e, &Z80Core::op_djnz, seq_djnz); break;
+				case 3: SetOp(e, &Z80Core::op_jr, seq_jr); break;
+				default: SetOp(e, &Z80Core::op_jr_cc, seq_jr, 0, 0, 0, 0, y - 4); break;
+				}
+				break;
+			case 1:
+				if (!q) SetOp(e, NULL, seq_ld_rp_nn, 0, 0, rp[p]);
+				else SetOp(e, &Z80Core::op_add_hl_rp, seq_add_hl_rp, 0, 0, hl, rp[p]);
+				break;
+			case 2:
+				switch (y) {
+				case 0: SetOp(e, NULL, seq_ld_ind_a, 0, 0, R16_BC); break;
+				case 1: SetOp(e, NULL, seq_ld_a_ind, 0, 0, R16_BC); break;
+				case 2: SetOp(e, NULL, seq_ld_ind_a, 0, 0, R16_DE); break;
+				case 3: SetOp(e, NULL, seq_ld_a_ind, 0, 0, R16_DE); break;
+				case 4: SetOp(e, NULL, seq_ld_nn_rp, 0, 0, hl); break;
+				case 5: SetOp(e, NULL, seq_ld_rp_nni, 0, 0, hl); break;
+				case 6: SetOp(e, NULL, seq_ld_nn_a); break;
+				case 7: SetOp(e, NULL, seq_ld_a_nn); break;
+				}
+				break;
+			case 3:
+				SetOp(e, q ? &Z80Core::op_dec_rp : &Z80Core::op_inc_rp, seq_inc_rp, 0, 0, rp[p]);
+				break;
+			case 4:
+				if (y == 6) SetMemOp(e, &Z80Core::op_inc_mem, seq_rmw, idx);
+				else SetOp(e, &Z80Core::op_inc_r, seq_exec, r[y]);
+				break;
+			case 5:
+				if (y == 6) SetMemOp(e, &Z80Core::op_dec_mem, seq_rmw, idx);
+				else SetOp(e, &Z80Core::op_dec_r, seq_exec, r[y]);
+				break;
+			case 6:
+				if (y != 6) SetOp(e, NULL, seq_ld_r_n, r[y]);
+				else if (!idx) SetOp(e, NULL, seq_ld_mem_n, 0, 0, R16_HL);
+				else {
+					SetOp(e, NULL, seq_ld_idx_n, 0, 0, R16_WZ);		// Displacement and data are read before adding
+					e->inner = seq_st_tmp;
+				}
+				break;
+			case 7:
+				switch (y) {
+				case 4: SetOp(e, &Z80Core::op_daa, seq_exec); break;
+				case 5: SetOp(e, &Z80Core::op_cpl, seq_exec); break;
+				case 6: SetOp(e, &Z80Core::op_scf, seq_exec); break;
+				case 7: SetOp(e, &Z80Core::op_ccf, seq_exec); break;
+				default: SetOp(e, &Z80Core::op_rota, seq_exec, 0, 0, 0, 0, y); break;
+				}
+				break;
+			}
+			break;
+		case 1:
+			if (y == 6 && z == 6) SetOp(e, &Z80Core::op_halt, seq_exec);
+			else if (y == 6) SetMemOp(e, NULL, seq_ld_mem_r, idx, rm[z]);
+			else if (z == 6) SetMemOp(e, NULL, seq_ld_r_mem, idx, rm[y]);
+			else SetOp(e, &Z80Core::op_ld_r_r, seq_exec, r[y], r[z]);
+			break;
+		case 2:
+			if (z == 6) SetMemOp(e, &Z80Core::op_alu_mem, seq_alu_mem, idx, 0, y);
+			else SetOp(e, &Z80Core::op_alu_r, seq_exec, r[z], 0, 0, 0, y);
+			break;
+		case 3:
+			switch (z) {
+			case 0: SetOp(e, &Z80Core::op_cond, seq_ret_cc, 0, 0, 0, 0, y); break;
+			case 1:
+				if (!q) SetOp(e, NULL, seq_pop, 0, 0, rp2[p]);
+				else {
+					switch (p) {
+					case 0: SetOp(e, NULL, seq_ret); break;
+					case 1: SetOp(e, &Z80Core::op_exx, seq_exec); break;
+					case 2: SetOp(e, &Z80Core::op_jp_hl, seq_exec, 0, 0, hl); break;
+					case 3: SetOp(e, &Z80Core::op_ld_sp_hl, seq_inc_rp, 0, 0, hl); break;
+					}
+				}
+				break;
+			case 2: SetOp(e, &Z80Core::op_jp_cc, seq_jp_cc, 0, 0, 0, 0, y); break;
+			case 3:
+				switch (y) {
+				case 0: SetOp(e, NULL, seq_jp); break;
+				case 1:
+					if (idx) SetOp(e, &Z80Core::op_ddcb, seq_ddcb, 0, 0, 0, 0, cbpage);
+					else SetOp(e, &Z80Core::op_prefix, seq_exec, 0, 0, 0, 0, cbpage);
+					break;
+				case 2: SetOp(e, NULL, seq_out_n_a); break;
+				case 3: SetOp(e, NULL, seq_in_a_n); break;
+				case 4: SetOp(e, &Z80Core::op_ex_sp_hl, seq_ex_sp_hl, 0, 0, hl); break;
+				case 5: SetOp(e, &Z80Core::op_ex_de_hl, seq_exec); break;
+				case 6: SetOp(e, &Z80Core::op_di, seq_exec); break;
+				case 7: SetOp(e, &Z80Core::op_ei, seq_exec); break;
+				}
+				break;
+			case 4: SetOp(e, &Z80Core::op_cond, seq_call_cc, 0, 0, 0, 0, y); break;
+			case 5:
+				if (!q) SetOp(e, NULL, seq_push, 0, 0, rp2[p]);
+				else {
+					switch (p) {
+					case 0: SetOp(e, NULL, seq_call); break;
+					case 1: SetOp(e, &Z80Core::op_prefix, seq_exec, 0, 0, 0, 0, PAGE_DD); break;
+					case 2: SetOp(e, &Z80Core::op_prefix, seq_exec, 0, 0, 0, 0, PAGE_ED); break;
+					case 3: SetOp(e, &Z80Core::op_prefix, seq_exec, 0, 0, 0, 0, PAGE_FD); break;
+					}
+				}
+				break;
+			case 6: SetOp(e, &Z80Core::op_alu_mem, seq_alu_n, 0, 0, 0, 0, y); break;
+			case 7: SetOp(e, &Z80Core::op_rst, seq_rst, 0, 0, 0, 0, y); break;
+			}
+			break;
+		}
+		e->idx = idx;
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::BuildCB(tOPCODE *tab, UINT8 addr, int regs) {	// CB page, or DDCB/FDCB with every operand at (IX/IY+*)
+	const UINT8 r[8] = { R8_B, R8_C, R8_D, R8_E, R8_H, R8_L, R8_MEM, R8_A };
+	const HANDLER fr[4] = { &Z80Core::op_rot_r, &Z80Core::op_bit_r, &Z80Core::op_res_r, &Z80Core::op_set_r };
+	const HANDLER fm[4] = { &Z80Core::op_rot_mem, &Z80Core::op_bit_mem, &Z80Core::op_res_mem, &Z80Core::op_set_mem };
+
+	for (int n = 0; n < 256; n++) {
+		int x = (n >> 6) & 3, y = (n >> 3) & 7, z = n & 7;
+
+		if (z != 6 && regs) SetOp(&tab[n], fr[x], seq_exec, r[z], 0, 0, 0, y);
+		else SetOp(&tab[n], fm[x], (x == 1) ? seq_bit_mem : seq_rmw, regs ? (UINT8)R8_MEM : r[z], 0, addr, 0, y);	// DDCB/FDCB also copy the result to r[z]
+		tab[n].idx = 0;
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::BuildED(tOPCODE *tab) {
+	const UINT8 r[8] = { R8_B, R8_C, R8_D, R8_E, R8_H, R8_L, R8_MEM, R8_A };
+	const UINT8 rp[4] = { R16_BC, R16_DE, R16_HL, R16_SP };
+	const UINT8 im[8] = { 0, 0, 1, 2, 0, 0, 1, 2 };
+	const HANDLER ldir[4] = { &Z80Core::op_ld_i_a, &Z80Core::op_ld_r_a, &Z80Core::op_ld_a_i, &Z80Core::op_ld_a_r };
+	const HANDLER block[4] = { &Z80Core::op_ldi, &Z80Core::op_cpi, &Z80Core::op_ini, &Z80Core::op_outi };
+	const tMOP *blockseq[4] = { seq_ldi, seq_cpi, seq_ini, seq_outi };
+
+	for (int n = 0; n < 256; n++) {
+		int x = (n >> 6) & 3, y = (n >> 3) & 7, z = n & 7, p = (y >> 1) & 3, q = y & 1;
+		tOPCODE *e = &tab[n];
+
+		SetOp(e, NULL, seq_nop);								// Invalid opcodes run as two NOPs
+		if (x == 1) {
+			switch (z) {
+			case 0: SetOp(e, &Z80Core::op_in_r_c, seq_in_r_c, r[y]); break;
+			case 1: SetOp(e, &Z80Core::op_out_c_r, seq_out_c_r, r[y]); break;
+			case 2: SetOp(e, q ? &Z80Core::op_adc_hl : &Z80Core::op_sbc_hl, seq_add_hl_rp, 0, 0, R16_HL, rp[p]); break;
+			case 3: SetOp(e, NULL, q ? seq_ld_rp_nni : seq_ld_nn_rp, 0, 0, rp[p]); break;
+			case 4: SetOp(e, &Z80Core::op_neg, seq_exec); break;
+			case 5: SetOp(e, &Z80Core::op_retn, seq_retn); break;
+			case 6: SetOp(e, &Z80Core::op_im, seq_exec, 0, 0, 0, 0, im[y]); break;
+			case 7:
+				if (y < 4) SetOp(e, ldir[y], seq_ld_i_a);
+				else if (y == 4) SetOp(e, &Z80Core::op_rrd, seq_rrd);
+				else if (y == 5) SetOp(e, &Z80Core::op_rld, seq_rrd);
+				break;
+			}
+		}
+		else if (x == 2 && z < 4 && y >= 4) SetOp(e, block[z], blockseq[z], 0, 0, 0, 0, y);	// LDI/CPI/INI/OUTI and their D/IR/DR forms
+		e->idx = 0;
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::BuildTables(void) {			// Decodes every opcode of every page once
+	BuildMain(optab[PAGE_MAIN], R16_HL, R8_H, R8_L, 0, PAGE_CB);
+	BuildMain(optab[PAGE_DD], R16_IX, R8_IXh, R8_IXl, R16_IX, PAGE_DDCB);
+	BuildMain(optab[PAGE_FD], R16_IY, R8_IYh, R8_IYl, R16_IY, PAGE_FDCB);
+	BuildCB(optab[PAGE_CB], R16_HL, 1);
+	BuildCB(optab[PAGE_DDCB], R16_WZ, 0);
+	BuildCB(optab[PAGE_FDCB], R16_WZ, 0);
+	BuildED(optab[PAGE_ED]);
+	SetOp(&acktab[1], &Z80Core::op_rst, seq_rst, 0, 0, 0, 0, 7);	// RST 38h
+	SetOp(&acktab[2], &Z80Core::op_im2, seq_im2, 0, 0, R16_PC);	// PC read from the table at I:vector
+	SetOp(&acktab[ACK_NMI], &Z80Core::op_nmi, seq_rst);
+}
+
+/* sequencer */
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::Decode(void) {				// Looks the fetched opcode up in the table of the current page
+	op = &optab[page][InstR];
+	mop = op->seq;
+	page = PAGE_MAIN;
+}
+
+template <class BUS, bool LAZYFLAGS>
+const tMOP *Z80Core<BUS, LAZYFLAGS>::Sequence(void) {		// Runs micro-ops up to the next machine cycle, NULL at the end of the instruction
+	for (;;) {
+		const tMOP *m = mop++;
+		switch (m->type) {
+		case M_EXEC:
+			phase = m->arg;
+			if ((this->*op->fn)()) return NULL;
+			break;
+		case M_JP:
+			reg.PC = reg.WZ;
+			LogReg16(R16_PC);
+			break;
+		case M_IDX:
+			reg.WZ = reg.WORD[op->idx] + (INT8)reg.Z;
+			mop = op->inner;
+			break;
+		case M_END:
+			return NULL;
+		default:
+			return m;
+		}
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT16 Z80Core<BUS, LAZYFLAGS>::Address(UINT8 src) {
+	switch (src) {
+	case A_PC: return reg.PC++;
+	case A_SP: return reg.SP;
+	case A_SP1: return reg.SP + 1;
+	case A_SPINC: return reg.SP++;
+	case A_SPDEC: return --reg.SP;
+	case A_WZ: return reg.WZ;
+	case A_WZINC: return reg.WZ++;
+	case A_RP: return reg.WORD[op->rp];
+	case A_HL: return reg.HL;
+	case A_DE: return reg.DE;
+	case A_BC: return reg.BC;
+	case A_PORT: return (reg.A << 8) | reg.Z;
+	default: return 0;
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT8 *Z80Core<BUS, LAZYFLAGS>::Operand(UINT8 d) {
+	switch (d) {
+	case D_TMP: return &Data;
+	case D_R: return &reg.ARRAY[op->r];
+	case D_RPL:
+		if (LAZYFLAGS && op->rp == R16_AF) SyncFlags();		// PUSH AF / POP AF
+		return &reg.ARRAY[op->rp * 2];
+	case D_RPH: return &reg.ARRAY[op->rp * 2 + 1];
+	default: return &reg.ARRAY[d];
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::Next(void) {					// Sets up the next machine cycle of the pin level state machine
+	Cycle(Sequence());
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::Cycle(const tMOP *m) {		// Sets up the machine cycle of m, NULL for the next opcode fetch
+	if (m == NULL) {
+		cycle = FETCH;
+		return;
+	}
+	if (m->type == M_INT) {
+		Count(PROF_INTERNAL, m->arg);
+		bop = m;
+		cycle = EXEC;
+		wait = m->arg * 2;
+		return;
+	}
+	Addr = Address(m->arg);
+	BusCycle(m);
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::BusCycle(const tMOP *m) {	// Sets up the bus cycle of m on Addr
+	bop = m;
+	switch (m->type) {
+	case M_RD:
+		Count(PROF_MEM, 3);
+		cycle = READ;
+		if (bus.Internal(Addr)) {							// Served without the pins, the cycle only takes its time
+			Data = bus.MemRead(Addr);
+			*Operand(m->data) = Data;
+			cycle = EXEC;
+			wait = 3 * 2;
+		}
+		break;
+	case M_WR:
+		Count(PROF_MEM, 3);
+		cycle = WRITE;
+		Data = *Operand(m->data);
+		if (bus.Internal(Addr)) {
+			bus.MemWrite(Addr, Data);
+			Written(Addr);
+			cycle = EXEC;
+			wait = 3 * 2;
+		}
+		break;
+	case M_IOR:
+		Count(PROF_IO, 4);
+		cycle = IOREAD;
+		break;
+	case M_IOW:
+		Count(PROF_IO, 4);
+		cycle = IOWRITE;
+		Data = *Operand(m->data);
+		break;
+	}
+}
+
+/* prefixes */
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_prefix(void) {				// CB/DD/ED/FD prefix
+	page = op->y;
+	DebugLog("        Instruction prefix 0x%02x", InstR);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ddcb(void) {				// DDCB/FDCB, after the displacement and the opcode
+	reg.WZ = reg.WORD[op->idx] + (INT8)reg.Z;
+	InstR = Data;
+	op = &optab[op->y][InstR];
+	DebugLog("        Indexed bit instruction 0x%02x at 0x%04x", InstR, reg.WZ);
+	mop = op->seq;
+	return 0;
+}
+
+/* unprefixed instructions */
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ex_af(void) {				// EX AF, AF'
+	SyncFlags();
+	UINT16 t = reg.AF;
+	reg.AF = reg.AF_;
+	reg.AF_ = t;
+	DebugLog("        AF=0x%04x AF'=0x%04x", reg.AF, reg.AF_);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_djnz(void) {				// DJNZ *
+	reg.B--;
+	LogReg8(R8_B);
+	if (!reg.B) return 1;
+	reg.PC += (INT8)reg.Z;
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_jr(void) {					// JR *
+	reg.PC += (INT8)reg.Z;
+	LogReg16(R16_PC);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_jr_cc(void) {				// JR cond, *
+	if (!cc(op->y)) return 1;
+	return op_jr();
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_add_hl_rp(void) {			// ADD HL, rp[p]
+	add16(&reg.WORD[op->rp], &reg.WORD[op->rp2], 0);
+	LogReg16(op->rp);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_inc_rp(void) {				// INC rp[p]
+	reg.WORD[op->rp]++;
+	LogReg16(op->rp);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_dec_rp(void) {				// DEC rp[p]
+	reg.WORD[op->rp]--;
+	LogReg16(op->rp);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_inc_r(void) {				// INC r[y]
+	reg.ARRAY[op->r]++;
+	IncDecFlags(LF_INC, reg.ARRAY[op->r]);
+	LogReg8(op->r);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_inc_mem(void) {				// INC (HL)
+	Data++;
+	IncDecFlags(LF_INC, Data);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_dec_r(void) {				// DEC r[y]
+	reg.ARRAY[op->r]--;
+	IncDecFlags(LF_DEC, reg.ARRAY[op->r]);
+	LogReg8(op->r);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_dec_mem(void) {				// DEC (HL)
+	Data--;
+	IncDecFlags(LF_DEC, Data);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_rota(void) {				// RLCA/RRCA/RLA/RRA
+	SyncFlags();
+	UINT8 f = reg.F;
+
+	rot(op->y, &reg.A);
+	reg.F = (f & (F_S | F_Z | F_PV)) | (reg.F & F_C) | (reg.A & F_53);	// S, Z and PV are kept, H and N cleared
+	LogReg8(R8_A);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_daa(void) {					// DAA
+	SyncFlags();
+	reg.AF = flags_daa[reg.A | ((reg.F & (F_C | F_N)) << 8) | ((reg.F & F_H) << 6)];
+	LogReg8(R8_A);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_cpl(void) {					// CPL
+	SyncFlags();
+	reg.A = ~reg.A;
+	reg.F = (reg.F & (F_S | F_Z | F_PV | F_C)) | F_H | F_N | (reg.A & F_53);
+	LogReg8(R8_A);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_scf(void) {					// SCF
+	SyncFlags();
+	reg.F = (reg.F & (F_S | F_Z | F_PV)) | F_C | (reg.A & F_53);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ccf(void) {					// CCF
+	SyncFlags();
+	reg.F = (reg.F & (F_S | F_Z | F_PV)) | ((reg.F & F_C) ? F_H : F_C) | (reg.A & F_53);	// H takes the old carry
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_halt(void) {				// HALT
+	reg.PC--;												// Fetches HALT again until an interrupt (NOP cycles as on the real CPU)
+	IsHalted = 1;
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ld_r_r(void) {				// LD r[y], r[z]
+	reg.ARRAY[op->r] = reg.ARRAY[op->r2];
+	LogReg8(op->r);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_alu_r(void) {				// alu[y] r[z]
+	alu(op->y, reg.ARRAY[op->r]);
+	LogReg8(R8_A);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_alu_mem(void) {				// alu[y] (HL) / alu[y] *
+	alu(op->y, Data);
+	LogReg8(R8_A);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_cond(void) {				// RET cc[y] / CALL cc[y], **
+	return !cc(op->y);
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_exx(void) {					// EXX
+	UINT16 t;
+
+	t = reg.BC;
+	reg.BC = reg.BC_;
+	reg.BC_ = t;
+	t = reg.DE;
+	reg.DE = reg.DE_;
+	reg.DE_ = t;
+	t = reg.HL;
+	reg.HL = reg.HL_;
+	reg.HL_ = t;
+	DebugLog("        BC=0x%04x DE=0x%04x HL=0x%04x", reg.BC, reg.DE, reg.HL);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_jp_hl(void) {				// JP (HL)
+	reg.PC = reg.WORD[op->rp];
+	LogReg16(R16_PC);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ld_sp_hl(void) {			// LD SP, HL
+	reg.SP = reg.WORD[op->rp];
+	LogReg16(R16_SP);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_jp_cc(void) {				// JP cc[y], **
+	if (cc(op->y)) {
+		reg.PC = reg.WZ;
+		LogReg16(R16_PC);
+	}
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ex_sp_hl(void) {			// EX (SP), HL
+	reg.WORD[op->rp] = reg.WZ;
+	LogReg16(op->rp);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ex_de_hl(void) {			// EX DE, HL
+	UINT16 t = reg.DE;
+	reg.DE = reg.HL;
+	reg.HL = t;
+	DebugLog("        DE=0x%04x HL=0x%04x", reg.DE, reg.HL);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_di(void) {					// DI
+	reg.IFF1 = reg.IFF2 = 0;
+	Pend();
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ei(void) {					// EI
+	reg.IFF1 = reg.IFF2 = 1;
+	eidelay = 1;
+	Pend();
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_rst(void) {					// RST y*8
+	reg.PC = op->y * 8;
+	LogReg16(R16_PC);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_nmi(void) {					// NMI acknowledge, after the push of PC
+	reg.PC = 0x0066;
+	LogReg16(R16_PC);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_im2(void) {					// IM 2 acknowledge, after the push of PC
+	reg.WZ = (reg.I << 8) | InstR;							// Vector read in the acknowledge
+	return 0;
+}
+
+/* CB prefixed instructions */
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_rot_r(void) {				// rot[y] r[z]
+	rot(op->y, &reg.ARRAY[op->r]);
+	LogReg8(op->r);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_rot_mem(void) {				// rot[y] (HL)
+	rot(op->y, &Data);
+	if (op->r != R8_MEM) reg.ARRAY[op->r] = Data;
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_bit_r(void) {				// BIT y, r[z]
+	bit(op->y, reg.ARRAY[op->r], reg.ARRAY[op->r]);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_bit_mem(void) {				// BIT y, (HL)
+	bit(op->y, Data, reg.W);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_res_r(void) {				// RES y, r[z]
+	reg.ARRAY[op->r] &= ~(1 << op->y);
+	LogReg8(op->r);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_res_mem(void) {				// RES y, (HL)
+	Data &= ~(1 << op->y);
+	if (op->r != R8_MEM) reg.ARRAY[op->r] = Data;
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_set_r(void) {				// SET y, r[z]
+	reg.ARRAY[op->r] |= (1 << op->y);
+	LogReg8(op->r);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_set_mem(void) {				// SET y, (HL)
+	Data |= (1 << op->y);
+	if (op->r != R8_MEM) reg.ARRAY[op->r] = Data;
+	return 0;
+}
+
+/* ED prefixed instructions */
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_in_r_c(void) {				// IN r[y], (C) / IN (C)
+	SyncFlags();
+	if (op->r != R8_MEM) reg.ARRAY[op->r] = Data;
+	DebugLog("        IO (0x%02x)=0x%02x", reg.C, Data);
+	reg.F = (reg.F & F_C) | flags_sz53p[Data];
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_out_c_r(void) {				// OUT (C), r[y] / OUT (C), 0
+	Data = (op->r == R8_MEM) ? 0 : reg.ARRAY[op->r];
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_sbc_hl(void) {				// SBC HL, rp[p]
+	sub16(&reg.WORD[op->rp], &reg.WORD[op->rp2], 1);
+	LogReg16(op->rp);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_adc_hl(void) {				// ADC HL, rp[p]
+	add16(&reg.WORD[op->rp], &reg.WORD[op->rp2], 1);
+	LogReg16(op->rp);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_neg(void) {					// NEG
+	UINT8 t = reg.A;
+	reg.A = 0;
+	alu(2, t);
+	LogReg8(R8_A);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_retn(void) {				// RETN / RETI
+	reg.IFF1 = reg.IFF2;
+	IsRetn = 1;
+	RetnPC = reg.PC - 2;
+	Pend();
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_im(void) {					// IM 0/1/2
+	IntMode = op->y;
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ld_i_a(void) {				// LD I, A
+	reg.I = reg.A;
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ld_r_a(void) {				// LD R, A
+	reg.R = reg.A;
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ld_a_i(void) {				// LD A, I
+	SyncFlags();
+	reg.A = reg.I;
+	reg.F = (reg.F & F_C) | flags_sz53[reg.A] | (reg.IFF2 ? F_PV : 0);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ld_a_r(void) {				// LD A, R
+	SyncFlags();
+	reg.A = reg.R;
+	reg.F = (reg.F & F_C) | flags_sz53[reg.A] | (reg.IFF2 ? F_PV : 0);
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_rrd(void) {					// RRD
+	SyncFlags();
+	UINT8 t = Data;
+	Data = (reg.A << 4) | (t >> 4);
+	reg.A = (reg.A & 0xF0) | (t & 0x0F);
+	reg.F = (reg.F & F_C) | flags_sz53p[reg.A];
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_rld(void) {					// RLD
+	SyncFlags();
+	UINT8 t = Data;
+	Data = (t << 4) | (reg.A & 0x0F);
+	reg.A = (reg.A & 0xF0) | (t >> 4);
+	reg.F = (reg.F & F_C) | flags_sz53p[reg.A];
+	return 0;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ldi(void) {					// LDI / LDD / LDIR / LDDR
+	SyncFlags();
+	int t = reg.A + Data;
+	int d = (op->y & 1) ? -1 : 1;
+
+	reg.HL += d;
+	reg.DE += d;
+	reg.BC--;
+	reg.F = (reg.F & (F_S | F_Z | F_C)) | (reg.BC ? F_PV : 0) | (t & F_3) | ((t << 4) & F_5);
+	if ((op->y & 2) && reg.BC) {
+		reg.PC -= 2;										// Repeats
+		return 0;
+	}
+	return 1;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_cpi(void) {					// CPI / CPD / CPIR / CPDR
+	SyncFlags();
+	int t = reg.A - Data, h, n;
+	int d = (op->y & 1) ? -1 : 1;
+
+	reg.HL += d;
+	reg.BC--;
+	h = (reg.A ^ Data ^ t) & F_H;
+	n = t - (h >> FLG_H);									// F3/F5 come from A - (HL) - H
+	reg.F = (reg.F & F_C) | F_N | h | (flags_sz53[t & 0xFF] & ~F_53) | (n & F_3) | ((n << 4) & F_5) | (reg.BC ? F_PV : 0);
+	if ((op->y & 2) && reg.BC && (t & 0xFF)) {
+		reg.PC -= 2;
+		return 0;
+	}
+	return 1;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_ini(void) {					// INI / IND / INIR / INDR
+	SyncFlags();
+	reg.B--;
+	reg.HL += (op->y & 1) ? -1 : 1;
+	reg.F = (reg.F & ~(F_S | F_Z | F_53)) | flags_sz53[reg.B] | F_N;
+	if ((op->y & 2) && reg.B) {
+		reg.PC -= 2;
+		return 0;
+	}
+	return 1;
+}
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::op_outi(void) {				// OUTI / OUTD / OTIR / OTDR
+	SyncFlags();
+	if (phase == 0) {
+		reg.B--;											// B is decremented before it goes on the bus
+		return 0;
+	}
+	reg.HL += (op->y & 1) ? -1 : 1;
+	reg.F = (reg.F & ~(F_S | F_Z | F_53)) | flags_sz53[reg.B] | F_N;
+	if ((op->y & 2) && reg.B) {
+		reg.PC -= 2;
+		return 0;
+	}
+	return 1;
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::ClockEdge(ABSTIME time) {		// Runs one half T-state of the bus state machine
+	TraceLog("Cycle %d state %d...", cycle, state);
+	if (IsWaiting) {										// TW, WAIT is sampled again on its falling edge
+		if (IsWaiting == 1) IsWaiting = 2;
+		else if (!Waited()) state++;						// On to the state after the one that sampled it
+		return;
+	}
+	switch (cycle) {
+		/*----------------------------------------------*/
+	case FETCH:											// Instruction fetch cycle
+		switch (state) {
+		case T1p:
+			CountFetch(1);
+			TraceLog("  Fetch...");
+			TraceLog("    Setting instruction address to 0x%04x...", reg.PC);
+			bus.SetLow(PIN_M1, time);
+			bus.SetAddr(reg.PC, time);
+			break;
+		case T1n:
+			bus.SetLow(PIN_MREQ, time);
+			bus.SetLow(PIN_RD, time);
+			break;
+		case T2p:
+			reg.PC++;
+			break;
+		case T2n:
+			if (Waited()) return;
+			break;
+		case T3p:
+			TraceLog("    Reading instruction...");
+			InstR = bus.GetData();
+			TraceLog("      -> 0x%02x (page %d)...", InstR, page);
+			fetches++;
+			Decode();
+			bus.SetHigh(PIN_MREQ, time);
+			bus.SetHigh(PIN_RD, time);
+			bus.SetHigh(PIN_M1, time);
+			TraceLog("    Setting refresh address to 0x%04x...", reg.IR);
+			bus.SetAddr(reg.IR, time + 20000);				// Puts the refresh address on the bus 20ns after RD goes up
+			reg.R = (reg.R & 0x80) | ((reg.R + 1) & 0x7f);	// Increments only the 7 first bits of R (the 8th bit stays the same)
+			bus.SetLow(PIN_RFSH, time + 22000);	// And brings RFSH low 2ns after that
+			break;
+		case T3n:
+			bus.SetLow(PIN_MREQ, time);
+			break;
+		case T4n:
+			bus.SetHigh(PIN_MREQ, time);
+			Next();											// Start execution of the fetched instruction
+			bus.SetHigh(PIN_RFSH, time);
+			break;
+		}
+
+		state++;
+		if (state > T4n)
+			state = T1p;
+		break;
+	case EXEC:											// Internal operation, no bus activity
+		if (--wait == 0) Next();
+		break;
+		/*----------------------------------------------*/
+	case READ:											// Memory read cycle
+		switch (state) {
+		case T1p:
+			TraceLog("  Read...");
+			TraceLog("    Setting read memory address to 0x%04x...", Addr);
+			bus.SetAddr(Addr, time);
+			break;
+		case T1n:
+			bus.SetLow(PIN_MREQ, time);
+			bus.SetLow(PIN_RD, time);
+			break;
+		case T2n:
+			if (Waited()) return;
+			break;
+		case T3n:
+			TraceLog("    Reading data...");
+			Data = bus.GetData();
+			TraceLog("      -> 0x%02x...", Data);
+			bus.SetHigh(PIN_MREQ, time);
+			bus.SetHigh(PIN_RD, time);
+			*Operand(bop->data) = Data;
+			Next();
+			break;
+		}
+		state++;
+		if (state > T3n)
+			state = T1p;
+		break;
+		/*----------------------------------------------*/
+	case WRITE:											// Memory write cycle
+		switch (state) {
+		case T1p:
+			TraceLog("  Write...");
+			TraceLog("    Setting write memory address to 0x%04x...", Addr);
+			bus.SetAddr(Addr, time);
+			break;
+		case T1n:
+			bus.SetLow(PIN_MREQ, time);
+			TraceLog("    Setting data to 0x%02x...", Data);
+			bus.SetData(Data, time);
+			break;
+		case T2n:
+			bus.SetLow(PIN_WR, time);
+			if (Waited()) return;
+			break;
+		case T3n:
+			bus.SetHigh(PIN_MREQ, time);
+			bus.SetHigh(PIN_WR, time);
+			bus.HIZData(time + 20000);						// Put the data bus in FLT 20ns after the WR pin goes up
+			Next();
+			break;
+		}
+		state++;
+		if (state > T3n)
+			state = T1p;
+		break;
+	case IOREAD:											// I/O read cycle
+		switch (state) {
+		case T1p:
+			TraceLog("  I/O Read...");
+			TraceLog("    Setting read memory address to 0x%04x...", Addr);
+			bus.SetAddr(Addr, time);
+			break;
+		case T2p:
+			bus.SetLow(PIN_IORQ, time);
+			bus.SetLow(PIN_RD, time);
+			break;
+		case T3n:											// T3 is the automatic TW of I/O cycles, T4 the datasheet's T3
+			if (Waited()) return;
+			break;
+		case T4p:
+			TraceLog("    Reading data...");
+			Data = bus.GetData();
+			TraceLog("      -> 0x%02x...", Data);
+			break;
+		case T4n:
+			bus.SetHigh(PIN_IORQ, time);
+			bus.SetHigh(PIN_RD, time);
+			*Operand(bop->data) = Data;
+			Next();
+			break;
+		}
+		state++;
+		if (state > T4n)
+			state = T1p;
+		break;
+		/*----------------------------------------------*/
+	case IOWRITE:											// I/O write cycle
+		switch (state) {
+		case T1p:
+			TraceLog("  I/O Write...");
+			TraceLog("    Setting write memory address to 0x%04x...", Addr);
+			bus.SetAddr(Addr, time);
+			break;
+		case T1n:
+			TraceLog("    Setting data to 0x%02x...", Data);
+			bus.SetData(Data, time);
+			break;
+		case T2p:
+			bus.SetLow(PIN_IORQ, time);
+			bus.SetLow(PIN_WR, time);
+			break;
+		case T3n:
+			if (Waited()) return;
+			break;
+		case T4n:
+			bus.SetHigh(PIN_IORQ, time);
+			bus.SetHigh(PIN_WR, time);
+			bus.HIZData(time + 20000);						// Put the data bus in FLT 20ns after the WR pin goes up
+			Next();
+			break;
+		}
+		state++;
+		if (state > T4n)
+			state = T1p;
+		break;
+		/*----------------------------------------------*/
+	case INTACK:											// Interrupt acknowledge: M1 with IORQ low instead of MREQ and RD,
+		switch (state) {									// two automatic TW; an NMI has a plain M1 without them
+		case T1p:
+			TraceLog("  Interrupt acknowledge...");
+			bus.SetLow(PIN_M1, time);
+			bus.SetAddr(reg.PC, time);
+			break;
+		case T1n:
+			if (ack == ACK_NMI) {							// Opcode read and ignored
+				bus.SetLow(PIN_MREQ, time);
+				bus.SetLow(PIN_RD, time);
+			}
+			break;
+		case T2n:
+			if (ack == ACK_NMI) {
+				state = T4n;								// On to TI3p
+				if (Waited()) return;
+			}
+			break;
+		case T3n:											// TW*1
+			bus.SetLow(PIN_IORQ, time);
+			break;
+		case T4n:											// TW*2
+			if (Waited()) return;
+			break;
+		case TI3p:
+			Acknowledged(time);
+			break;
+		case TI3n:
+			bus.SetLow(PIN_MREQ, time);
+			break;
+		case TI4n:
+			bus.SetHigh(PIN_MREQ, time);
+			Next();											// Push of PC, or the instruction read in IM 0
+			bus.SetHigh(PIN_RFSH, time);
+			break;
+		}
+		state++;
+		if (state > TI4n)
+			state = T1p;
+		break;
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT Z80Core<BUS, LAZYFLAGS>::ClockCycle(ABSTIME time, RELTIME half) {	// ClockEdge() from this edge up to the next one that samples a pin,
+																// with the pin changes in between driven ahead; returns the half T-states to it
+																// (0 when WAIT is sampled low, the owner waits for it to go high)
+	if (IsWaiting && Waited()) return 0;					// Falling edge of a TW
+	switch (cycle) {
+	case FETCH:
+		if (state == T1p) {
+			CountFetch(1);
+			bus.SetLow(PIN_M1, time);
+			bus.SetAddr(reg.PC, time);
+			bus.SetLow(PIN_MREQ, time + half);
+			bus.SetLow(PIN_RD, time + half);
+			reg.PC++;
+			state = T3p;
+			return 4;
+		}
+		if (state == T2n) {									// WAIT went high
+			state = T3p;
+			return 1;
+		}
+		if (bus.WaitAt(time - half)) {						// Low on T2n, this edge starts a TW
+			Count(PROF_WAIT, 1);
+			state = T2n;
+			IsWaiting = 2;
+			return 1;
+		}
+		InstR = bus.GetData();								// T3p
+		fetches++;
+		Decode();
+		bus.SetHigh(PIN_MREQ, time);
+		bus.SetHigh(PIN_RD, time);
+		bus.SetHigh(PIN_M1, time);
+		bus.SetAddr(reg.IR, time + 20000);					// Refresh as in ClockEdge()
+		reg.R = (reg.R & 0x80) | ((reg.R + 1) & 0x7f);
+		bus.SetLow(PIN_RFSH, time + 22000);
+		bus.SetLow(PIN_MREQ, time + half);					// T3n
+		bus.SetHigh(PIN_MREQ, time + 3 * half);				// T4n
+		bus.SetHigh(PIN_RFSH, time + 3 * half);
+		return 3 + EndCycle(time + 3 * half, half);
+	case READ:
+		if (state == T1p) {
+			bus.SetAddr(Addr, time);
+			bus.SetLow(PIN_MREQ, time + half);
+			bus.SetLow(PIN_RD, time + half);
+			state = T3n;
+			return 5;
+		}
+		if (state == T2n) {									// WAIT went high
+			state = T3n;
+			return 2;
+		}
+		if (bus.WaitAt(time - 2 * half)) {					// Low on T2n, this edge ends a TW
+			Count(PROF_WAIT, 1);
+			state = T2n;
+			IsWaiting = 2;
+			return ClockCycle(time, half);
+		}
+		Data = bus.GetData();								// T3n
+		bus.SetHigh(PIN_MREQ, time);
+		bus.SetHigh(PIN_RD, time);
+		*Operand(bop->data) = Data;
+		return EndCycle(time, half);
+	case WRITE:
+		if (state == T1p) {
+			bus.SetAddr(Addr, time);
+			bus.SetLow(PIN_MREQ, time + half);
+			bus.SetData(Data, time + half);
+			bus.SetLow(PIN_WR, time + 3 * half);
+			state = T2n;
+			return 3;
+		}
+		if (Waited()) return 0;								// T2n
+		bus.SetHigh(PIN_MREQ, time + 2 * half);
+		bus.SetHigh(PIN_WR, time + 2 * half);
+		bus.HIZData(time + 2 * half + 20000);
+		return 2 + EndCycle(time + 2 * half, half);
+	case IOREAD:
+		if (state == T1p) {
+			bus.SetAddr(Addr, time);
+			bus.SetLow(PIN_IORQ, time + 2 * half);
+			bus.SetLow(PIN_RD, time + 2 * half);
+			state = T4p;
+			return 6;
+		}
+		if (state == T3n) {									// WAIT went high
+			state = T4p;
+			return 1;
+		}
+		if (bus.WaitAt(time - half)) {						// Low on T3n, this edge starts a TW
+			Count(PROF_WAIT, 1);
+			state = T3n;
+			IsWaiting = 2;
+			return 1;
+		}
+		Data = bus.GetData();								// T4p
+		bus.SetHigh(PIN_IORQ, time + half);
+		bus.SetHigh(PIN_RD, time + half);
+		*Operand(bop->data) = Data;
+		return 1 + EndCycle(time + half, half);
+	case IOWRITE:
+		if (state == T1p) {
+			bus.SetAddr(Addr, time);
+			bus.SetData(Data, time + half);
+			bus.SetLow(PIN_IORQ, time + 2 * half);
+			bus.SetLow(PIN_WR, time + 2 * half);
+			state = T3n;
+			return 5;
+		}
+		if (Waited()) return 0;								// T3n
+		bus.SetHigh(PIN_IORQ, time + 2 * half);
+		bus.SetHigh(PIN_WR, time + 2 * half);
+		bus.HIZData(time + 2 * half + 20000);
+		return 2 + EndCycle(time + 2 * half, half);
+	case INTACK:
+		if (state == T1p) {
+			bus.SetLow(PIN_M1, time);
+			bus.SetAddr(reg.PC, time);
+			state = TI3p;
+			if (ack == ACK_NMI) {
+				bus.SetLow(PIN_MREQ, time + half);
+				bus.SetLow(PIN_RD, time + half);
+				return 4;
+			}
+			bus.SetLow(PIN_IORQ, time + 5 * half);			// TW*1
+			return 8;
+		}
+		if (state == T4n) {									// WAIT went high
+			state = TI3p;
+			return 1;
+		}
+		if (bus.WaitAt(time - half)) {						// Low on TW*2 (T2n of an NMI), this edge starts a TW
+			Count(PROF_WAIT, 1);
+			state = T4n;
+			IsWaiting = 2;
+			return 1;
+		}
+		Acknowledged(time);									// TI3p
+		bus.SetLow(PIN_MREQ, time + half);
+		bus.SetHigh(PIN_MREQ, time + 3 * half);
+		bus.SetHigh(PIN_RFSH, time + 3 * half);
+		return 3 + EndCycle(time + 3 * half, half);
+	default: {												// EXEC, this edge counts
+		UINT n = wait - 1;
+		wait = 1;
+		return n + EndCycle(time + n * half, half);
+	}
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+bool Z80Core<BUS, LAZYFLAGS>::Accept(ABSTIME time) {		// On the instruction boundary IntPending stops at: sets up the acknowledge
+																// of the interrupt taken, false if none is
+	bool ei = eidelay;
+
+	if (page != PAGE_MAIN) return false;					// Not between a prefix and its opcode
+	eidelay = 0;
+	IsRetn = 0;												// The owner has seen it
+	if (IsNMI) {
+		IsNMI = 0;
+		reg.IFF1 = 0;										// IFF2 keeps the state for RETN
+		ack = ACK_NMI;
+	}
+	else if (IsInt && reg.IFF1 && !ei) {					// Not right after EI
+		reg.IFF1 = reg.IFF2 = 0;
+		ack = IntMode;
+	}
+	else {
+		Pend();
+		return false;
+	}
+	Pend();
+	if (ack == ACK_NMI) DebugLog("NMI accepted at 0x%04x", reg.PC);
+	else DebugLog("INT accepted at 0x%04x, IM %d", reg.PC, ack);
+	InstPC = reg.PC;										// The acknowledge counts for the instruction interrupted
+	Count(PROF_FETCH, 4);
+	if (ack != ACK_NMI) Count(PROF_WAIT, 2);
+	if (IsHalted) {											// Returns after the HALT
+		IsHalted = 0;
+		reg.PC++;
+		bus.SetHigh(PIN_HALT, time);
+	}
+	if (ack == ACK_NMI && bus.Internal(reg.PC)) {			// Its M1 reads memory, served without the pins as in BusCycle()
+		op = &acktab[ACK_NMI];
+		mop = op->seq;
+		fetches++;
+		reg.R = (reg.R & 0x80) | ((reg.R + 1) & 0x7f);
+		cycle = EXEC;
+		wait = 4 * 2;
+		return true;
+	}
+	cycle = INTACK;
+	return true;
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::Acknowledged(ABSTIME time) {	// TI3p of INTACK: the vector is read, then refresh as in a fetch
+	if (ack == ACK_NMI) {
+		op = &acktab[ACK_NMI];
+		bus.SetHigh(PIN_MREQ, time);
+		bus.SetHigh(PIN_RD, time);
+	}
+	else {
+		InstR = bus.GetData();
+		TraceLog("      -> vector 0x%02x...", InstR);
+		op = ack == 0 ? &optab[PAGE_MAIN][InstR] : &acktab[ack];	// IM 0 runs the byte read, a RST in practice
+		bus.SetHigh(PIN_IORQ, time);
+	}
+	mop = op->seq;
+	fetches++;
+	bus.SetHigh(PIN_M1, time);
+	bus.SetAddr(reg.IR, time + 20000);
+	reg.R = (reg.R & 0x80) | ((reg.R + 1) & 0x7f);
+	bus.SetLow(PIN_RFSH, time + 22000);
+}
+
+template <class BUS, bool LAZYFLAGS>
+bool Z80Core<BUS, LAZYFLAGS>::Waited(void) {				// Samples WAIT, true if low: a TW follows the edge instead of the next state
+	if (!bus.WaitLow()) {
+		IsWaiting = 0;
+		return false;
+	}
+	TraceLog("    Waiting...");
+	Count(PROF_WAIT, 1);
+	IsWaiting = 1;
+	return true;
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT Z80Core<BUS, LAZYFLAGS>::Idle(void) {					// Runs the internal operations starting on this edge at once, returns their
+																// half T-states (0 if there are none, ClockEdge() runs the edge then)
+	UINT n = 0;
+
+	if (cycle != EXEC || wait < 2) return 0;
+	while (cycle == EXEC) {
+		n += wait;
+		wait = 0;
+		Next();
+	}
+	return n;
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::Halted(UINT64 m) {			// Accounts for m opcode fetches of HALT run off the clock, R is all they change
+	reg.R = (reg.R & 0x80) | ((reg.R + m) & 0x7f);
+	fetches += m;
+	if (prof != NULL) {										// NOPs of the HALT
+		prof->pc[InstPC].instr += m;
+		prof->pc[InstPC].t[PROF_FETCH] += 4 * m;
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::CountFetch(UINT n) {			// Profiles n opcode fetches at PC, which start an instruction unless
+																// they follow a prefix
+	if (prof == NULL) return;
+	if (page == PAGE_MAIN) {
+		InstPC = reg.PC;
+		prof->pc[InstPC].instr++;
+	}
+	prof->pc[InstPC].t[PROF_FETCH] += 4 * n;
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT Z80Core<BUS, LAZYFLAGS>::EndCycle(ABSTIME time, RELTIME half) {	// Edge ending a cycle in ClockCycle(): internal operations, then
+																// the next bus cycle from the edge after, unless it is an opcode fetch
+	UINT n = 0;
+
+	state = T1p;
+	if (cycle != EXEC || --wait == 0) Next();
+	while (cycle == EXEC) {									// Counted, not clocked
+		n += wait;
+		wait = 0;
+		Next();
+	}
+	if (cycle == FETCH || BusReq) return n + 1;				// Left to the owner, which may run it at once or grant the bus
+	return n + 1 + ClockCycle(time + (n + 1) * half, half);
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT Z80Core<BUS, LAZYFLAGS>::Step(void) {					// Runs one instruction (or prefix) at transaction level, returns its T-states
+																// (up to the first cycle left to ClockEdge(), cycle is not FETCH then)
+	const tDECODED *d;
+
+	if (cache != NULL && (d = Cached()) != NULL) return StepDecoded(d);	// Prefixes and opcode already decoded
+	CountFetch(1);
+	InstR = bus.MemRead(reg.PC++);
+	reg.R = (reg.R & 0x80) | ((reg.R + 1) & 0x7f);			// Increments only the 7 first bits of R (the 8th bit stays the same)
+	fetches++;
+	Decode();
+	return Execute(4);										// Opcode fetch
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT Z80Core<BUS, LAZYFLAGS>::StepDecoded(const tDECODED *d) {	// Step() of an instruction decoded at PC
+	CountFetch(d->fetches);
+	reg.PC += d->fetches;
+	reg.R = (reg.R & 0x80) | ((reg.R + d->fetches) & 0x7f);
+	fetches += d->fetches;
+	InstR = d->opcode;
+	op = d->op;
+	mop = op->seq;
+	return Execute(4 * d->fetches);
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT Z80Core<BUS, LAZYFLAGS>::Execute(UINT t) {				// Machine cycles of Step() after the fetches, which took t T-states
+	const tMOP *m;
+
+	while ((m = Sequence()) != NULL) {						// Same micro-ops as ClockEdge(), one machine cycle at a time
+		switch (m->type) {
+		case M_RD:
+			Addr = Address(m->arg);
+			if (!bus.Internal(Addr)) {						// On the pins, ClockEdge() finishes the instruction
+				BusCycle(m);
+				return t;
+			}
+			Data = bus.MemRead(Addr);
+			*Operand(m->data) = Data;
+			Count(PROF_MEM, 3);
+			t += 3;
+			break;
+		case M_WR:
+			Addr = Address(m->arg);
+			if (!bus.Internal(Addr)) {
+				BusCycle(m);
+				return t;
+			}
+			Data = *Operand(m->data);
+			bus.MemWrite(Addr, Data);
+			Written(Addr);
+			Count(PROF_MEM, 3);
+			t += 3;
+			break;
+		case M_IOR:
+		case M_IOW:
+			Addr = Address(m->arg);
+			if (!IOStep(m, std::integral_constant<bool, BUS::PINIO>())) return t;
+			Count(PROF_IO, 4);
+			t += 4;
+			break;
+		case M_INT:
+			Count(PROF_INTERNAL, m->arg);
+			t += m->arg;
+			break;
+		}
+	}
+	return t;
+}
+
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::IOStep(const tMOP *m, std::false_type) {	// I/O cycle of Step() through IORead/IOWrite
+	if (m->type == M_IOR) {
+		Data = bus.IORead(Addr);
+		*Operand(m->data) = Data;
+	}
+	else {
+		Data = *Operand(m->data);
+		bus.IOWrite(Addr, Data);
+	}
+	return 1;
+}
+
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::IOStep(const tMOP *m, std::true_type) {	// I/O cycle of Step() left to ClockEdge()
+	BusCycle(m);
+	return 0;
+}
+
+/* decoded block cache */
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::EnableCache(bool on) {			// Lets Step() keep the opcodes it decodes, per block of straight code
+	if (on && cache == NULL) {
+		cache = new tBLKCACHE;
+		memset(cache, 0, sizeof(*cache));
+	}
+	else if (!on) {
+		EnableJit(false);
+		delete cache;
+		cache = NULL;
+	}
+	blk = NULL;
+}
+
+template <class BUS, bool LAZYFLAGS>
+bool Z80Core<BUS, LAZYFLAGS>::EnableJit(bool on) {			// Lets StepBlock() compile the hot blocks, false if the host cannot
+	if (on && jit == NULL) {
+		EnableCache(true);
+		jit = new Z80Jit<Z80Core>;
+		if (!jit->Ok()) {
+			delete jit;
+			jit = NULL;
+			return false;
+		}
+	}
+	else if (!on && jit != NULL) {
+		delete jit;
+		jit = NULL;
+		for (int i = 0; i < BLK_ENTRIES; i++) cache->blocks[i].code = NULL;
+	}
+	return true;
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT Z80Core<BUS, LAZYFLAGS>::Predecode(const UINT16 *entries, int n) {	// Decodes the blocks reachable from entries, returns how many
+	UINT16 *work;
+	UINT8 *seen;
+	UINT8 claimed[BLK_ENTRIES] = { 0 };						// Slots already holding a block of the walk
+	int head = 0, tail = 0;
+	UINT built = 0;
+
+	if (cache == NULL) return 0;
+	work = new UINT16[2 * BLK_ENTRIES + n];				// Two successors per block decoded
+	seen = new UINT8[0x10000 / 8];
+	memset(seen, 0, 0x10000 / 8);
+	for (int i = 0; i < n; i++) work[tail++] = entries[i];
+	while (head < tail && built < BLK_ENTRIES) {			// Breadth first, the code near the vectors wins the slots
+		UINT16 pc = work[head++], p, next, target;
+		tBLOCK *b = &cache->blocks[pc & (BLK_ENTRIES - 1)];
+		const tDECODED *d;
+		const tOPCODE *e;
+		bool fall = true;
+
+		if (seen[pc >> 3] & (1 << (pc & 7)) || !bus.Internal(pc) || claimed[pc & (BLK_ENTRIES - 1)]) continue;
+		seen[pc >> 3] |= 1 << (pc & 7);
+		BuildBlock(b, pc);
+		if (b->count == 0) continue;
+		claimed[pc & (BLK_ENTRIES - 1)] = 1;
+		built++;
+		p = pc;
+		for (int i = 0; i + 1 < b->count; i++) p += b->ins[i].len;
+		d = &b->ins[b->count - 1];
+		e = d->op;
+		next = p + d->len;
+		p += d->fetches;									// Operands of the last instruction
+		if (Branches(e)) {									// Static targets only, RET and JP (HL) end the walk
+			bool known = true;								// target is the static one
+
+			target = next;
+			fall = false;
+			if (e->fn == &Z80Core::op_jr || e->fn == &Z80Core::op_jr_cc || e->fn == &Z80Core::op_djnz) {
+				target = next + (INT8)bus.MemRead(p);
+				fall = e->fn != &Z80Core::op_jr;
+			}
+			else if (e->fn == &Z80Core::op_rst) {
+				target = e->y * 8;
+				fall = true;
+			}
+			else if (e->seq[0].type == M_RD && e->seq[0].arg == A_PC) {	// JP/CALL nn, conditional or not
+				target = bus.MemRead(p) | (bus.MemRead((UINT16)(p + 1)) << 8);
+				for (const tMOP *m = e->seq; m->type != M_END; m++)
+					if (m->type == M_EXEC || m->type == M_WR) fall = true;	// Condition, or return address pushed
+			}
+			else {
+				known = false;
+				fall = e->fn == &Z80Core::op_halt || e->fn == &Z80Core::op_cond;	// RET cc goes on when not taken
+			}
+			if (known && target == next) fall = true;		// JR $+2 and the like
+			else if (known && !(seen[target >> 3] & (1 << (target & 7)))) work[tail++] = target;
+		}
+		if (fall && !(seen[next >> 3] & (1 << (next & 7)))) work[tail++] = next;
+	}
+	delete[] seen;
+	delete[] work;
+	blk = NULL;
+	return built;
+}
+
+template <class BUS, bool LAZYFLAGS>
+int Z80Core<BUS, LAZYFLAGS>::ListBlocks(UINT16 *pcs, UINT8 *hot, int max) const {	// Addresses of the decoded blocks, and which ran often
+	int n = 0;
+
+	for (int i = 0; cache != NULL && i < BLK_ENTRIES && n < max; i++) {
+		const tBLOCK *b = &cache->blocks[i];
+		if (b->count == 0 || Stale(b)) continue;
+		pcs[n] = b->pc;
+		hot[n++] = b->code != NULL || b->runs >= JIT_THRESHOLD;
+	}
+	return n;
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::Preload(UINT16 pc, bool hot) {	// Decodes the block at pc, and compiles it now if it was hot
+	tBLOCK *b;
+
+	if (cache == NULL || !bus.Internal(pc)) return;
+	b = &cache->blocks[pc & (BLK_ENTRIES - 1)];
+	BuildBlock(b, pc);
+	if (b->count == 0 || !hot) return;
+	b->runs = JIT_THRESHOLD;								// Compiled on its first run otherwise
+	if (jit == NULL) return;
+	if ((b->code = jit->Compile(this, b)) == NULL) {
+		FlushCode();
+		b->code = jit->Compile(this, b);
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::EnableProfile(bool on) {		// Counts the instructions and T-states of every PC from now on
+	if (on && prof == NULL) prof = new Z80Profile;
+	else if (!on) {
+		delete prof;
+		prof = NULL;
+	}
+	if (jit != NULL) FlushCode();							// The compiled blocks count inline, or not
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::FlushCode(void) {				// Empties the full code buffer of the JIT
+	jit->Flush();
+	for (int i = 0; i < BLK_ENTRIES; i++) cache->blocks[i].code = NULL;
+}
+
+template <class BUS, bool LAZYFLAGS>
+UINT Z80Core<BUS, LAZYFLAGS>::StepBlock(void) {				// Runs the block at PC compiled, or one instruction with Step(), returns the T-states
+	tBLOCK *b;
+
+	if (jit == NULL || page != PAGE_MAIN) return Step();
+	if (IntPending || reg.IFF1) return Step();				// Interrupts: every boundary may take one, as interpreted
+	if (blk != NULL && reg.PC == blk_pc && blk_idx < blk->count) return Step();	// Inside a cold block
+	if ((b = Lookup(reg.PC)) == NULL) return Step();
+	if (b->code == NULL && ++b->runs >= JIT_THRESHOLD) {
+		if ((b->code = jit->Compile(this, b)) == NULL) {
+			FlushCode();
+			b->code = jit->Compile(this, b);
+		}
+	}
+	if (b->code == NULL) {									// Still cold: its first instruction, as Cached() would
+		blk = b;
+		blk_idx = 1;
+		blk_pc = reg.PC + b->ins[0].len;
+		return StepDecoded(&b->ins[0]);
+	}
+	blk = NULL;
+	jit_runs++;
+	return jit->Run(this, b->code);
+}
+
+template <class BUS, bool LAZYFLAGS>
+const typename Z80Core<BUS, LAZYFLAGS>::tDECODED *Z80Core<BUS, LAZYFLAGS>::Cached(void) {	// Decoded instruction at PC, NULL to decode it as usual
+	const tBLOCK *b = blk;
+
+	if (page != PAGE_MAIN) {								// After a prefix fetched by ClockEdge()
+		blk_misses++;
+		return NULL;
+	}
+	if (b == NULL || reg.PC != blk_pc || blk_idx >= b->count || Stale(b)) {
+		if ((b = Lookup(reg.PC)) == NULL) {
+			blk = NULL;
+			return NULL;
+		}
+		blk = b;
+		blk_idx = 0;
+		blk_pc = reg.PC;
+	}
+	else blk_hits++;
+	blk_pc += b->ins[blk_idx].len;
+	return &b->ins[blk_idx++];
+}
+
+template <class BUS, bool LAZYFLAGS>
+typename Z80Core<BUS, LAZYFLAGS>::tBLOCK *Z80Core<BUS, LAZYFLAGS>::Lookup(UINT16 pc) {	// Block at pc, decoded if needed, NULL if nothing is
+	tBLOCK *e = &cache->blocks[pc & (BLK_ENTRIES - 1)];
+
+	if (e->count == 0 || e->pc != pc || Stale(e)) {
+		BuildBlock(e, pc);
+		blk_misses++;
+		if (e->count == 0) return NULL;
+	}
+	else blk_hits++;
+	return e;
+}
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::BuildBlock(tBLOCK *b, UINT16 pc) {	// Decodes the straight code at pc from the internal memory
+	UINT16 p = pc;
+
+	b->pc = pc;
+	b->count = 0;
+	b->runs = 0;
+	b->code = NULL;
+	b->page[0] = b->page[1] = pc >> 8;
+	while (b->count < BLK_MAXINSTR) {
+		tDECODED *d = &b->ins[b->count];
+		const tOPCODE *e = NULL;
+		UINT8 pg = PAGE_MAIN, n = 0;
+		UINT16 q = p;
+
+		while (n < 4 && bus.Internal(q)) {					// Prefixes then the opcode
+			d->opcode = bus.MemRead(q++);
+			e = &optab[pg][d->opcode];
+			n++;
+			if (e->fn != &Z80Core::op_prefix) break;
+			pg = e->y;
+			e = NULL;
+		}
+		if (e == NULL) break;								// External, or too many prefixes
+		d->op = e;
+		d->fetches = n;
+		Measure(e, d);
+		b->page[1] = (UINT8)((p + d->len - 1) >> 8);		// Operands included, the JIT copies them
+		b->count++;
+		p += d->len;
+		if (Branches(e)) break;
+	}
+	b->ver[0] = cache->pagever[b->page[0]];
+	b->ver[1] = cache->pagever[b->page[1]];
+	cache->pagecode[b->page[0]] = cache->pagecode[b->page[1]] = 1;
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::Invalidate(UINT8 p) {			// Drops the blocks decoded from page p
+	cache->pagever[p]++;
+	cache->pagecode[p] = 0;
+	blk_invalidations++;
+}
+
+template <class BUS, bool LAZYFLAGS>
+void Z80Core<BUS, LAZYFLAGS>::Measure(const tOPCODE *e, tDECODED *d) {	// Length from the micro-ops
+	d->len = d->fetches;
+	for (const tMOP *m = e->seq; m->type != M_END; m++) {
+		if (m->type == M_RD && m->arg == A_PC) d->len++;	// Operand byte
+		else if (m->type == M_IDX) m = e->inner - 1;
+	}
+}
+
+template <class BUS, bool LAZYFLAGS>
+bool Z80Core<BUS, LAZYFLAGS>::Branches(const tOPCODE *e) {	// Instruction that may not continue at the next address
+	for (const tMOP *m = e->seq; m->type != M_END; m++) {
+		if (m->type == M_JP) return true;
+		if (m->type == M_IDX) m = e->inner - 1;
+	}
+	return e->fn == &Z80Core::op_djnz || e->fn == &Z80Core::op_jr || e->fn == &Z80Core::op_jr_cc
+		|| e->fn == &Z80Core::op_jp_hl || e->fn == &Z80Core::op_jp_cc || e->fn == &Z80Core::op_rst
+		|| e->fn == &Z80Core::op_halt;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "StdAfx.h"
+
+// Flag bits of F and the lookup tables the ALU builds F from.
+//
+// The tables are constexpr and filled in at compile time by expanding the
+// generator functions below over every index (C++11 constexpr functions are
+// single expressions, hence the nesting). Half carry and overflow of
+// additions and subtractions come from small tables indexed by bits 3 and 7
+// of both operands and the result, so every 8-bit operation produces F with
+// a few loads and ORs.
+
+#define FLG_C		0
+#define FLG_N		1
+#define FLG_PV		2
+#define FLG_F3		3
+#define FLG_H		4
+#define FLG_F5		5
+#define FLG_Z		6
+#define FLG_S		7
+
+#define F_C			(1 << FLG_C)
+#define F_N			(1 << FLG_N)
+#define F_PV		(1 << FLG_PV)
+#define F_3			(1 << FLG_F3)
+#define F_H			(1 << FLG_H)
+#define F_5			(1 << FLG_F5)
+#define F_Z			(1 << FLG_Z)
+#define F_S			(1 << FLG_S)
+#define F_53		(F_5 | F_3)
+
+/* generators */
+constexpr UINT8 GenSZ53(int n) {							// S, Z, F5 and F3 of a result
+	return (UINT8)((n & (F_S | F_53)) | (n ? 0 : F_Z));
+}
+constexpr UINT8 GenP(int n) {								// PV set on even parity
+	return (((n ^ (n >> 1) ^ (n >> 2) ^ (n >> 3) ^ (n >> 4) ^ (n >> 5) ^ (n >> 6) ^ (n >> 7)) & 1) ? 0 : F_PV);
+}
+constexpr UINT8 GenSZ53P(int n) {
+	return GenSZ53(n) | GenP(n);
+}
+constexpr UINT8 GenInc(int n) {								// INC, indexed by the result
+	return GenSZ53(n) | ((n & 0x0F) ? 0 : F_H) | ((n == 0x80) ? F_PV : 0);
+}
+constexpr UINT8 GenDec(int n) {								// DEC, indexed by the result
+	return GenSZ53(n) | F_N | (((n & 0x0F) == 0x0F) ? F_H : 0) | ((n == 0x7F) ? F_PV : 0);
+}
+
+// DAA, indexed by A | C << 8 | N << 9 | H << 10, gives A << 8 | F
+constexpr int DaaA(int i) { return i & 0xFF; }
+constexpr int DaaC(int i) { return (i >> 8) & 1; }
+constexpr int DaaN(int i) { return (i >> 9) & 1; }
+constexpr int DaaH(int i) { return (i >> 10) & 1; }
+constexpr int DaaCarry(int i) {
+	return DaaC(i) || DaaA(i) > 0x99;
+}
+constexpr int DaaDiff(int i) {
+	return (DaaCarry(i) ? 0x60 : 0) | ((DaaH(i) || (DaaA(i) & 0x0F) > 9) ? 0x06 : 0);
+}
+constexpr int DaaRes(int i) {
+	return (DaaN(i) ? DaaA(i) - DaaDiff(i) : DaaA(i) + DaaDiff(i)) & 0xFF;
+}
+constexpr int DaaHalf(int i) {
+	return DaaN(i) ? (DaaH(i) && (DaaA(i) & 0x0F) < 6) : ((DaaA(i) & 0x0F) > 9);
+}
+constexpr UINT16 GenDaa(int i) {
+	return (UINT16)((DaaRes(i) << 8) | GenSZ53P(DaaRes(i)) | (DaaCarry(i) ? F_C : 0) | (DaaHalf(i) ? F_H : 0) | (DaaN(i) ? F_N : 0));
+}
+
+#define FT_4(f, n)		f(n), f((n) + 1), f((n) + 2), f((n) + 3)
+#define FT_16(f, n)		FT_4(f, n), FT_4(f, (n) + 4), FT_4(f, (n) + 8), FT_4(f, (n) + 12)
+#define FT_64(f, n)		FT_16(f, n), FT_16(f, (n) + 16), FT_16(f, (n) + 32), FT_16(f, (n) + 48)
+#define FT_256(f, n)	FT_64(f, n), FT_64(f, (n) + 64), FT_64(f, (n) + 128), FT_64(f, (n) + 192)
+
+/* tables */
+static constexpr UINT8 flags_sz53[256] = { FT_256(GenSZ53, 0) };
+static constexpr UINT8 flags_sz53p[256] = { FT_256(GenSZ53P, 0) };
+static constexpr UINT8 flags_inc[256] = { FT_256(GenInc, 0) };
+static constexpr UINT8 flags_dec[256] = { FT_256(GenDec, 0) };
+static constexpr UINT16 flags_daa[2048] = {
+	FT_256(GenDaa, 0), FT_256(GenDaa, 256), FT_256(GenDaa, 512), FT_256(GenDaa, 768),
+	FT_256(GenDaa, 1024), FT_256(GenDaa, 1280), FT_256(GenDaa, 1536), FT_256(GenDaa, 1792)
+};
+
+// Indexed by FlagIdx(): bits 0-2 for H, bits 4-6 for V
+static constexpr UINT8 flags_hadd[8] = { 0, F_H, F_H, F_H, 0, 0, 0, F_H };
+static constexpr UINT8 flags_hsub[8] = { 0, 0, F_H, 0, F_H, 0, F_H, F_H };
+static constexpr UINT8 flags_vadd[8] = { 0, 0, 0, F_PV, F_PV, 0, 0, 0 };
+static constexpr UINT8 flags_vsub[8] = { 0, F_PV, 0, 0, 0, 0, F_PV, 0 };
+
+#undef FT_4
+#undef FT_16
+#undef FT_64
+#undef FT_256
+
+// Gathers bits 3 and 7 of the operands and of the result of a + b or a - b.
+// For 16-bit operations pass everything shifted right by 8.
+inline int FlagIdx(int a, int b, int res) {
+	return ((a & 0x88) >> 3) | ((b & 0x88) >> 2) | ((res & 0x88) >> 1);
+}
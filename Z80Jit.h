@@ -0,0 +1,370 @@
+#pragma once
+#include "StdAfx.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// Block compiler of Z80Core for x86-64 hosts, see Z80Core::EnableJit().
+//
+// A block of the decode cache of Step() is turned into host code once it has
+// run JIT_THRESHOLD times. Fetches, refresh, operands read from the
+// instruction stream, internal T-states, IX/IY displacements and jumps to WZ
+// are done inline (operand bytes are copied into the code, the block pages
+// cover them); memory and I/O cycles and the instruction handlers are calls
+// into the core that run as in Step(). The code returns the T-states it ran
+// and leaves the core where Step() would: at the next instruction, or in front
+// of a cycle left to ClockEdge(). It returns early after an instruction that
+// wrote to the pages of the block, or whose handler did not continue at the
+// next address (repeated block instructions), or that left IntPending set
+// (EI, RETI/RETN) for the owner to look at.
+// With the profile of the core enabled, the code also adds the inline cycles
+// to the entry of each instruction, the calls count theirs as in Step().
+// Other hosts get no compiler and EnableJit() fails.
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define Z80_JIT			1
+#else
+#define Z80_JIT			0
+#endif
+
+#define JIT_BUFSIZE		(4 << 20)							// Host code of an instance, flushed when full
+#define JIT_MAXBLOCK	16384								// Worst case code of a block
+#define JIT_THRESHOLD	8									// Interpreted runs of a block before it is compiled
+#define JIT_MAXEXITS	256									// Jumps to the epilogue in a block
+
+class Z80JitBuffer											// Executable memory written to in sequence
+{
+public:
+	Z80JitBuffer(size_t n) {
+#if !Z80_JIT
+		base = NULL;
+#elif defined(_WIN32)
+		base = (UINT8 *)VirtualAlloc(NULL, n, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+		base = (UINT8 *)mmap(NULL, n, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == (UINT8 *)MAP_FAILED) base = NULL;
+#endif
+		size = base != NULL ? n : 0;
+	}
+	~Z80JitBuffer(void) {
+		if (base == NULL) return;
+#ifdef _WIN32
+		VirtualFree(base, 0, MEM_RELEASE);
+#else
+		munmap(base, size);
+#endif
+	}
+
+	bool Ok(void) const { return base != NULL; }
+	bool Room(size_t n) const { return used + n <= size; }
+	const UINT8 *Here(void) const { return base + used; }
+	size_t Mark(void) const { return used; }
+	void Reset(void) { used = 0; }
+	void B(UINT8 b) { base[used++] = b; }
+	void B(UINT8 a, UINT8 b) { B(a); B(b); }
+	void B(UINT8 a, UINT8 b, UINT8 c) { B(a); B(b); B(c); }
+	void W(UINT16 w) { memcpy(base + used, &w, 2); used += 2; }
+	void D(UINT32 d) { memcpy(base + used, &d, 4); used += 4; }
+	void Q(UINT64 q) { memcpy(base + used, &q, 8); used += 8; }
+	void Patch(size_t at) { D32At(at, (UINT32)(used - (at + 4))); }	// Points the rel32 at at to here
+
+private:
+	void D32At(size_t at, UINT32 d) { memcpy(base + at, &d, 4); }
+
+	UINT8 *base;
+	size_t size;
+	size_t used = 0;
+};
+
+template <class CORE>
+class Z80Jit
+{
+	typedef typename CORE::tOPCODE tOPCODE;
+	typedef typename CORE::tDECODED tDECODED;
+	typedef typename CORE::tBLOCK tBLOCK;
+	typedef UINT (*ENTRY)(CORE *c);
+
+public:
+	Z80Jit(void) : buf(JIT_BUFSIZE) {}
+
+	bool Ok(void) const { return Z80_JIT && buf.Ok(); }
+	void Flush(void) { buf.Reset(); flushes++; }
+	const UINT8 *Compile(CORE *c, const tBLOCK *b);
+	static UINT Run(CORE *c, const UINT8 *code) { return ((ENTRY)code)(c); }
+
+	UINT32 compiled = 0;									// Blocks compiled
+	UINT32 flushes = 0;										// Times the buffer was full
+
+private:
+	Z80JitBuffer buf;
+	CORE *core = NULL;										// Instance compiled for, the code addresses it from rbx
+	size_t exits[JIT_MAXEXITS];								// rel32 of the jumps to the epilogue
+	int numexits = 0;
+	UINT pending = 0;										// T-states not yet added to r12d
+	tPROFPC *prof = NULL;									// Profile of the instruction compiled, NULL if none
+	UINT counted[PROF_KINDS];								// Its inline T-states not yet added to the profile
+
+	// Machine cycles and handlers called by the code, non-zero to stop
+	static int Rd(CORE *c, const tMOP *m);
+	static int Wr(CORE *c, const tMOP *m);
+	static int IO(CORE *c, const tMOP *m);
+	static int Exec(CORE *c, const tMOP *m);
+	static UINT Interp(CORE *c, const tDECODED *d);
+
+	INT32 Off(const void *p) const { return (INT32)((const UINT8 *)p - (const UINT8 *)core); }
+	void Mem(UINT8 op, UINT8 reg, const void *p) { buf.B(op, 0x80 | (reg << 3) | 3); buf.D(Off(p)); }	// op reg, [rbx+disp32]
+	void StoreB(const void *p, UINT8 v) { Mem(0xC6, 0, p); buf.B(v); }
+	void StoreW(const void *p, UINT16 v) { buf.B(0x66); Mem(0xC7, 0, p); buf.W(v); }
+	void Call(const void *fn, UINT64 arg);
+	void AddT(UINT t);
+	void Profile(UINT kind, UINT t) { if (prof != NULL) counted[kind] += t; }
+	void Add64(const UINT64 *p, UINT n) { buf.B(0x48, 0xB8); buf.Q((UINT64)p); buf.B(0x48, 0x81, 0x00); buf.D(n); }	// add qword [p], n
+	void ExitIf(UINT8 cc);
+	void CheckPages(const tBLOCK *b);
+};
+
+template <class CORE>
+const UINT8 *Z80Jit<CORE>::Compile(CORE *c, const tBLOCK *b) {	// Host code of b, NULL if the buffer is full
+	const UINT8 *entry = buf.Here();
+	UINT16 pc = b->pc;										// Address of the instruction compiled
+
+	if (!Ok() || !buf.Room(JIT_MAXBLOCK)) return NULL;
+	core = c;
+	numexits = 0;
+	buf.B(0x53);											// push rbx
+	buf.B(0x41, 0x54);										// push r12
+#ifdef _WIN32
+	buf.B(0x48, 0x83, 0xEC); buf.B(40);						// sub rsp, 40 (shadow space, alignment)
+	buf.B(0x48, 0x89, 0xCB);								// mov rbx, rcx
+#else
+	buf.B(0x48, 0x83, 0xEC); buf.B(8);						// sub rsp, 8 (alignment)
+	buf.B(0x48, 0x89, 0xFB);								// mov rbx, rdi
+#endif
+	buf.B(0x45, 0x31, 0xE4);								// xor r12d, r12d
+	for (int i = 0; i < b->count; i++) {
+		const tDECODED *d = &b->ins[i];
+		const tOPCODE *e = d->op;
+		UINT16 next = pc + d->len;
+		UINT16 rpc = pc;									// PC while it is known at compile time
+		bool known = true, synced = true;					// rpc valid, and stored in the core
+		bool wrote = false, exec = false;
+		size_t early[4];									// Handlers ending the instruction early
+		int numearly = 0;
+
+		if (e->fn == &CORE::op_ddcb) {						// Switches sequence: the interpreter runs it
+			Call((const void *)&Interp, (UINT64)d);
+			buf.B(0x41, 0x01, 0xC4);						// add r12d, eax
+			buf.B(0x80, 0xBB); buf.D(Off(&c->cycle)); buf.B(FETCH);	// cmp byte [cycle], FETCH
+			ExitIf(0x85);
+			CheckPages(b);
+			buf.B(0x66, 0x81, 0xBB); buf.D(Off(&c->reg.PC)); buf.W(next);	// cmp word [PC], next
+			ExitIf(0x85);
+			pc = next;
+			continue;
+		}
+		StoreB(&c->InstR, d->opcode);						// Fetches
+		buf.B(0x48, 0x83, 0x83); buf.D(Off(&c->fetches)); buf.B(d->fetches);	// add qword [fetches], n
+		Mem(0x8A, 0, &c->reg.R);							// mov al, [R]
+		buf.B(0x88, 0xC1);									// mov cl, al
+		buf.B(0x04, d->fetches);							// add al, n
+		buf.B(0x24, 0x7F);									// and al, 7Fh
+		buf.B(0x80, 0xE1, 0x80);							// and cl, 80h
+		buf.B(0x08, 0xC8);									// or al, cl
+		Mem(0x88, 0, &c->reg.R);							// mov [R], al
+		buf.B(0x48, 0xB8); buf.Q((UINT64)e);				// mov rax, e
+		buf.B(0x48); Mem(0x89, 0, &c->op);					// mov [op], rax
+		rpc += d->fetches;
+		synced = false;
+		pending = 4 * d->fetches;
+		if (c->prof != NULL) {								// Cycles called count for InstPC
+			prof = &c->prof->pc[pc];
+			memset(counted, 0, sizeof(counted));
+			StoreW(&c->InstPC, pc);
+			Add64(&prof->instr, 1);
+			Profile(PROF_FETCH, 4 * d->fetches);
+		}
+		for (const tMOP *m = e->seq; m->type != M_END; m++) {
+			if (m->type == M_RD && m->arg == A_PC && known && c->bus.Internal(rpc)
+				&& !((m->data == D_RPL || m->data == D_RPH) && e->rp == R16_AF)) {
+				UINT8 v = c->bus.MemRead(rpc++);			// Operand copied into the code
+				const UINT8 *dst;
+
+				switch (m->data) {
+				case D_TMP: dst = NULL; break;
+				case D_R: dst = &c->reg.ARRAY[e->r]; break;
+				case D_RPL: dst = &c->reg.ARRAY[e->rp * 2]; break;
+				case D_RPH: dst = &c->reg.ARRAY[e->rp * 2 + 1]; break;
+				default: dst = &c->reg.ARRAY[m->data]; break;
+				}
+				StoreB(&c->Data, v);
+				if (dst != NULL) StoreB(dst, v);
+				synced = false;
+				pending += 3;
+				Profile(PROF_MEM, 3);
+				continue;
+			}
+			if (m->type != M_INT && m->type != M_JP && m->type != M_IDX) {	// Calls see the core as Step() leaves it
+				AddT(pending);
+				if (known && !synced) StoreW(&c->reg.PC, rpc);
+				synced = known;
+			}
+			switch (m->type) {
+			case M_RD:
+			case M_WR:
+				Call(m->type == M_RD ? (const void *)&Rd : (const void *)&Wr, (UINT64)m);
+				buf.B(0x85, 0xC0);							// test eax, eax
+				ExitIf(0x85);
+				if (m->arg == A_PC) rpc++;					// Operand on the pins
+				if (m->type == M_WR) wrote = true;
+				pending = 3;
+				break;
+			case M_IOR:
+			case M_IOW:
+				Call((const void *)&IO, (UINT64)m);
+				buf.B(0x85, 0xC0);
+				ExitIf(0x85);
+				pending = 4;
+				break;
+			case M_INT:
+				pending += m->arg;
+				Profile(PROF_INTERNAL, m->arg);
+				break;
+			case M_EXEC:
+				Call((const void *)&Exec, (UINT64)m);
+				buf.B(0x85, 0xC0);
+				buf.B(0x0F, 0x85); early[numearly++] = buf.Mark(); buf.D(0);	// jnz end of the instruction
+				known = synced = false;
+				exec = true;
+				break;
+			case M_JP:
+				buf.B(0x0F); Mem(0xB7, 0, &c->reg.WZ);		// movzx eax, word [WZ]
+				buf.B(0x66); Mem(0x89, 0, &c->reg.PC);		// mov [PC], ax
+				known = synced = false;
+				break;
+			case M_IDX:
+				buf.B(0x0F); Mem(0xBE, 0, &c->reg.Z);		// movsx eax, byte [Z]
+				buf.B(0x0F); Mem(0xB7, 1, &c->reg.WORD[e->idx]);	// movzx ecx, word [IX/IY]
+				buf.B(0x01, 0xC8);							// add eax, ecx
+				buf.B(0x66); Mem(0x89, 0, &c->reg.WZ);		// mov [WZ], ax
+				m = e->inner - 1;
+				break;
+			}
+		}
+		AddT(pending);
+		prof = NULL;
+		if (known && !synced) StoreW(&c->reg.PC, rpc);
+		for (int j = 0; j < numearly; j++) buf.Patch(early[j]);
+		if (wrote) CheckPages(b);
+		if (exec && i + 1 < b->count) {					// Repeated, or jumped
+			buf.B(0x66, 0x81, 0xBB); buf.D(Off(&c->reg.PC)); buf.W(next);
+			ExitIf(0x85);
+			buf.B(0x80, 0xBB); buf.D(Off(&c->IntPending)); buf.B(0);	// cmp byte [IntPending], 0 (EI, RETI/RETN)
+			ExitIf(0x85);
+		}
+		pc = next;
+	}
+	for (int j = 0; j < numexits; j++) buf.Patch(exits[j]);
+	buf.B(0x44, 0x89, 0xE0);								// mov eax, r12d
+#ifdef _WIN32
+	buf.B(0x48, 0x83, 0xC4); buf.B(40);						// add rsp, 40
+#else
+	buf.B(0x48, 0x83, 0xC4); buf.B(8);						// add rsp, 8
+#endif
+	buf.B(0x41, 0x5C);										// pop r12
+	buf.B(0x5B);											// pop rbx
+	buf.B(0xC3);											// ret
+	compiled++;
+	return entry;
+}
+
+template <class CORE>
+void Z80Jit<CORE>::Call(const void *fn, UINT64 arg) {		// fn(core, arg)
+#ifdef _WIN32
+	buf.B(0x48, 0x89, 0xD9);								// mov rcx, rbx
+	buf.B(0x48, 0xBA); buf.Q(arg);							// mov rdx, arg
+#else
+	buf.B(0x48, 0x89, 0xDF);								// mov rdi, rbx
+	buf.B(0x48, 0xBE); buf.Q(arg);							// mov rsi, arg
+#endif
+	buf.B(0x48, 0xB8); buf.Q((UINT64)fn);					// mov rax, fn
+	buf.B(0xFF, 0xD0);										// call rax
+}
+
+template <class CORE>
+void Z80Jit<CORE>::AddT(UINT t) {							// Adds the T-states run since the last call, to the profile too
+	if (t) {
+		buf.B(0x41, 0x81, 0xC4); buf.D(t);					// add r12d, t
+	}
+	pending = 0;
+	if (prof == NULL) return;
+	for (int k = 0; k < PROF_KINDS; k++) {
+		if (counted[k]) Add64(&prof->t[k], counted[k]);
+		counted[k] = 0;
+	}
+}
+
+template <class CORE>
+void Z80Jit<CORE>::ExitIf(UINT8 cc) {						// Jcc to the epilogue (0x84 je, 0x85 jne)
+	buf.B(0x0F, cc);
+	exits[numexits++] = buf.Mark();
+	buf.D(0);
+}
+
+template <class CORE>
+void Z80Jit<CORE>::CheckPages(const tBLOCK *b) {			// Leaves if the pages of b were written to
+	for (int p = 0; p < 2; p++) {
+		if (p == 1 && b->page[1] == b->page[0]) break;
+		buf.B(0x48, 0xB8); buf.Q((UINT64)&core->cache->pagever[b->page[p]]);	// mov rax, &pagever
+		buf.B(0x66, 0x81, 0x38); buf.W(b->ver[p]);			// cmp word [rax], ver
+		ExitIf(0x85);
+	}
+}
+
+template <class CORE>
+int Z80Jit<CORE>::Rd(CORE *c, const tMOP *m) {				// Memory read cycle of Step()
+	c->Addr = c->Address(m->arg);
+	if (!c->bus.Internal(c->Addr)) {						// Left to ClockEdge() with the rest of the instruction
+		c->mop = m + 1;
+		c->BusCycle(m);
+		return 1;
+	}
+	c->Data = c->bus.MemRead(c->Addr);
+	*c->Operand(m->data) = c->Data;
+	c->Count(PROF_MEM, 3);
+	return 0;
+}
+
+template <class CORE>
+int Z80Jit<CORE>::Wr(CORE *c, const tMOP *m) {				// Memory write cycle of Step()
+	c->Addr = c->Address(m->arg);
+	if (!c->bus.Internal(c->Addr)) {
+		c->mop = m + 1;
+		c->BusCycle(m);
+		return 1;
+	}
+	c->Data = *c->Operand(m->data);
+	c->bus.MemWrite(c->Addr, c->Data);
+	c->Written(c->Addr);
+	c->Count(PROF_MEM, 3);
+	return 0;
+}
+
+template <class CORE>
+int Z80Jit<CORE>::IO(CORE *c, const tMOP *m) {				// I/O cycle of Step()
+	c->Addr = c->Address(m->arg);
+	c->mop = m + 1;
+	if (!c->IOStep(m, std::integral_constant<bool, CORE::BusType::PINIO>())) return 1;
+	c->Count(PROF_IO, 4);
+	return 0;
+}
+
+template <class CORE>
+int Z80Jit<CORE>::Exec(CORE *c, const tMOP *m) {			// Handler, non-zero when it ends the instruction
+	c->phase = m->arg;
+	return (c->*(c->op->fn))();
+}
+
+template <class CORE>
+UINT Z80Jit<CORE>::Interp(CORE *c, const tDECODED *d) {	// Whole instruction by Step()
+	return c->StepDecoded(d);
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include "StdAfx.h"
+#include <atomic>
+
+// Leveled debug log of the Z80 core.
+//
+// Records are fixed size and binary: a format string, an optional string
+// argument and up to three numeric arguments, all captured without any
+// formatting. They go into a ring buffer that keeps the most recent
+// LOG_RINGSIZE records; Pop() formats them, which the model only does when
+// the simulation is paused or stopped.
+//
+// The ring has a single producer (the simulation) and a single consumer. The
+// producer never waits: when the ring is full it overwrites the oldest
+// records, and the consumer detects and skips the ones it lost.
+//
+// Levels above Z80LOG_MAXLEVEL are removed at compile time; the others cost a
+// compare against the runtime level when they are disabled.
+
+enum LOGLEVELS {
+	LOG_OFF = 0,
+	LOG_ERROR = 1,		// Failures (bad reset...)
+	LOG_INFO = 2,		// Setup, reset, interrupts
+	LOG_DEBUG = 3,		// Instruction results
+	LOG_TRACE = 4		// Every half T-state of the bus state machine
+};
+
+#ifndef Z80LOG_MAXLEVEL
+#define Z80LOG_MAXLEVEL	LOG_TRACE
+#endif
+
+#define LOG_RINGSIZE	4096								// Records, power of 2
+
+typedef struct {
+	const char *fmt;
+	const char *str;		// Passed before the numeric arguments when not NULL
+	UINT32 arg[3];
+	UINT8 level;
+} tLOGREC;
+
+class Z80Log
+{
+public:
+	Z80Log() : level(LOG_OFF), ring(NULL), wr(0), rd(0), lost(0) { }
+	~Z80Log() { delete[] ring; }
+
+	void SetLevel(int lv) {
+		if (lv > Z80LOG_MAXLEVEL) lv = Z80LOG_MAXLEVEL;
+		if (lv > LOG_OFF && ring == NULL) ring = new tLOGREC[LOG_RINGSIZE];	// Only allocated when used
+		level = (lv < LOG_OFF) ? LOG_OFF : lv;
+	}
+
+	void Put(int lv, const char *fmt, UINT32 a = 0, UINT32 b = 0, UINT32 c = 0) { PutS(lv, fmt, NULL, a, b, c); }
+	void PutS(int lv, const char *fmt, const char *s, UINT32 a = 0, UINT32 b = 0, UINT32 c = 0) {
+		UINT64 n = wr.load(std::memory_order_relaxed);
+		tLOGREC *r = &ring[n & (LOG_RINGSIZE - 1)];
+
+		r->fmt = fmt;
+		r->str = s;
+		r->arg[0] = a;
+		r->arg[1] = b;
+		r->arg[2] = c;
+		r->level = (UINT8)lv;
+		wr.store(n + 1, std::memory_order_release);
+	}
+
+	// Formats the oldest record left into buf, returns FALSE when there is none
+	BOOL Pop(char *buf, size_t size) {
+		tLOGREC r;
+		UINT64 n;
+
+		for (;;) {
+			n = wr.load(std::memory_order_acquire);
+			if (rd == n) return FALSE;
+			if (n - rd > LOG_RINGSIZE) {				// Overwritten before we got there
+				lost += n - LOG_RINGSIZE - rd;
+				rd = n - LOG_RINGSIZE;
+			}
+			r = ring[rd & (LOG_RINGSIZE - 1)];
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (wr.load(std::memory_order_relaxed) - rd <= LOG_RINGSIZE) break;
+			lost++;										// Overwritten while being copied
+			rd++;
+		}
+		rd++;
+		if (r.str != NULL) snprintf(buf, size, r.fmt, r.str, r.arg[0], r.arg[1], r.arg[2]);
+		else snprintf(buf, size, r.fmt, r.arg[0], r.arg[1], r.arg[2]);
+		return TRUE;
+	}
+
+	UINT64 Records(void) { return wr.load(std::memory_order_relaxed); }
+	UINT64 Lost(void) { UINT64 n = lost; lost = 0; return n; }
+
+	int level;
+
+private:
+	tLOGREC *ring;
+	std::atomic<UINT64> wr;		// Records ever written, producer side
+	UINT64 rd;					// Records consumed or lost, consumer side
+	UINT64 lost;
+};
+
+// Logging macros, for code that has a Z80Log named zlog in scope. The
+// arguments are only evaluated when the level is enabled.
+#define Z80LOG(__lv__, ...)		do { if ((__lv__) <= Z80LOG_MAXLEVEL && (__lv__) <= zlog.level) zlog.Put((__lv__), __VA_ARGS__); } while (0)
+#define Z80LOGS(__lv__, ...)	do { if ((__lv__) <= Z80LOG_MAXLEVEL && (__lv__) <= zlog.level) zlog.PutS((__lv__), __VA_ARGS__); } while (0)
+#define ErrorLog(...)			Z80LOG(LOG_ERROR, __VA_ARGS__)
+#define InfoLog(...)			Z80LOG(LOG_INFO, __VA_ARGS__)
+#define DebugLog(...)			Z80LOG(LOG_DEBUG, __VA_ARGS__)
+#define TraceLog(...)			Z80LOG(LOG_TRACE, __VA_ARGS__)
@@ -0,0 +1,92 @@
+#pragma once
+#include "StdAfx.h"
+
+// Per-PC profile of the Z80 core, see Z80Core::EnableProfile().
+//
+// One entry per address of the 64K space counts the instructions started
+// there and the T-states they took, split by machine cycle: opcode fetches
+// (prefixes and interrupt acknowledges included), memory reads and writes,
+// I/O cycles, internal operations and wait states. The core adds the fixed
+// length of a cycle when it sets it up and every TW as it is sampled, to the
+// entry of the instruction running, so the counts cost a few adds per cycle
+// and no work at all on the clock edges. Interrupt acknowledges count at the
+// PC they interrupted, the NOPs of HALT at the HALT.
+//
+// Save() writes the counts in the callgrind format, one function per 256-byte
+// page of the address space, which KCachegrind and callgrind_annotate read.
+
+enum PROFKINDS {
+	PROF_FETCH = 0,			// M1 cycles
+	PROF_MEM = 1,			// Memory reads and writes
+	PROF_IO = 2,			// I/O cycles, their automatic TW included
+	PROF_INTERNAL = 3,		// Internal operations
+	PROF_WAIT = 4,			// TW of WAIT, and the two automatic ones of an INT acknowledge
+	PROF_KINDS = 5
+};
+
+typedef struct {
+	UINT64 instr;			// Instructions started at this address
+	UINT64 t[PROF_KINDS];	// T-states of these instructions, by PROFKINDS
+} tPROFPC;
+
+class Z80Profile
+{
+public:
+	Z80Profile() { Clear(); }
+
+	void Clear(void) { memset(pc, 0, sizeof(pc)); }
+	UINT64 Total(UINT64 *instrs) const {					// T-states counted, and the instructions if instrs is not NULL
+		UINT64 t = 0, n = 0;
+
+		for (UINT a = 0; a < 0x10000; a++) {
+			n += pc[a].instr;
+			for (int k = 0; k < PROF_KINDS; k++) t += pc[a].t[k];
+		}
+		if (instrs != NULL) *instrs = n;
+		return t;
+	}
+
+	bool Save(const char *file, const char *cmd) const {	// Writes the callgrind file for the program cmd, false if it cannot
+		static const char *events[PROF_KINDS] = { "Fetch", "Mem", "IO", "Internal", "Wait" };
+		UINT64 sum[PROF_KINDS + 2] = { 0 };					// T-states, instructions, then by kind
+		const char *name = cmd != NULL ? cmd : "z80";
+		FILE *f;
+		int page = -1;
+
+		if (fopen_s(&f, file, "w") != 0) return false;
+		for (UINT a = 0; a < 0x10000; a++) {
+			sum[1] += pc[a].instr;
+			for (int k = 0; k < PROF_KINDS; k++) {
+				sum[0] += pc[a].t[k];
+				sum[k + 2] += pc[a].t[k];
+			}
+		}
+		fprintf(f, "# callgrind format\nversion: 1\ncreator: VSMZ80\n");
+		fprintf(f, "cmd: %s\npositions: instr\n", name);
+		fprintf(f, "event: T : T-states\nevent: Ir : Instructions\n");
+		for (int k = 0; k < PROF_KINDS; k++) fprintf(f, "event: %s : %s T-states\n", events[k], events[k]);
+		fprintf(f, "events: T Ir");
+		for (int k = 0; k < PROF_KINDS; k++) fprintf(f, " %s", events[k]);
+		fprintf(f, "\nsummary:");
+		for (int k = 0; k < PROF_KINDS + 2; k++) fprintf(f, " %llu", (unsigned long long)sum[k]);
+		fprintf(f, "\n\nob=%s\nfl=%s\n", name, name);
+		for (UINT a = 0; a < 0x10000; a++) {
+			const tPROFPC *e = &pc[a];
+			UINT64 t = 0;
+
+			for (int k = 0; k < PROF_KINDS; k++) t += e->t[k];
+			if (t == 0 && e->instr == 0) continue;
+			if ((int)(a >> 8) != page) {
+				page = a >> 8;
+				fprintf(f, "fn=%02X00-%02XFF\n", page, page);
+			}
+			fprintf(f, "0x%04X %llu %llu", a, (unsigned long long)t, (unsigned long long)e->instr);
+			for (int k = 0; k < PROF_KINDS; k++) fprintf(f, " %llu", (unsigned long long)e->t[k]);
+			fprintf(f, "\n");
+		}
+		fclose(f);
+		return true;
+	}
+
+	tPROFPC pc[0x10000];
+};
@@ -0,0 +1,893 @@
+#include "StdAfx.h"
+#include "Harness.h"
+
+#include <stdarg.h>
+
+/*----------------------------------------------------------------------------*/
+/* Pins */
+
+HarnessPin::HarnessPin(HarnessCkt *c, const char *n) {
+	ckt = c;
+	name = n;
+	model = NULL;
+	handler = NULL;
+	drv[DRV_MODEL] = FLT;
+	drv[DRV_DEVICE] = FLT;
+	cur = prev = FLT;
+	changed = -1;
+	tgq = 1;
+	st_true = SHI;
+	st_false = SLO;
+	st_float = FLT;
+}
+
+BOOL HarnessPin::invert() {
+	return FALSE;
+}
+
+STATE HarnessPin::istate() {
+	return cur;
+}
+
+BOOL HarnessPin::issteady() {
+	return changed != ckt->now;
+}
+
+INT HarnessPin::activity() {
+	if (changed != ckt->now) return 0;
+	if (ishigh(cur)) return 1;
+	if (islow(cur)) return -1;
+	return 0;
+}
+
+BOOL HarnessPin::isactive() {
+	return ishigh(cur);
+}
+
+BOOL HarnessPin::isinactive() {
+	return islow(cur);
+}
+
+BOOL HarnessPin::isposedge() {
+	return changed == ckt->now && !ishigh(prev) && ishigh(cur);
+}
+
+BOOL HarnessPin::isnegedge() {
+	return changed == ckt->now && !islow(prev) && islow(cur);
+}
+
+BOOL HarnessPin::isedge() {
+	return changed == ckt->now && ((islow(prev) && ishigh(cur)) || (ishigh(prev) && islow(cur)));
+}
+
+EVENT *HarnessPin::setstate(ABSTIME time, RELTIME tlh, RELTIME thl, RELTIME tgq, STATE state) {
+	return setstate(time, tgq, state);
+}
+
+EVENT *HarnessPin::setstate(ABSTIME time, RELTIME tgq, STATE state) {
+	EVENT *e = ckt->Post(time + tgq, EVT_PIN);
+	e->pin = this;
+	e->driver = DRV_MODEL;
+	e->state = state;
+	return e;
+}
+
+VOID HarnessPin::setstate(STATE state) {
+	setstate(ckt->now, 0, state);
+}
+
+VOID HarnessPin::sethandler(IDSIMMODEL *m, PINHANDLERFN phf) {
+	model = m;
+	handler = phf;
+}
+
+DSIMNODE HarnessPin::getnode() {
+	return (DSIMNODE)this;
+}
+
+STATE HarnessPin::getstate() {
+	return drv[DRV_MODEL];
+}
+
+VOID HarnessPin::settiming(RELTIME tlh, RELTIME thl, RELTIME t) {
+	tgq = t;
+}
+
+VOID HarnessPin::setstates(STATE tstate, STATE fstate, STATE zstate) {
+	st_true = tstate;
+	st_false = fstate;
+	st_float = zstate;
+}
+
+EVENT *HarnessPin::drivebool(ABSTIME time, BOOL flag) {
+	return setstate(time, tgq, flag ? st_true : st_false);
+}
+
+EVENT *HarnessPin::drivestate(ABSTIME time, STATE state) {
+	return setstate(time, tgq, state);
+}
+
+EVENT *HarnessPin::drivetristate(ABSTIME time) {
+	return setstate(time, tgq, st_float);
+}
+
+VOID HarnessPin::Drive(ABSTIME time, STATE state) {
+	EVENT *e = ckt->Post(time, EVT_PIN);
+	e->pin = this;
+	e->driver = DRV_DEVICE;
+	e->state = state;
+}
+
+VOID HarnessPin::Apply(ABSTIME time, INT driver, STATE state) {
+	STATE s;
+
+	drv[driver] = state;
+	// The stronger driver wins; the model wins a tie
+	if (strength(drv[DRV_DEVICE]) > strength(drv[DRV_MODEL])) s = drv[DRV_DEVICE];
+	else if (isfloating(drv[DRV_MODEL])) s = drv[DRV_DEVICE];
+	else s = drv[DRV_MODEL];
+	if (s == cur) return;
+
+	ckt->stats.pinchanges++;
+	prev = cur;
+	cur = s;
+	changed = time;
+	if (model != NULL && handler != NULL) {
+		ckt->stats.handlers++;
+		(model->*handler)(time, DSIMNORMAL);
+	}
+	else if (model != NULL && driver == DRV_DEVICE) {
+		ckt->stats.handlers++;
+		model->simulate(time, DSIMNORMAL);
+	}
+	for (size_t i = 0; i < listeners.size(); i++)
+		listeners[i]->pinchange(this, time);
+}
+
+VOID HarnessPin::AddListener(HarnessDevice *dev) {
+	listeners.push_back(dev);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Bus pins */
+
+HarnessBusPin::HarnessBusPin(HarnessCkt *c, HarnessPin **p, UINT width) {
+	ckt = c;
+	pins.assign(p, p + width);
+	drive = 0;
+	tgq = 1;
+	st_true = SHI;
+	st_false = SLO;
+	st_float = FLT;
+}
+
+VOID HarnessBusPin::settiming(RELTIME tlh, RELTIME thl, RELTIME tz) {
+	tgq = tz;
+}
+
+VOID HarnessBusPin::setstates(STATE tstate, STATE fstate, STATE zstate) {
+	st_true = tstate;
+	st_false = fstate;
+	st_float = zstate;
+}
+
+VOID HarnessBusPin::sethandler(IDSIMMODEL *model, PINHANDLERFN phf) {
+	for (size_t i = 0; i < pins.size(); i++) pins[i]->sethandler(model, phf);
+}
+
+VOID HarnessBusPin::drivebusvalue(ABSTIME time, DWORD value) {
+	EVENT *e = ckt->Post(time + tgq, EVT_BUS);
+	e->bus = this;
+	e->value = value;
+	e->state = st_true;								// Anything but st_float
+	drive = value;
+}
+
+VOID HarnessBusPin::drivetristate(ABSTIME time) {
+	EVENT *e = ckt->Post(time + tgq, EVT_BUS);
+	e->bus = this;
+	e->value = 0;
+	e->state = st_float;
+}
+
+VOID HarnessBusPin::drivebitstate(ABSTIME time, UINT bit, STATE state) {
+	if (bit < pins.size()) pins[bit]->setstate(time, tgq, state);
+}
+
+DWORD HarnessBusPin::getbusvalue() {
+	DWORD val = 0;
+
+	for (size_t i = 0; i < pins.size(); i++)
+		if (ishigh(pins[i]->istate())) val |= (1 << i);
+	return val;
+}
+
+DWORD HarnessBusPin::getbusdrive() {
+	return drive;
+}
+
+STATE HarnessBusPin::getbitstate(UINT bit) {
+	return bit < pins.size() ? pins[bit]->istate() : FLT;
+}
+
+VOID HarnessBusPin::Apply(ABSTIME time, DWORD value, STATE state) {
+	BOOL tristate = (state == st_float);
+
+	for (size_t i = 0; i < pins.size(); i++)
+		pins[i]->Apply(time, DRV_MODEL, tristate ? st_float : (((value >> i) & 1) ? st_true : st_false));
+}
+
+/*----------------------------------------------------------------------------*/
+/* Scheduler */
+
+HarnessCkt::HarnessCkt() {
+	now = 0;
+	seq = 0;
+	stopped = FALSE;
+	ResetStats();
+}
+
+HarnessCkt::~HarnessCkt() {
+	for (size_t i = 0; i < heap.size(); i++) delete heap[i];
+	for (size_t i = 0; i < pool.size(); i++) delete pool[i];
+}
+
+EVENT *HarnessCkt::Alloc() {
+	EVENT *e;
+
+	if (pool.empty()) return new EVENT;
+	e = pool.back();
+	pool.pop_back();
+	return e;
+}
+
+VOID HarnessCkt::Free(EVENT *e) {
+	pool.push_back(e);
+}
+
+static inline BOOL evtless(const EVENT *a, const EVENT *b) {
+	return (a->time < b->time) || (a->time == b->time && a->seq < b->seq);
+}
+
+VOID HarnessCkt::Push(EVENT *e) {
+	size_t i = heap.size();
+
+	heap.push_back(e);
+	while (i) {
+		size_t p = (i - 1) / 2;
+		if (!evtless(heap[i], heap[p])) break;
+		EVENT *t = heap[i]; heap[i] = heap[p]; heap[p] = t;
+		i = p;
+	}
+}
+
+EVENT *HarnessCkt::Pop() {
+	EVENT *top = heap[0];
+	size_t i = 0, n;
+
+	heap[0] = heap.back();
+	heap.pop_back();
+	n = heap.size();
+	for (;;) {
+		size_t l = 2 * i + 1, r = l + 1, m = i;
+		if (l < n && evtless(heap[l], heap[m])) m = l;
+		if (r < n && evtless(heap[r], heap[m])) m = r;
+		if (m == i) break;
+		EVENT *t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+		i = m;
+	}
+	return top;
+}
+
+EVENT *HarnessCkt::Post(ABSTIME time, INT kind) {
+	EVENT *e = Alloc();
+
+	e->time = (time < now) ? now : time;			// Events in the past happen now
+	e->seq = seq++;
+	e->kind = kind;
+	e->cancelled = FALSE;
+	e->pin = NULL;
+	e->bus = NULL;
+	e->model = NULL;
+	e->func = NULL;
+	e->device = NULL;
+	e->period = 0;
+	stats.posted++;
+	Push(e);
+	return e;
+}
+
+EVENT *HarnessCkt::SetTimer(ABSTIME time, HarnessDevice *dev, EVENTID id) {
+	EVENT *e = Post(time, EVT_DEVICE);
+	e->device = dev;
+	e->id = id;
+	return e;
+}
+
+BOOL HarnessCkt::Run(ABSTIME until) {
+	stopped = FALSE;
+	while (!heap.empty() && !stopped) {
+		if (heap[0]->time > until) {
+			now = until;
+			return FALSE;
+		}
+		EVENT *e = Pop();
+		now = e->time;
+		if (!e->cancelled) {
+			switch (e->kind) {
+			case EVT_PIN:
+				stats.pinevents++;
+				e->pin->Apply(now, e->driver, e->state);
+				break;
+			case EVT_BUS:
+				stats.busevents++;
+				e->bus->Apply(now, e->value, e->state);
+				break;
+			case EVT_CALLBACK:
+				stats.callbacks++;
+				if (e->func != NULL) (e->model->*e->func)(now, e->id);
+				else e->model->callback(now, e->id);
+				break;
+			case EVT_CLOCK:
+				stats.callbacks++;
+				(e->model->*e->func)(now, e->id);
+				if (!e->cancelled) {						// Re-arm the same event
+					e->time += e->period;
+					e->seq = seq++;
+					stats.posted++;
+					Push(e);
+					continue;
+				}
+				break;
+			case EVT_DEVICE:
+				e->device->timer(now, e->id);
+				break;
+			}
+		}
+		Free(e);
+	}
+	if (!stopped) now = until;								// Nothing left to happen, time still runs
+	return stopped;
+}
+
+VOID HarnessCkt::sysvar(DOUBLE *result, DSIMVARS var) {
+	if (var == DSIMTIMENOW) *(ABSTIME *)result = now;	// See IDSIMCKT::systime()
+	else *result = 1.0;
+}
+
+EVENT *HarnessCkt::setcallback(ABSTIME evttime, IDSIMMODEL *model, EVENTID id) {
+	EVENT *e = Post(evttime, EVT_CALLBACK);
+	e->model = model;
+	e->id = id;
+	return e;
+}
+
+BOOL HarnessCkt::cancelcallback(EVENT *event, IDSIMMODEL *model) {
+	if (event == NULL || event->cancelled) return FALSE;
+	event->cancelled = TRUE;
+	return TRUE;
+}
+
+VOID HarnessCkt::setbreak(ABSTIME breaktime) {
+}
+
+VOID HarnessCkt::suspend(IINSTANCE *instance, CHAR *msg) {
+	fprintf(stderr, "suspend: %s\n", msg);
+	stopped = TRUE;
+}
+
+EVENT *HarnessCkt::setcallbackex(ABSTIME evttime, IDSIMMODEL *model, CALLBACKHANDLERFN func, EVENTID id) {
+	EVENT *e = Post(evttime, EVT_CALLBACK);
+	e->model = model;
+	e->func = func;
+	e->id = id;
+	return e;
+}
+
+DSIMNODE HarnessCkt::newnode(CHAR *partid, CHAR *nodename) {
+	return NULL;
+}
+
+IDSIMPIN *HarnessCkt::newpin(IINSTANCE *, DSIMNODE node, CHAR *name, DWORD flags) {
+	return NULL;
+}
+
+EVENT *HarnessCkt::setclockcallback(ABSTIME starttime, RELTIME period, IDSIMMODEL *model, CALLBACKHANDLERFN func, EVENTID id) {
+	EVENT *e = Post(starttime, EVT_CLOCK);
+	e->model = model;
+	e->func = func;
+	e->id = id;
+	e->period = period;
+	return e;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Debug popup */
+
+VOID HarnessPopup::print(CHAR *msg, ...) {
+	char buf[1024];
+	va_list ap;
+	int n;
+
+	// Always format, so the cost matches a real popup
+	va_start(ap, msg);
+	n = vsnprintf(buf, sizeof(buf), msg, ap);
+	va_end(ap);
+	if (n > 0) bytes += n;
+	if (strchr(buf, '\n') != NULL) lines++;
+	if (verbose) fputs(buf, stdout);
+}
+
+VOID HarnessPopup::dump(const BYTE *ptr, UINT nbytes, UINT base) {
+	for (UINT i = 0; i < nbytes; i += 16) {
+		if (verbose) {
+			printf("%04X:", base + i);
+			for (UINT j = i; j < i + 16 && j < nbytes; j++) printf(" %02X", ptr[j]);
+			printf("\n");
+		}
+		lines++;
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+/* Component instance */
+
+HarnessInstance::HarnessInstance(HarnessCkt *c, const char *n) {
+	ckt = c;
+	name = n;
+	model = NULL;
+}
+
+HarnessInstance::~HarnessInstance() {
+	std::map<std::string, HarnessPin *>::iterator it;
+
+	for (it = pins.begin(); it != pins.end(); ++it) delete it->second;
+	for (size_t i = 0; i < buses.size(); i++) delete buses[i];
+}
+
+HarnessPin *HarnessInstance::Pin(const char *n) {
+	HarnessPin *&p = pins[n];
+
+	if (p == NULL) p = new HarnessPin(ckt, n);
+	return p;
+}
+
+VOID HarnessInstance::SetProp(const char *n, const char *v) {
+	props[n] = v;
+}
+
+CHAR *HarnessInstance::id() {
+	return (CHAR *)name.c_str();
+}
+
+CHAR *HarnessInstance::value() {
+	return (CHAR *)"Z80";
+}
+
+CHAR *HarnessInstance::getstrval(CHAR *n, CHAR *defval) {
+	std::map<std::string, std::string>::iterator it = props.find(n);
+
+	if (it == props.end()) return defval;
+	return (CHAR *)it->second.c_str();
+}
+
+VOID HarnessInstance::getnumval(DOUBLE *result, CHAR *n, DOUBLE defval) {
+	CHAR *s = getstrval(n);
+	char *end;
+	DOUBLE v;
+
+	if (s == NULL) {
+		*result = defval;
+		return;
+	}
+	v = strtod(s, &end);
+	// Engineering suffixes as accepted by Proteus
+	switch (*end) {
+	case 'p': v *= 1e-12; break;
+	case 'n': v *= 1e-9; break;
+	case 'u': v *= 1e-6; break;
+	case 'm': v *= 1e-3; break;
+	case 'k': case 'K': v *= 1e3; break;
+	case 'M': v *= 1e6; break;
+	case 'G': v *= 1e9; break;
+	}
+	*result = v;
+}
+
+BOOL HarnessInstance::getboolval(CHAR *n, BOOL defval) {
+	CHAR *s = getstrval(n);
+
+	if (s == NULL) return defval;
+	return !strcasecmp(s, "TRUE") || !strcasecmp(s, "YES") || !strcasecmp(s, "ON") || atoi(s) != 0;
+}
+
+DWORD HarnessInstance::gethexval(CHAR *n, DWORD defval) {
+	CHAR *s = getstrval(n);
+
+	if (s == NULL) return defval;
+	return strtoul(s, NULL, 16);
+}
+
+LONG HarnessInstance::getinitval(CHAR *n, LONG defval) {
+	CHAR *s = getstrval(n);
+
+	if (s == NULL) return defval;
+	return strtol(s, NULL, 0);
+}
+
+RELTIME HarnessInstance::getdelay(CHAR *n, RELTIME deftime) {
+	DOUBLE v;
+
+	if (getstrval(n) == NULL) return deftime;
+	getnumval(&v, n, 0);
+	return dsimtime(v);
+}
+
+IACTIVEMODEL *HarnessInstance::getactivemodel() {
+	return NULL;
+}
+
+IINSTANCE *HarnessInstance::getinterfacemodel() {
+	return NULL;
+}
+
+BOOL HarnessInstance::getmoddata(BYTE **data, DWORD *size) {
+	return FALSE;
+}
+
+SPICENODE HarnessInstance::getspicenode(CHAR *namelist, BOOL required) {
+	return 0;
+}
+
+IDSIMPIN *HarnessInstance::getdsimpin(CHAR *namelist, BOOL required) {
+	return Pin(namelist);
+}
+
+VOID HarnessInstance::log(CHAR *msg, ...) {
+	va_list ap;
+
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+VOID HarnessInstance::warning(CHAR *msg, ...) {
+	va_list ap;
+
+	va_start(ap, msg);
+	fprintf(stderr, "warning: ");
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+VOID HarnessInstance::error(CHAR *msg, ...) {
+	va_list ap;
+
+	va_start(ap, msg);
+	fprintf(stderr, "error: ");
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+VOID HarnessInstance::fatal(CHAR *msg, ...) {
+	va_list ap;
+
+	va_start(ap, msg);
+	fprintf(stderr, "fatal: ");
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+BOOL HarnessInstance::message(CHAR *msg, ...) {
+	return TRUE;
+}
+
+IPOPUP *HarnessInstance::createpopup(CREATEPOPUPSTRUCT *cps) {
+	return (IPOPUP *)static_cast<IDEBUGPOPUP *>(&popup);
+}
+
+VOID HarnessInstance::deletepopup(POPUPID id) {
+}
+
+BOOL HarnessInstance::setvdmhlr(class ICPU *) {
+	return FALSE;
+}
+
+BOOL HarnessInstance::loadmemory(CHAR *filename, VOID *buffer, UINT size, UINT base, UINT shift) {
+	FILE *f;
+	size_t n;
+
+	if (filename == NULL || base >= size) return FALSE;
+	f = fopen(filename, "rb");
+	if (f == NULL) return FALSE;
+	n = fread((BYTE *)buffer + base, 1, size - base, f);
+	fclose(f);
+	return n > 0;
+}
+
+IBUSPIN *HarnessInstance::getbuspin(CHAR *namestem, UINT base, UINT width, BOOL required) {
+	std::vector<HarnessPin *> p(width);
+	char s[32];
+
+	for (UINT i = 0; i < width; i++) {
+		snprintf(s, sizeof(s), "%s%u", namestem, base + i);
+		p[i] = Pin(s);
+	}
+	buses.push_back(new HarnessBusPin(ckt, &p[0], width));
+	return buses.back();
+}
+
+IBUSPIN *HarnessInstance::getbuspin(CHAR *n, IDSIMPIN **p, UINT width) {
+	std::vector<HarnessPin *> hp(width);
+
+	for (UINT i = 0; i < width; i++) hp[i] = static_cast<HarnessPin *>(p[i]);
+	buses.push_back(new HarnessBusPin(ckt, &hp[0], width));
+	return buses.back();
+}
+
+/*----------------------------------------------------------------------------*/
+/* Clock and reset generator */
+
+ClockGen::ClockGen(HarnessCkt *c, HarnessPin *clkpin, HarnessPin *rstpin, RELTIME p) {
+	ckt = c;
+	clk = clkpin;
+	rst = rstpin;
+	period = p;
+	level = FALSE;
+	cycles = 0;
+	rstcycles = 0;
+}
+
+VOID ClockGen::Start(ABSTIME time, INT resetcycles) {
+	rstcycles = resetcycles;
+	cycles = 0;
+	rst->Drive(time, SHI);
+	rst->Drive(time + period / 4, SLO);			// Hold RESET low for a few clocks...
+	rst->Drive(time + period / 4 + resetcycles * period, SHI);	// ...then release it
+	level = FALSE;
+	if (clk == NULL) return;					// The model clocks itself, only RESET is driven
+	clk->Drive(time, SLO);
+	ckt->SetTimer(time + period / 2, this, 0);
+}
+
+VOID ClockGen::timer(ABSTIME time, EVENTID id) {
+	level = !level;
+	clk->Drive(time, level ? SHI : SLO);
+	if (level) cycles++;
+	ckt->SetTimer(time + period / 2, this, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Memory and I/O responder */
+
+MemoryDevice::MemoryDevice(HarnessCkt *c, HarnessInstance *inst, UINT rs) {
+	char s[8];
+	int n;
+
+	ckt = c;
+	romsize = rs;
+	memset(mem, 0, sizeof(mem));
+	memset(ports, 0xFF, sizeof(ports));
+	m1cycles = reads = writes = ioreads = iowrites = 0;
+	result = -1;
+	exited = FALSE;
+	running = NULL;
+	waitstates = 0;
+	period = 0;
+	driving = written = m1 = counted = FALSE;
+
+	pin_M1 = inst->Pin("$M1$");
+	pin_MREQ = inst->Pin("$MREQ$");
+	pin_IORQ = inst->Pin("$IORQ$");
+	pin_RD = inst->Pin("$RD$");
+	pin_WR = inst->Pin("$WR$");
+	pin_RFSH = inst->Pin("$RFSH$");
+	pin_WAIT = inst->Pin("$WAIT$");
+	for (n = 0; n < 16; n++) {
+		snprintf(s, sizeof(s), "A%d", n);
+		pin_A[n] = inst->Pin(s);
+	}
+	for (n = 0; n < 8; n++) {
+		snprintf(s, sizeof(s), "D%d", n);
+		pin_D[n] = inst->Pin(s);
+	}
+	pin_M1->AddListener(this);
+	pin_MREQ->AddListener(this);
+	pin_IORQ->AddListener(this);
+	pin_RD->AddListener(this);
+	pin_WR->AddListener(this);
+}
+
+UINT16 MemoryDevice::GetAddr() {
+	UINT16 val = 0;
+
+	for (int i = 0; i < 16; i++)
+		if (ishigh(pin_A[i]->istate())) val |= (1 << i);
+	return val;
+}
+
+UINT8 MemoryDevice::GetData() {
+	UINT8 val = 0;
+
+	for (int i = 0; i < 8; i++)
+		if (ishigh(pin_D[i]->istate())) val |= (1 << i);
+	return val;
+}
+
+VOID MemoryDevice::DriveData(ABSTIME time, UINT8 val) {
+	for (int i = 0; i < 8; i++)
+		pin_D[i]->Drive(time, ((val >> i) & 1) ? SHI : SLO);
+}
+
+VOID MemoryDevice::FloatData(ABSTIME time) {
+	for (int i = 0; i < 8; i++)
+		pin_D[i]->Drive(time, FLT);
+}
+
+VOID MemoryDevice::Exit() {							// Stops the circuit once all the boards have exited
+	if (running != NULL && !counted) (*running)--;
+	counted = TRUE;
+	if (running == NULL || *running == 0) ckt->Stop();
+}
+
+VOID MemoryDevice::timer(ABSTIME time, EVENTID id) {	// End of the wait states
+	pin_WAIT->Drive(time, SHI);
+}
+
+VOID MemoryDevice::pinchange(HarnessPin *pin, ABSTIME time) {
+	BOOL mreq = islow(pin_MREQ->istate());
+	BOOL iorq = islow(pin_IORQ->istate());
+	BOOL rd = islow(pin_RD->istate());
+	BOOL wr = islow(pin_WR->istate());
+	UINT16 addr;
+
+	if (pin == pin_M1) {
+		if (islow(pin_M1->istate()) && !m1 && exited) Exit();	// Stop on an instruction boundary
+		m1 = islow(pin_M1->istate());
+		return;
+	}
+
+	// A slow device: WAIT is pulled low as the cycle starts (but not for refresh),
+	// and released so that it is seen low on waitstates sampling edges
+	if (waitstates != 0 && (pin == pin_MREQ || pin == pin_IORQ) && islow(pin->istate()) && !islow(pin_RFSH->istate())) {
+		pin_WAIT->Drive(time + 1, SLO);
+		ckt->SetTimer(time + (waitstates + 1) * period - period / 4, this, 0);
+	}
+
+	if ((mreq || iorq) && rd) {
+		if (!driving) {
+			addr = GetAddr();
+			if (mreq) {
+				reads++;
+				if (m1) m1cycles++;						// Opcode fetch, an INT acknowledge reads no memory
+				DriveData(time + 1, mem[addr]);
+			}
+			else {
+				ioreads++;
+				DriveData(time + 1, ports[addr & 0xFF]);
+			}
+			driving = TRUE;
+		}
+	}
+	else if (driving) {
+		FloatData(time + 1);
+		driving = FALSE;
+	}
+
+	if ((mreq || iorq) && wr) {
+		if (!written) {
+			addr = GetAddr();
+			if (mreq) {
+				writes++;
+				if (addr >= romsize) mem[addr] = GetData();
+			}
+			else {
+				iowrites++;
+				if ((addr & 0xFF) == PORT_RESULT) result = GetData();
+				else if ((addr & 0xFF) == PORT_EXIT) {
+					exited = TRUE;
+					if (m1cycles == 0) Exit();				// No fetch on the pins (INTERNALMEM)
+				}
+			}
+			written = TRUE;
+		}
+	}
+	else written = FALSE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* DMA controller */
+
+DmaDevice::DmaDevice(HarnessCkt *c, HarnessInstance *inst, RELTIME p, UINT e, UINT h) {
+	ckt = c;
+	period = p;
+	every = e;
+	hold = h;
+	grants = 0;
+	pin_BUSRQ = inst->Pin("$BUSRQ$");
+	pin_BUSAK = inst->Pin("$BUSAK$");
+	pin_BUSAK->AddListener(this);
+}
+
+VOID DmaDevice::Start(ABSTIME time) {
+	pin_BUSRQ->Drive(time, SHI);
+	ckt->SetTimer(time + every * period, this, 0);
+}
+
+VOID DmaDevice::pinchange(HarnessPin *pin, ABSTIME time) {
+	if (!islow(pin_BUSAK->istate())) return;
+	grants++;
+	ckt->SetTimer(time + hold * period, this, 1);
+}
+
+VOID DmaDevice::timer(ABSTIME time, EVENTID id) {
+	if (id == 0) pin_BUSRQ->Drive(time, SLO);			// Request
+	else {
+		pin_BUSRQ->Drive(time, SHI);					// Done, the next request comes later
+		ckt->SetTimer(time + every * period, this, 0);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+/* Timer interrupts */
+
+TickDevice::TickDevice(HarnessCkt *c, HarnessInstance *inst, RELTIME p, UINT e, BOOL n) {
+	char s[8];
+
+	ckt = c;
+	period = p;
+	every = e;
+	nmi = n;
+	ticks = acks = 0;
+	driving = FALSE;
+	pin_INT = inst->Pin("$INT$");
+	pin_NMI = inst->Pin("$NMI$");
+	pin_M1 = inst->Pin("$M1$");
+	pin_IORQ = inst->Pin("$IORQ$");
+	for (int i = 0; i < 8; i++) {
+		snprintf(s, sizeof(s), "D%d", i);
+		pin_D[i] = inst->Pin(s);
+	}
+	pin_M1->AddListener(this);
+	pin_IORQ->AddListener(this);
+}
+
+VOID TickDevice::Start(ABSTIME time) {
+	pin_INT->Drive(time, SHI);
+	pin_NMI->Drive(time, SHI);
+	ckt->SetTimer(time + every * period, this, 0);
+}
+
+VOID TickDevice::pinchange(HarnessPin *pin, ABSTIME time) {
+	BOOL inta = islow(pin_M1->istate()) && islow(pin_IORQ->istate());
+
+	if (inta && !driving) {								// Acknowledge: vector on the bus, request withdrawn
+		acks++;
+		for (int i = 0; i < 8; i++) pin_D[i]->Drive(time + 1, ((INT_VECTOR >> i) & 1) ? SHI : SLO);
+		pin_INT->Drive(time + 1, SHI);
+		driving = TRUE;
+	}
+	else if (!inta && driving) {
+		for (int i = 0; i < 8; i++) pin_D[i]->Drive(time + 1, FLT);
+		driving = FALSE;
+	}
+}
+
+VOID TickDevice::timer(ABSTIME time, EVENTID id) {
+	if (id == 1) {										// End of the NMI pulse
+		pin_NMI->Drive(time, SHI);
+		return;
+	}
+	ticks++;
+	if (nmi) {
+		pin_NMI->Drive(time, SLO);
+		ckt->SetTimer(time + period, this, 1);
+	}
+	else pin_INT->Drive(time, SLO);
+	ckt->SetTimer(time + every * period, this, 0);
+}
@@ -0,0 +1,319 @@
+#pragma once
+#include "StdAfx.h"
+#include "sdk/vsm.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Headless stand-ins for the Proteus DSIM kernel. Only what the Z80 model
+// uses is implemented; everything else is a harmless stub.
+
+class HarnessCkt;
+class HarnessPin;
+class HarnessBusPin;
+
+enum EVENTKINDS {
+	EVT_PIN = 0,		// Pin drive change
+	EVT_CALLBACK = 1,	// IDSIMCKT::setcallback/setcallbackex
+	EVT_CLOCK = 2,		// IDSIMCKT::setclockcallback (repeats)
+	EVT_DEVICE = 3,		// Harness-side device timer
+	EVT_BUS = 4			// Bus pin drive change, one event for all bits
+};
+
+enum DRIVERS {
+	DRV_MODEL = 0,		// Driven through the IDSIMPIN handed to the model
+	DRV_DEVICE = 1		// Driven by the harness (clock, reset, memory)
+};
+
+// Harness-side peripheral (clock generator, memory responder...)
+class HarnessDevice {
+public:
+	virtual ~HarnessDevice() {}
+	virtual VOID pinchange(HarnessPin *pin, ABSTIME time) {}
+	virtual VOID timer(ABSTIME time, EVENTID id) {}
+};
+
+// Scheduler event, opaque to the models
+class EVENT {
+public:
+	ABSTIME time;
+	UINT64 seq;
+	INT kind;
+	BOOL cancelled;
+	HarnessPin *pin;
+	HarnessBusPin *bus;
+	DWORD value;
+	INT driver;
+	STATE state;
+	IDSIMMODEL *model;
+	CALLBACKHANDLERFN func;
+	HarnessDevice *device;
+	EVENTID id;
+	RELTIME period;
+};
+
+struct HARNESSSTATS {
+	UINT64 posted;			// Events scheduled by anybody
+	UINT64 pinevents;		// Pin events processed
+	UINT64 busevents;		// Bus pin events processed (one per bus update)
+	UINT64 pinchanges;		// Pin events that changed the resolved net state
+	UINT64 callbacks;		// Model callbacks fired
+	UINT64 handlers;		// Model pin handlers/simulate() invoked
+};
+
+class HarnessPin : public IDSIMPIN {
+public:
+	HarnessPin(HarnessCkt *ckt, const char *name);
+
+	// IDSIMPIN1
+	BOOL invert();
+	STATE istate();
+	BOOL issteady();
+	INT activity();
+	BOOL isactive();
+	BOOL isinactive();
+	BOOL isposedge();
+	BOOL isnegedge();
+	BOOL isedge();
+	EVENT *setstate(ABSTIME time, RELTIME tlh, RELTIME thl, RELTIME tgq, STATE state);
+	EVENT *setstate(ABSTIME time, RELTIME tgq, STATE state);
+	VOID setstate(STATE state);
+	VOID sethandler(IDSIMMODEL *model, PINHANDLERFN phf);
+	DSIMNODE getnode();
+	STATE getstate();
+	// IDSIMPIN2
+	VOID settiming(RELTIME tlh, RELTIME thl, RELTIME tgq);
+	VOID setstates(STATE tstate, STATE fstate, STATE zstate);
+	EVENT *drivebool(ABSTIME time, BOOL flag);
+	EVENT *drivestate(ABSTIME time, STATE state);
+	EVENT *drivetristate(ABSTIME time);
+
+	// Harness side
+	VOID Drive(ABSTIME time, STATE state);			// Device-side drive
+	VOID Apply(ABSTIME time, INT driver, STATE state);
+	VOID AddListener(HarnessDevice *dev);
+
+	std::string name;
+	IDSIMMODEL *model;								// Owner, for simulate() calls
+	PINHANDLERFN handler;
+
+private:
+	HarnessCkt *ckt;
+	STATE drv[2];
+	STATE cur, prev;
+	ABSTIME changed;
+	RELTIME tgq;
+	STATE st_true, st_false, st_float;
+	std::vector<HarnessDevice *> listeners;
+};
+
+class HarnessBusPin : public IBUSPIN {
+public:
+	HarnessBusPin(HarnessCkt *ckt, HarnessPin **pins, UINT width);
+
+	VOID settiming(RELTIME tlh, RELTIME thl, RELTIME tz);
+	VOID setstates(STATE tstate, STATE fstate, STATE zstate);
+	VOID sethandler(IDSIMMODEL *model, PINHANDLERFN phf);
+	VOID drivebusvalue(ABSTIME time, DWORD value);
+	VOID drivetristate(ABSTIME time);
+	VOID drivebitstate(ABSTIME time, UINT bit, STATE state);
+	DWORD getbusvalue();
+	DWORD getbusdrive();
+	STATE getbitstate(UINT bit);
+
+	// Harness side
+	VOID Apply(ABSTIME time, DWORD value, STATE state);	// state is st_float to release the bus
+
+private:
+	HarnessCkt *ckt;
+	std::vector<HarnessPin *> pins;
+	DWORD drive;
+	RELTIME tgq;
+	STATE st_true, st_false, st_float;
+};
+
+class HarnessCkt : public IDSIMCKT {
+public:
+	HarnessCkt();
+	~HarnessCkt();
+
+	VOID sysvar(DOUBLE *result, DSIMVARS var);
+	EVENT *setcallback(ABSTIME evttime, IDSIMMODEL *model, EVENTID id);
+	BOOL cancelcallback(EVENT *event, IDSIMMODEL *model);
+	VOID setbreak(ABSTIME breaktime);
+	VOID suspend(IINSTANCE *instance, CHAR *msg);
+	EVENT *setcallbackex(ABSTIME evttime, IDSIMMODEL *model, CALLBACKHANDLERFN func, EVENTID id);
+	DSIMNODE newnode(CHAR *partid, CHAR *nodename);
+	IDSIMPIN *newpin(IINSTANCE *, DSIMNODE node, CHAR *name, DWORD flags);
+	EVENT *setclockcallback(ABSTIME starttime, RELTIME period, IDSIMMODEL *model, CALLBACKHANDLERFN func, EVENTID id);
+
+	EVENT *Post(ABSTIME time, INT kind);
+	EVENT *SetTimer(ABSTIME time, HarnessDevice *dev, EVENTID id);
+	BOOL Run(ABSTIME until);						// Returns FALSE if stopped early
+	VOID Stop() { stopped = TRUE; }
+	VOID ResetStats() { memset(&stats, 0, sizeof(stats)); }
+
+	ABSTIME now;
+	HARNESSSTATS stats;
+
+private:
+	EVENT *Alloc();
+	VOID Free(EVENT *e);
+	VOID Push(EVENT *e);
+	EVENT *Pop();
+
+	std::vector<EVENT *> heap;
+	std::vector<EVENT *> pool;
+	UINT64 seq;
+	BOOL stopped;
+};
+
+class HarnessPopup : public IDEBUGPOPUP {
+public:
+	HarnessPopup() : verbose(FALSE), lines(0), bytes(0) {}
+	VOID print(CHAR *msg, ...);
+	VOID dump(const BYTE *ptr, UINT nbytes, UINT base = 0);
+
+	BOOL verbose;									// Echo to stdout
+	UINT64 lines, bytes;
+};
+
+class HarnessInstance : public IINSTANCE {
+public:
+	HarnessInstance(HarnessCkt *ckt, const char *name);
+	~HarnessInstance();
+
+	CHAR *id();
+	CHAR *value();
+	CHAR *getstrval(CHAR *name, CHAR *defval = NULL);
+	VOID getnumval(DOUBLE *result, CHAR *name, DOUBLE defval = 0);
+	BOOL getboolval(CHAR *name, BOOL defval = FALSE);
+	DWORD gethexval(CHAR *name, DWORD defval = 0);
+	LONG getinitval(CHAR *name, LONG defval = 0);
+	RELTIME getdelay(CHAR *name, RELTIME deftime = 0);
+	IACTIVEMODEL *getactivemodel();
+	IINSTANCE *getinterfacemodel();
+	BOOL getmoddata(BYTE **data, DWORD *size);
+	SPICENODE getspicenode(CHAR *namelist, BOOL required);
+	IDSIMPIN *getdsimpin(CHAR *namelist, BOOL required);
+	VOID log(CHAR *msg, ...);
+	VOID warning(CHAR *msg, ...);
+	VOID error(CHAR *msg, ...);
+	VOID fatal(CHAR *msg, ...);
+	BOOL message(CHAR *msg, ...);
+	IPOPUP *createpopup(CREATEPOPUPSTRUCT *cps);
+	VOID deletepopup(POPUPID id);
+	BOOL setvdmhlr(class ICPU *);
+	BOOL loadmemory(CHAR *filename, VOID *buffer, UINT size, UINT base = 0, UINT shift = 0);
+	IBUSPIN *getbuspin(CHAR *namestem, UINT base, UINT width, BOOL required);
+	IBUSPIN *getbuspin(CHAR *name, IDSIMPIN **pins, UINT width);
+
+	HarnessPin *Pin(const char *name);				// Finds or creates a net
+	VOID SetProp(const char *name, const char *value);
+
+	IDSIMMODEL *model;
+	HarnessPopup popup;
+
+private:
+	HarnessCkt *ckt;
+	std::string name;
+	std::map<std::string, HarnessPin *> pins;
+	std::vector<HarnessBusPin *> buses;
+	std::map<std::string, std::string> props;
+};
+
+// Clock and reset generator for one board
+class ClockGen : public HarnessDevice {
+public:
+	ClockGen(HarnessCkt *ckt, HarnessPin *clk, HarnessPin *rst, RELTIME period);
+	VOID Start(ABSTIME time, INT resetcycles);
+	VOID timer(ABSTIME time, EVENTID id);
+
+	UINT64 cycles;									// Rising edges since reset release (none without a CLK pin)
+	UINT64 rstcycles;
+
+private:
+	HarnessCkt *ckt;
+	HarnessPin *clk, *rst;
+	RELTIME period;
+	BOOL level;
+};
+
+// ROM/RAM and I/O responder watching the Z80 control pins
+#define PORT_RESULT	0xFE							// OUT (0FEh),A records a result byte
+#define PORT_EXIT	0xFF							// OUT (0FFh),A ends the run
+#define PORT_TICKS	0xFD							// IN A,(0FDh) reads the timer ticks to wait for, 0 without a timer
+
+class MemoryDevice : public HarnessDevice {
+public:
+	MemoryDevice(HarnessCkt *ckt, HarnessInstance *inst, UINT romsize);
+	VOID pinchange(HarnessPin *pin, ABSTIME time);
+	VOID timer(ABSTIME time, EVENTID id);
+
+	UINT8 mem[0x10000];
+	UINT8 ports[0x100];								// Values returned by IN
+	UINT romsize;									// Writes below this address are ignored
+	UINT64 m1cycles, reads, writes, ioreads, iowrites;
+	INT result;
+	BOOL exited;
+	UINT *running;									// Boards sharing the circuit still running, NULL if alone
+	UINT waitstates;								// Held on WAIT by every memory and I/O cycle
+	RELTIME period;									// Clock period, to time them
+
+private:
+	UINT16 GetAddr();
+	UINT8 GetData();
+	VOID DriveData(ABSTIME time, UINT8 val);
+	VOID FloatData(ABSTIME time);
+	VOID Exit();
+
+	HarnessCkt *ckt;
+	HarnessPin *pin_M1, *pin_MREQ, *pin_IORQ, *pin_RD, *pin_WR;
+	HarnessPin *pin_RFSH, *pin_WAIT;
+	HarnessPin *pin_A[16];
+	HarnessPin *pin_D[8];
+	BOOL driving, written, m1;
+	BOOL counted;									// Taken off *running
+};
+
+// DMA controller taking the bus at regular intervals through BUSRQ/BUSAK
+class DmaDevice : public HarnessDevice {
+public:
+	DmaDevice(HarnessCkt *ckt, HarnessInstance *inst, RELTIME period, UINT every, UINT hold);
+	VOID Start(ABSTIME time);
+	VOID pinchange(HarnessPin *pin, ABSTIME time);
+	VOID timer(ABSTIME time, EVENTID id);
+
+	UINT64 grants;									// Falling edges of BUSAK
+
+private:
+	HarnessCkt *ckt;
+	HarnessPin *pin_BUSRQ, *pin_BUSAK;
+	RELTIME period;
+	UINT every;										// T-states from a release to the next request
+	UINT hold;										// T-states the bus is kept once granted
+};
+
+// Timer interrupting the Z80 at regular intervals: INT held low until the
+// acknowledge, which reads INT_VECTOR, or a one T-state pulse on NMI
+#define INT_VECTOR	0xFF							// RST 38h in IM 0
+
+class TickDevice : public HarnessDevice {
+public:
+	TickDevice(HarnessCkt *ckt, HarnessInstance *inst, RELTIME period, UINT every, BOOL nmi);
+	VOID Start(ABSTIME time);
+	VOID pinchange(HarnessPin *pin, ABSTIME time);
+	VOID timer(ABSTIME time, EVENTID id);
+
+	UINT64 ticks, acks;								// Interrupts raised, INT acknowledge cycles seen
+
+private:
+	HarnessCkt *ckt;
+	HarnessPin *pin_INT, *pin_NMI, *pin_M1, *pin_IORQ;
+	HarnessPin *pin_D[8];
+	RELTIME period;
+	UINT every;										// T-states between two ticks
+	BOOL nmi;										// Ticks on NMI instead of INT
+	BOOL driving;									// Vector on the data bus
+};
@@ -0,0 +1,273 @@
+#include "StdAfx.h"
+#include "Programs.h"
+
+/* checksum of the first 256 bytes of ROM, 64 passes */
+static const UINT8 prog_alu[] = {
+	0x31, 0x00, 0xFF,		// 0000  LD SP,0FF00h
+	0x3E, 0x40,				// 0003  LD A,40h
+	0x32, 0x00, 0x80,		// 0005  LD (8000h),A
+	0x21, 0x00, 0x00,		// 0008  LD HL,0000h
+	0x11, 0x01, 0x00,		// 000B  LD DE,0001h
+	0x0E, 0x00,				// 000E  LD C,0
+	0x7E,					// 0010  LD A,(HL)
+	0x81,					// 0011  ADD A,C
+	0xAA,					// 0012  XOR D
+	0x4F,					// 0013  LD C,A
+	0x19,					// 0014  ADD HL,DE
+	0x7D,					// 0015  LD A,L
+	0xFE, 0x00,				// 0016  CP 0
+	0xC2, 0x10, 0x00,		// 0018  JP NZ,0010h
+	0x3A, 0x00, 0x80,		// 001B  LD A,(8000h)
+	0xD6, 0x01,				// 001E  SUB 1
+	0x32, 0x00, 0x80,		// 0020  LD (8000h),A
+	0xC2, 0x08, 0x00,		// 0023  JP NZ,0008h
+	0x79,					// 0026  LD A,C
+	0xD3, 0xFE,				// 0027  OUT (0FEh),A
+	0xD3, 0xFF,				// 0029  OUT (0FFh),A
+	0xC3, 0x2B, 0x00,		// 002B  JP 002Bh
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 002E
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0036
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 003E
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0046
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 004E
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0056
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 005E
+	0xED, 0x45				// 0066  RETN	; NMI handler
+};
+
+static INT expect_alu(const UINT8 *mem) {
+	UINT8 sum = 0;
+
+	for (int i = 0; i < 0x100; i++) sum += mem[i];
+	return sum;
+}
+
+/* copies the first 256 bytes of ROM to 9000h, 32 passes */
+static const UINT8 prog_memcpy[] = {
+	0x31, 0x00, 0xFF,		// 0000  LD SP,0FF00h
+	0x3E, 0x20,				// 0003  LD A,20h
+	0x32, 0x00, 0x80,		// 0005  LD (8000h),A
+	0x21, 0x00, 0x00,		// 0008  LD HL,0000h
+	0x11, 0x00, 0x90,		// 000B  LD DE,9000h
+	0x01, 0x01, 0x00,		// 000E  LD BC,0001h
+	0x7E,					// 0011  LD A,(HL)
+	0x12,					// 0012  LD (DE),A
+	0x09,					// 0013  ADD HL,BC
+	0xEB,					// 0014  EX DE,HL
+	0x09,					// 0015  ADD HL,BC
+	0xEB,					// 0016  EX DE,HL
+	0x7D,					// 0017  LD A,L
+	0xFE, 0x00,				// 0018  CP 0
+	0xC2, 0x11, 0x00,		// 001A  JP NZ,0011h
+	0x3A, 0x00, 0x80,		// 001D  LD A,(8000h)
+	0xD6, 0x01,				// 0020  SUB 1
+	0x32, 0x00, 0x80,		// 0022  LD (8000h),A
+	0xC2, 0x08, 0x00,		// 0025  JP NZ,0008h
+	0x3A, 0x02, 0x90,		// 0028  LD A,(9002h)
+	0xD3, 0xFE,				// 002B  OUT (0FEh),A
+	0xD3, 0xFF,				// 002D  OUT (0FFh),A
+	0xC3, 0x2F, 0x00,		// 002F  JP 002Fh
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0032
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 003A
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0042
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 004A
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0052
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 005A
+	0x00, 0x00, 0x00, 0x00,		// 0062
+	0xED, 0x45				// 0066  RETN	; NMI handler
+};
+
+static INT expect_memcpy(const UINT8 *mem) {
+	for (int i = 0; i < 0x100; i++)
+		if (mem[0x9000 + i] != mem[i]) return -2;		// Copy is incomplete
+	return mem[0x0002];
+}
+
+/* subroutine calls with stack and indexed memory traffic, 64 passes of 256 calls */
+static const UINT8 prog_call[] = {
+	0x31, 0x00, 0xFF,		// 0000  LD SP,0FF00h
+	0xDD, 0x21, 0x00, 0x90,	// 0003  LD IX,9000h
+	0x3E, 0x40,				// 0007  LD A,40h
+	0x32, 0x00, 0x80,		// 0009  LD (8000h),A
+	0x06, 0x00,				// 000C  LD B,0
+	0xCD, 0x30, 0x00,		// 000E  CALL 0030h
+	0x10, 0xFB,				// 0011  DJNZ 000Eh
+	0x3A, 0x00, 0x80,		// 0013  LD A,(8000h)
+	0x3D,					// 0016  DEC A
+	0x32, 0x00, 0x80,		// 0017  LD (8000h),A
+	0x20, 0xF0,				// 001A  JR NZ,000Ch
+	0x79,					// 001C  LD A,C
+	0xDD, 0x86, 0x01,		// 001D  ADD A,(IX+1)
+	0xD3, 0xFE,				// 0020  OUT (0FEh),A
+	0xD3, 0xFF,				// 0022  OUT (0FFh),A
+	0x18, 0xFE,				// 0024  JR 0024h
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xC5,					// 0030  PUSH BC
+	0x78,					// 0031  LD A,B
+	0xC1,					// 0032  POP BC
+	0x81,					// 0033  ADD A,C
+	0x4F,					// 0034  LD C,A
+	0xDD, 0x34, 0x01,		// 0035  INC (IX+1)
+	0x20, 0x01,				// 0038  JR NZ,003Bh
+	0x0C,					// 003A  INC C
+	0xC9,					// 003B  RET
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 003C
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0044
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 004C
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0054
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 005C
+	0x00, 0x00,				// 0064
+	0xED, 0x45				// 0066  RETN	; NMI handler
+};
+
+static INT expect_call(const UINT8 *mem) {
+	UINT8 c = 0, count = 0;
+
+	for (int pass = 0; pass < 0x40; pass++) {
+		UINT8 b = 0;
+		do {
+			c += b;
+			if (++count == 0) c++;
+		} while (--b);
+	}
+	return (UINT8)(c + count);
+}
+
+/* CRC-16/CCITT of the first 256 bytes of ROM, bit by bit, 8 passes */
+static const UINT8 prog_crc[] = {
+	0x31, 0x00, 0xFF,		// 0000  LD SP,0FF00h
+	0x3E, 0x08,				// 0003  LD A,08h
+	0x32, 0x00, 0x80,		// 0005  LD (8000h),A
+	0x21, 0x00, 0x00,		// 0008  LD HL,0000h
+	0x11, 0xFF, 0xFF,		// 000B  LD DE,0FFFFh
+	0x06, 0x00,				// 000E  LD B,0
+	0x7E,					// 0010  LD A,(HL)
+	0xAA,					// 0011  XOR D
+	0x57,					// 0012  LD D,A
+	0x0E, 0x08,				// 0013  LD C,8
+	0xCB, 0x23,				// 0015  SLA E
+	0xCB, 0x12,				// 0017  RL D
+	0x30, 0x08,				// 0019  JR NC,0023h
+	0x7A,					// 001B  LD A,D
+	0xEE, 0x10,				// 001C  XOR 10h
+	0x57,					// 001E  LD D,A
+	0x7B,					// 001F  LD A,E
+	0xEE, 0x21,				// 0020  XOR 21h
+	0x5F,					// 0022  LD E,A
+	0x0D,					// 0023  DEC C
+	0x20, 0xEF,				// 0024  JR NZ,0015h
+	0x23,					// 0026  INC HL
+	0x10, 0xE7,				// 0027  DJNZ 0010h
+	0x3A, 0x00, 0x80,		// 0029  LD A,(8000h)
+	0x3D,					// 002C  DEC A
+	0x32, 0x00, 0x80,		// 002D  LD (8000h),A
+	0x20, 0xD6,				// 0030  JR NZ,0008h
+	0x7A,					// 0032  LD A,D
+	0xAB,					// 0033  XOR E
+	0xD3, 0xFE,				// 0034  OUT (0FEh),A
+	0xD3, 0xFF,				// 0036  OUT (0FFh),A
+	0x18, 0xFE,				// 0038  JR 0038h
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 003A
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0042
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 004A
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0052
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 005A
+	0x00, 0x00, 0x00, 0x00,		// 0062
+	0xED, 0x45				// 0066  RETN	; NMI handler
+};
+
+static INT expect_crc(const UINT8 *mem) {
+	UINT16 crc = 0xFFFF;
+
+	for (int i = 0; i < 0x100; i++) {
+		crc ^= mem[i] << 8;
+		for (int b = 0; b < 8; b++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return (crc >> 8) ^ (crc & 0xFF);
+}
+
+/* rotating checksum of the first 256 bytes of ROM with the timer interrupt
+   enabled (IM 2), then HALT until PORT_TICKS more ticks have been counted */
+static const UINT8 prog_irq[] = {
+	0x31, 0x00, 0xFF,		// 0000  LD SP,0FF00h
+	0x21, 0x40, 0x00,		// 0003  LD HL,0040h
+	0x22, 0xFF, 0x80,		// 0006  LD (80FFh),HL	; IM 2 table entry of vector 0FFh
+	0x3E, 0x80,				// 0009  LD A,80h
+	0xED, 0x47,				// 000B  LD I,A
+	0xED, 0x5E,				// 000D  IM 2
+	0xAF,					// 000F  XOR A
+	0x32, 0x00, 0x80,		// 0010  LD (8000h),A	; ticks
+	0xFB,					// 0013  EI
+	0x0E, 0x00,				// 0014  LD C,0
+	0x06, 0x20,				// 0016  LD B,20h
+	0x21, 0x00, 0x00,		// 0018  LD HL,0000h
+	0x7E,					// 001B  LD A,(HL)
+	0x81,					// 001C  ADD A,C
+	0x07,					// 001D  RLCA
+	0x4F,					// 001E  LD C,A
+	0x2C,					// 001F  INC L
+	0x20, 0xF9,				// 0020  JR NZ,001Bh
+	0x10, 0xF4,				// 0022  DJNZ 0018h
+	0xDB, 0xFD,				// 0024  IN A,(0FDh)
+	0xB7,					// 0026  OR A
+	0x28, 0x0F,				// 0027  JR Z,0038h
+	0x5F,					// 0029  LD E,A
+	0xF3,					// 002A  DI
+	0xAF,					// 002B  XOR A
+	0x32, 0x00, 0x80,		// 002C  LD (8000h),A
+	0xFB,					// 002F  EI
+	0x76,					// 0030  HALT
+	0x3A, 0x00, 0x80,		// 0031  LD A,(8000h)
+	0xBB,					// 0034  CP E
+	0x38, 0xF9,				// 0035  JR C,0030h
+	0xF3,					// 0037  DI
+	0x79,					// 0038  LD A,C
+	0xD3, 0xFE,				// 0039  OUT (0FEh),A
+	0xD3, 0xFF,				// 003B  OUT (0FFh),A
+	0x18, 0xFE,				// 003D  JR 003Dh
+	0x00,					// 003F
+	0xF5,					// 0040  PUSH AF	; INT handler
+	0x3A, 0x00, 0x80,		// 0041  LD A,(8000h)
+	0x3C,					// 0044  INC A
+	0x32, 0x00, 0x80,		// 0045  LD (8000h),A
+	0xF1,					// 0048  POP AF
+	0xFB,					// 0049  EI
+	0xED, 0x4D,				// 004A  RETI
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 004C
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 0054
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 005C
+	0x00, 0x00,				// 0064
+	0xF5,					// 0066  PUSH AF	; NMI handler
+	0x3A, 0x00, 0x80,		// 0067  LD A,(8000h)
+	0x3C,					// 006A  INC A
+	0x32, 0x00, 0x80,		// 006B  LD (8000h),A
+	0xF1,					// 006E  POP AF
+	0xED, 0x45				// 006F  RETN
+};
+
+static INT expect_irq(const UINT8 *mem) {
+	UINT8 c = 0;
+
+	for (int pass = 0; pass < 0x20; pass++)
+		for (int i = 0; i < 0x100; i++) {
+			UINT8 a = mem[i] + c;
+			c = (a << 1) | (a >> 7);
+		}
+	return c;
+}
+
+const tPROGRAM programs[] = {
+	{ "alu", "ALU and 16-bit add loop over ROM", prog_alu, sizeof(prog_alu), expect_alu },
+	{ "memcpy", "Memory to memory block copy", prog_memcpy, sizeof(prog_memcpy), expect_memcpy },
+	{ "call", "Subroutine calls, stack and indexed memory", prog_call, sizeof(prog_call), expect_call },
+	{ "crc", "Bitwise CRC-16, shifts and flag tests", prog_crc, sizeof(prog_crc), expect_crc },
+	{ "irq", "Checksum under timer interrupts, then HALT between ticks", prog_irq, sizeof(prog_irq), expect_irq }
+};
+
+const int numprograms = sizeof(programs) / sizeof(programs[0]);
+
+const tPROGRAM *FindProgram(const char *name) {
+	for (int i = 0; i < numprograms; i++)
+		if (!strcmp(programs[i].name, name)) return &programs[i];
+	return NULL;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "StdAfx.h"
+#include "sdk/vsm.hpp"
+
+// Built-in benchmark programs. Each one loads at 0000h, reports a result
+// byte with OUT (0FEh),A and finishes with OUT (0FFh),A. All of them have an
+// NMI handler at 0066h, if only a RETN, so that they run under the -N timer.
+
+typedef struct {
+	const char *name;
+	const char *desc;
+	const UINT8 *code;
+	UINT size;
+	INT (*expect)(const UINT8 *mem);				// Expected result byte, or -1 if unchecked
+} tPROGRAM;
+
+extern const tPROGRAM programs[];
+extern const int numprograms;
+
+const tPROGRAM *FindProgram(const char *name);
@@ -0,0 +1,53 @@
+// StdAfx.h : Linux stand-in for the Windows precompiled header.
+// The harness build puts this directory on the include path so that the model
+// sources compile unmodified without <windows.h>.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define __int64 long long
+
+typedef int8_t INT8;
+typedef int16_t INT16;
+typedef int32_t INT32;
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+
+// MSVC aligned heap, used for the cache-aligned model instances
+inline void *_aligned_malloc(size_t size, size_t align) {
+	void *p;
+	return posix_memalign(&p, align, size) ? NULL : p;
+}
+#define _aligned_free(__p__) free(__p__)
+
+// Only the array form of sprintf_s is used by the model
+#define sprintf_s(__buf__, ...) snprintf(__buf__, sizeof(__buf__), __VA_ARGS__)
+
+inline int fopen_s(FILE **f, const char *name, const char *mode) {
+	*f = fopen(name, mode);
+	return *f == NULL;
+}
+
+inline int _itoa_s(int value, char *buf, size_t size, int radix) {
+	const char *digits = "0123456789abcdefghijklmnopqrstuvwxyz";
+	char tmp[40];
+	unsigned int v = (value < 0 && radix == 10) ? -value : value;
+	int n = 0;
+
+	do {
+		tmp[n++] = digits[v % radix];
+		v /= radix;
+	} while (v);
+	if (value < 0 && radix == 10) tmp[n++] = '-';
+	if ((size_t)n >= size) return 1;
+	while (n) *buf++ = tmp[--n];
+	*buf = 0;
+	return 0;
+}
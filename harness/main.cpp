@@ -0,0 +1,448 @@
+// main.cpp : Headless benchmark driver for the Z80 model.
+//
+// Runs the DSIM model against an in-process scheduler, clock generator and
+// ROM/RAM responder, and reports how fast it simulates.
+//
+
+#include "StdAfx.h"
+#include "Harness.h"
+#include "Programs.h"
+#include "DsimModel.h"
+#include "Z80Core.h"
+
+#include <time.h>
+
+typedef struct {
+	const char *name;
+	UINT boards;									// Copies run side by side, counts are totals
+	UINT64 tstates;
+	UINT64 instrs;
+	double wall;
+	HARNESSSTATS stats;
+	UINT64 loglines;
+	UINT64 issued, suppressed;						// Model output drives, see DsimBus
+	UINT64 blk_hits, blk_misses, blk_invalidations;	// Decode cache of Step()
+	UINT64 jit_runs;								// Compiled blocks run by StepBlock()
+	UINT64 dma_grants;								// Bus grants to the DMA controller
+	UINT64 ticks, acks;								// Timer interrupts raised, INT acknowledges
+	BOOL tick_nmi;									// The timer pulsed NMI, which has no acknowledge
+	UINT64 prof_tstates, prof_instrs;				// Counted by the per-PC profile
+	INT result;
+	INT expected;
+	BOOL finished;
+} tRESULT;
+
+typedef struct {
+	double clock;									// Clock frequency in Hz
+	UINT64 maxtstates;								// Give up after this many T-states
+	BOOL verbose;
+	BOOL batch;										// Run the bare core, without DSIM
+	BOOL lazy;										// ...with lazy flag evaluation
+	UINT boards;									// Z80s simulated side by side
+	BOOL internal;									// Memory inside the model (INTERNALMEM)
+	BOOL cache;										// With -b, decode cache of Step()
+	BOOL jit;										// With -b, compiled blocks (StepBlock())
+	BOOL modelclock;								// The model generates its clock (CLOCK), CLK is not driven
+	UINT waitstates;								// Wait states of every memory and I/O cycle on the pins
+	UINT dma_every, dma_hold;						// DMA controller, 0 if none
+	UINT tick_every;								// Timer interrupt period in T-states, 0 if none
+	BOOL tick_nmi;									// ...on NMI instead of INT
+	const char *profile;							// Per-PC profile written to PROFILE.<program>, NULL if none
+	std::vector<std::pair<std::string, std::string> > props;
+} tOPTIONS;
+
+#define TICKS_WAITED	100							// Read by the programs on PORT_TICKS when a timer runs
+
+static double walltime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// One Z80 with its memory, clock and reset
+typedef struct {
+	HarnessInstance *inst;
+	MemoryDevice *memory;
+	DsimModel *model;
+	ClockGen *clock;
+	DmaDevice *dma;									// NULL if none
+	TickDevice *tick;								// NULL if none
+	UINT64 fetches;									// Opcode fetches of the model before measuring
+} tBOARD;
+
+// Runs opt->boards copies of the program side by side in one circuit. The
+// counts are summed over the boards, so with linear scaling the sim MHz
+// (aggregate) stays flat as boards are added.
+static VOID run(const char *name, const UINT8 *image, UINT size, INT (*expect)(const UINT8 *), const tOPTIONS *opt, tRESULT *res) {
+	HarnessCkt ckt;
+	std::vector<tBOARD> boards(opt->boards);
+	RELTIME period = (RELTIME)(1e12 / opt->clock);
+	UINT running = opt->boards;
+	UINT64 c0 = 0, l0 = 0, i0 = 0, s0 = 0;
+	BOOL finished;
+	double t0;
+	char id[16];
+	char image_file[] = "/tmp/vsmz80benchXXXXXX";
+	UINT n;
+
+	if (opt->internal) {							// The model loads its memory from a file
+		int fd = mkstemp(image_file);
+		FILE *f = (fd < 0) ? NULL : fdopen(fd, "wb");
+		if (f == NULL || fwrite(image, 1, size, f) != size) {
+			fprintf(stderr, "cannot write '%s'\n", image_file);
+			exit(2);
+		}
+		fclose(f);
+	}
+
+	for (n = 0; n < opt->boards; n++) {
+		tBOARD *b = &boards[n];
+
+		snprintf(id, sizeof(id), "U%u", n + 1);
+		b->inst = new HarnessInstance(&ckt, id);
+		for (size_t i = 0; i < opt->props.size(); i++)
+			b->inst->SetProp(opt->props[i].first.c_str(), opt->props[i].second.c_str());
+		if (opt->modelclock) {
+			snprintf(id, sizeof(id), "%g", opt->clock);
+			b->inst->SetProp("CLOCK", id);
+		}
+		if (opt->internal) {
+			b->inst->SetProp("INTERNALMEM", "1");
+			b->inst->SetProp("PROGRAM", image_file);
+			b->inst->SetProp("ROMSIZE", "8000");
+		}
+		b->inst->popup.verbose = opt->verbose;
+		if (opt->profile != NULL) {
+			std::string path = std::string(opt->profile) + "." + name;
+			if (opt->boards > 1) path += "." + std::string(id);
+			b->inst->SetProp("PROFILE", path.c_str());
+		}
+
+		b->memory = new MemoryDevice(&ckt, b->inst, 0x8000);
+		memcpy(b->memory->mem, image, size > 0x10000 ? 0x10000 : size);
+		b->memory->running = &running;
+		b->memory->waitstates = opt->waitstates;
+		b->memory->period = period;
+		b->memory->ports[PORT_TICKS] = opt->tick_every != 0 ? TICKS_WAITED : 0;
+
+		b->model = new DsimModel;
+		b->inst->model = b->model;
+		b->model->setup(b->inst, &ckt);
+		b->model->runctrl(RM_START);
+
+		b->clock = new ClockGen(&ckt, opt->modelclock ? NULL : b->inst->Pin("CLK"), b->inst->Pin("$RESET$"), period);
+		b->clock->Start(0, 4);
+		b->dma = NULL;
+		if (opt->dma_every != 0) {
+			b->dma = new DmaDevice(&ckt, b->inst, period, opt->dma_every, opt->dma_hold);
+			b->dma->Start(0);
+		}
+		b->tick = NULL;
+		if (opt->tick_every != 0) {
+			b->tick = new TickDevice(&ckt, b->inst, period, opt->tick_every, opt->tick_nmi);
+			b->tick->Start(0);
+		}
+	}
+	if (opt->internal) remove(image_file);
+
+	// Measure from the release of RESET (period / 4 + 4 periods), before the edge that runs the first instruction,
+	// so that a QUANTUM run ahead on that edge is counted like the rest
+	ckt.Run(4 * period + period / 2 - 1);
+	ckt.ResetStats();
+	for (n = 0; n < opt->boards; n++) {
+		boards[n].memory->m1cycles = 0;
+		c0 += opt->modelclock ? ckt.now / period : boards[n].clock->cycles;
+		l0 += boards[n].inst->popup.lines;
+		i0 += boards[n].model->GetBus().issued;
+		s0 += boards[n].model->GetBus().suppressed;
+		boards[n].fetches = boards[n].model->GetCore().fetches;
+	}
+
+	t0 = walltime();
+	finished = ckt.Run((ABSTIME)(4 + 2 + opt->maxtstates) * period);
+	t0 = walltime() - t0;
+
+	memset(res, 0, sizeof(*res));
+	res->wall = t0;
+	res->name = name;
+	res->boards = opt->boards;
+	res->finished = finished;
+	res->stats = ckt.stats;
+	res->result = boards[0].memory->result;
+	if (boards[0].model->GetMemory() != NULL) {		// Internal pages from the model, the others from the harness
+		const DsimBus &bus = boards[0].model->GetBus();
+		for (UINT a = 0; a < 0x10000; a++)
+			if (bus.Internal((UINT16)a)) boards[0].memory->mem[a] = boards[0].model->GetMemory()[a];
+	}
+	res->expected = expect ? expect(boards[0].memory->mem) : -1;
+	for (n = 0; n < opt->boards; n++) {
+		tBOARD *b = &boards[n];
+
+		b->model->runctrl(RM_STOP);
+		res->tstates += opt->modelclock ? ckt.now / period : b->clock->cycles;
+		res->instrs += b->model->GetCore().fetches - b->fetches;	// Internal fetches have no M1 on the pins
+		res->loglines += b->inst->popup.lines;
+		res->issued += b->model->GetBus().issued;
+		res->suppressed += b->model->GetBus().suppressed;
+		res->blk_hits += b->model->GetCore().blk_hits;
+		res->blk_misses += b->model->GetCore().blk_misses;
+		res->blk_invalidations += b->model->GetCore().blk_invalidations;
+		res->jit_runs += b->model->GetCore().jit_runs;
+		if (b->dma != NULL) res->dma_grants += b->dma->grants;
+		if (b->tick != NULL) {
+			res->ticks += b->tick->ticks;
+			res->acks += b->tick->acks;
+			res->tick_nmi = opt->tick_nmi;
+		}
+		if (b->model->GetCore().Profile() != NULL) {
+			UINT64 instrs;
+			res->prof_tstates += b->model->GetCore().Profile()->Total(&instrs);
+			res->prof_instrs += instrs;
+		}
+		if (b->memory->result != res->result) res->result = -1;	// Boards disagree
+		delete b->model;
+		delete b->clock;
+		delete b->dma;
+		delete b->tick;
+		delete b->memory;
+		delete b->inst;
+	}
+	res->tstates -= c0;
+	res->loglines -= l0;
+	res->issued -= i0;
+	res->suppressed -= s0;
+}
+
+// Memory array bus with the harness result/exit ports
+class BenchBus : public Z80MemoryBus
+{
+public:
+	void IOWrite(UINT16 addr, UINT8 val) {
+		if ((addr & 0xFF) == PORT_RESULT) result = val;
+		else if ((addr & 0xFF) == PORT_EXIT) exited = TRUE;
+	}
+	UINT8 IORead(UINT16 addr) { return (addr & 0xFF) == PORT_TICKS ? 0 : 0xFF; }	// No timer
+	void SetHigh(UINT8, ABSTIME) {}						// No HALT pin, for Accept()
+
+	INT result;
+	BOOL exited;
+};
+
+template <bool LAZYFLAGS>
+static VOID run_core(const char *name, const UINT8 *image, UINT size, INT (*expect)(const UINT8 *), const tOPTIONS *opt, tRESULT *res) {
+	Z80Core<BenchBus, LAZYFLAGS> *core = new Z80Core<BenchBus, LAZYFLAGS>;
+	UINT64 tstates = 0;
+	double t0;
+
+	memset(core->bus.mem, 0, sizeof(core->bus.mem));
+	memcpy(core->bus.mem, image, size > 0x10000 ? 0x10000 : size);
+	core->bus.result = -1;
+	core->bus.exited = FALSE;
+	memset(&core->reg, 0, sizeof(core->reg));			// ResetCPU() needs the pins, so clear the registers here
+	core->EnableCache(opt->cache != FALSE);
+	if (opt->jit && !core->EnableJit(true)) fprintf(stderr, "no JIT on this host, interpreting\n");
+	if (opt->profile != NULL) core->EnableProfile(true);
+
+	t0 = walltime();
+	if (opt->jit) {
+		while (!core->bus.exited && tstates < opt->maxtstates) {
+			if (core->IntPending) core->Accept(0);		// No interrupt lines, clears what EI and RETI/RETN left
+			tstates += core->StepBlock();
+		}
+	}
+	else {
+		while (!core->bus.exited && tstates < opt->maxtstates) tstates += core->Step();
+	}
+	t0 = walltime() - t0;
+
+	memset(res, 0, sizeof(*res));
+	res->wall = t0;
+	res->name = name;
+	res->tstates = tstates;
+	res->instrs = core->fetches;
+	res->blk_hits = core->blk_hits;
+	res->blk_misses = core->blk_misses;
+	res->blk_invalidations = core->blk_invalidations;
+	res->jit_runs = core->jit_runs;
+	res->result = core->bus.result;
+	res->expected = expect ? expect(core->bus.mem) : -1;
+	res->finished = core->bus.exited;
+	if (opt->profile != NULL) {
+		std::string path = std::string(opt->profile) + "." + name;
+		res->prof_tstates = core->Profile()->Total(&res->prof_instrs);
+		if (!core->Profile()->Save(path.c_str(), name)) fprintf(stderr, "cannot write '%s'\n", path.c_str());
+	}
+	delete core;
+}
+
+static VOID report_header(void) {
+	printf("%-8s %12s %10s %9s %8s %12s %8s %10s %8s %8s %8s  %s\n",
+		"program", "T-states", "M1", "wall ms", "sim MHz", "events", "ev/M1", "handlers", "drv/M1", "skip/M1", "log/M1", "result");
+}
+
+static VOID report(const tRESULT *r) {
+	double m1 = r->instrs ? (double)r->instrs : 1.0;
+	char name[32], result[32];
+
+	if (!r->finished) snprintf(result, sizeof(result), "TIMEOUT");
+	else if (r->expected == -1) snprintf(result, sizeof(result), "0x%02X", r->result & 0xFF);
+	else if (r->result == r->expected) snprintf(result, sizeof(result), "0x%02X ok", r->result);
+	else snprintf(result, sizeof(result), "0x%02X MISMATCH (0x%02X)", r->result & 0xFF, r->expected & 0xFF);
+
+	if (r->boards > 1) snprintf(name, sizeof(name), "%s x%u", r->name, r->boards);
+	else snprintf(name, sizeof(name), "%s", r->name);
+
+	printf("%-8s %12llu %10llu %9.1f %8.3f %12llu %8.1f %10llu %8.1f %8.1f %8.1f  %s\n",
+		name,
+		(unsigned long long)r->tstates,
+		(unsigned long long)r->instrs,
+		r->wall * 1e3,
+		r->wall > 0 ? r->tstates / r->wall / 1e6 : 0.0,
+		(unsigned long long)r->stats.posted,
+		r->stats.posted / m1,
+		(unsigned long long)r->stats.handlers,
+		r->issued / m1,
+		r->suppressed / m1,
+		r->loglines / m1,
+		result);
+	if (r->blk_hits + r->blk_misses != 0)
+		printf("%-8s decode cache: %.2f%% hits, %llu misses, %llu page invalidations\n", "",
+			100.0 * r->blk_hits / (r->blk_hits + r->blk_misses), (unsigned long long)r->blk_misses, (unsigned long long)r->blk_invalidations);
+	if (r->jit_runs != 0)
+		printf("%-8s jit: %llu compiled block runs, %.1f M1 per run\n", "",
+			(unsigned long long)r->jit_runs, r->instrs / (double)r->jit_runs);
+	if (r->dma_grants != 0)
+		printf("%-8s dma: %llu bus grants\n", "", (unsigned long long)r->dma_grants);
+	if (r->ticks != 0 && r->tick_nmi)
+		printf("%-8s timer: %llu NMI pulses\n", "", (unsigned long long)r->ticks);
+	else if (r->ticks != 0)
+		printf("%-8s timer: %llu interrupts, %llu INT acknowledges\n", "", (unsigned long long)r->ticks, (unsigned long long)r->acks);
+	if (r->prof_tstates != 0)
+		printf("%-8s profile: %llu T-states in %llu instructions\n", "", (unsigned long long)r->prof_tstates, (unsigned long long)r->prof_instrs);
+}
+
+static VOID usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [options]\n", argv0);
+	fprintf(stderr, "  -p NAME        run a built-in program (repeatable, default all)\n");
+	fprintf(stderr, "  -f FILE        run a raw binary image loaded at 0000h\n");
+	fprintf(stderr, "  -c MHZ         clock frequency (default 4)\n");
+	fprintf(stderr, "  -t TSTATES     give up after this many T-states (default 20000000)\n");
+	fprintf(stderr, "  -D NAME=VALUE  set a component property\n");
+	fprintf(stderr, "  -b             run the bare core against a memory array (no DSIM)\n");
+	fprintf(stderr, "  -L             with -b, build F lazily (Z80_LAZYFLAGS policy)\n");
+	fprintf(stderr, "  -C             with -b, keep decoded blocks (DECODECACHE, on by default with -i)\n");
+	fprintf(stderr, "  -J             with -b, compile the hot blocks to host code (JIT, x86-64 only)\n");
+	fprintf(stderr, "  -i             load the program into the model (INTERNALMEM), only I/O uses the pins\n");
+	fprintf(stderr, "  -M             the model generates its clock (CLOCK property), the CLK net is not driven\n");
+	fprintf(stderr, "  -w WAITS       hold WAIT low for this many wait states in every memory and I/O cycle on the pins\n");
+	fprintf(stderr, "  -q EVERY,HOLD  a DMA controller takes the bus for HOLD T-states, EVERY T-states after it gave it back\n");
+	fprintf(stderr, "  -I TSTATES     a timer pulls INT low every TSTATES T-states, until the acknowledge\n");
+	fprintf(stderr, "  -N TSTATES     the timer pulses NMI instead\n");
+	fprintf(stderr, "  -P PREFIX      profile every PC (PROFILE property), callgrind files PREFIX.<program>\n");
+	fprintf(stderr, "  -n BOARDS      simulate this many Z80s side by side in one circuit (default 1)\n");
+	fprintf(stderr, "  -v             echo the debug popup to stdout\n");
+	fprintf(stderr, "  -l             list built-in programs\n");
+}
+
+int main(int argc, char **argv) {
+	tOPTIONS opt;
+	std::vector<const tPROGRAM *> progs;
+	const char *file = NULL;
+	BOOL failed = FALSE;
+	tRESULT res;
+	VOID (*runfn)(const char *, const UINT8 *, UINT, INT (*)(const UINT8 *), const tOPTIONS *, tRESULT *);
+	int i;
+
+	opt.clock = 4e6;
+	opt.maxtstates = 20000000;
+	opt.verbose = FALSE;
+	opt.batch = FALSE;
+	opt.lazy = FALSE;
+	opt.boards = 1;
+	opt.internal = FALSE;
+	opt.cache = FALSE;
+	opt.jit = FALSE;
+	opt.modelclock = FALSE;
+	opt.waitstates = 0;
+	opt.dma_every = opt.dma_hold = 0;
+	opt.tick_every = 0;
+	opt.tick_nmi = FALSE;
+	opt.profile = NULL;
+
+	for (i = 1; i < argc; i++) {
+		const char *a = argv[i];
+		if (!strcmp(a, "-p") && i + 1 < argc) {
+			const tPROGRAM *p = FindProgram(argv[++i]);
+			if (p == NULL) {
+				fprintf(stderr, "unknown program '%s'\n", argv[i]);
+				return 2;
+			}
+			progs.push_back(p);
+		}
+		else if (!strcmp(a, "-f") && i + 1 < argc) file = argv[++i];
+		else if (!strcmp(a, "-c") && i + 1 < argc) opt.clock = atof(argv[++i]) * 1e6;
+		else if (!strcmp(a, "-t") && i + 1 < argc) opt.maxtstates = strtoull(argv[++i], NULL, 0);
+		else if (!strcmp(a, "-D") && i + 1 < argc) {
+			std::string d = argv[++i];
+			size_t eq = d.find('=');
+			if (eq == std::string::npos) opt.props.push_back(std::make_pair(d, std::string("1")));
+			else opt.props.push_back(std::make_pair(d.substr(0, eq), d.substr(eq + 1)));
+		}
+		else if (!strcmp(a, "-v")) opt.verbose = TRUE;
+		else if (!strcmp(a, "-b")) opt.batch = TRUE;
+		else if (!strcmp(a, "-L")) opt.lazy = TRUE;
+		else if (!strcmp(a, "-i")) opt.internal = TRUE;
+		else if (!strcmp(a, "-C")) opt.cache = TRUE;
+		else if (!strcmp(a, "-J")) opt.jit = TRUE;
+		else if (!strcmp(a, "-M")) opt.modelclock = TRUE;
+		else if (!strcmp(a, "-w") && i + 1 < argc) opt.waitstates = atoi(argv[++i]);
+		else if (!strcmp(a, "-q") && i + 1 < argc) {
+			if (sscanf(argv[++i], "%u,%u", &opt.dma_every, &opt.dma_hold) != 2 || opt.dma_every == 0) {
+				usage(argv[0]);
+				return 2;
+			}
+		}
+		else if ((!strcmp(a, "-I") || !strcmp(a, "-N")) && i + 1 < argc) {
+			opt.tick_every = atoi(argv[++i]);
+			opt.tick_nmi = a[1] == 'N';
+		}
+		else if (!strcmp(a, "-P") && i + 1 < argc) opt.profile = argv[++i];
+		else if (!strcmp(a, "-n") && i + 1 < argc) opt.boards = atoi(argv[++i]) > 1 ? atoi(argv[i]) : 1;
+		else if (!strcmp(a, "-l")) {
+			for (int n = 0; n < numprograms; n++) printf("%-8s %s\n", programs[n].name, programs[n].desc);
+			return 0;
+		}
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	runfn = !opt.batch ? run : opt.lazy ? run_core<true> : run_core<false>;
+	report_header();
+	if (file != NULL) {
+		static UINT8 image[0x10000];
+		FILE *f = fopen(file, "rb");
+		size_t n;
+		if (f == NULL) {
+			fprintf(stderr, "cannot open '%s'\n", file);
+			return 2;
+		}
+		n = fread(image, 1, sizeof(image), f);
+		fclose(f);
+		runfn(file, image, (UINT)n, NULL, &opt, &res);
+		report(&res);
+		failed |= !res.finished;
+	}
+	else {
+		if (progs.empty())
+			for (i = 0; i < numprograms; i++) progs.push_back(&programs[i]);
+		for (size_t n = 0; n < progs.size(); n++) {
+			runfn(progs[n]->name, progs[n]->code, progs[n]->size, progs[n]->expect, &opt, &res);
+			report(&res);
+			failed |= !res.finished || (res.expected != -1 && res.result != res.expected);
+		}
+	}
+	return failed ? 1 : 0;
+}